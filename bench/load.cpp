@@ -0,0 +1,507 @@
+///////////////////////////////////////////////////////////////////////////////////////////////////
+//                                                                                               //
+// Copyright 2017 Benoît CORTIER                                                                 //
+//                                                                                               //
+// This file is part of RUDP project which is released under the                                 //
+// European Union Public License v1.1. If a copy of the EUPL was                                 //
+// not distributed with this software, you can obtain one at :                                   //
+// https://joinup.ec.europa.eu/community/eupl/og_page/european-union-public-licence-eupl-v11     //
+//                                                                                               //
+///////////////////////////////////////////////////////////////////////////////////////////////////
+
+// Load generator: a server echoing everything it receives, and thousands of clients spread over a few
+// threads, all on loopback. Each client keeps `window` messages in flight and sends a new one for each
+// echo it gets back.
+//
+// Every combination of the given peer counts, payload sizes and handler costs is run in turn, and
+// reported as one JSON object per line: pps, goodput, round trip percentiles, CPU per packet.
+//
+//   bench_load --peers 1,100,1000 --payload 64,1200 --handler-ns 0,2000 --label "$(git rev-parse --short HEAD)"
+//
+// Each client is a rudp::Socket with its own UDP port: thousands of peers need as many file descriptors
+// (the soft limit is raised to the hard one).
+//
+// --loss, --burst, --duplicate, --bandwidth-mbps, --delay-ms, --jitter-ms and --reorder impair both
+// directions (see rudp::Impairment), with decisions drawn from --seed: the round trip time gets twice
+// the delay.
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <memory>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <pthread.h>
+#include <sys/resource.h>
+#include <time.h>
+
+#include <boost/asio.hpp>
+
+#include "RUDP/ImpairedTransport.hpp"
+#include "RUDP/Metrics.hpp"
+#include "RUDP/Socket.hpp"
+#include "RUDP/WireFormat.hpp"
+
+using boost::asio::ip::udp;
+using clock_type = rudp::clock_type;
+
+namespace {
+	// Payload: send time and epoch of the client, echoes of an older epoch are ignored.
+	const size_t MIN_PAYLOAD = sizeof(uint64_t) + sizeof(uint32_t);
+	const size_t BUFFER_SIZE = 2048;
+	const std::chrono::milliseconds LOSS_TIMEOUT(500);
+	const std::chrono::seconds CONNECT_TIMEOUT(30);
+
+	struct Config {
+		std::vector<size_t> peers = { 1, 100, 1000 };
+		std::vector<size_t> payloads = { 64, 1024 };
+		std::vector<size_t> handler_ns = { 0 };
+		std::string header = "basic";
+		size_t window = 1;
+		size_t client_threads = 2;
+		size_t batch_size = 1;
+		bool io_uring = false;
+		double warmup = 0.5; // seconds
+		double duration = 2.0;
+		unsigned short port = 24000;
+		std::string label;
+		std::string output = "-";
+		rudp::Impairment impairment;
+		bool impaired = false;
+	};
+
+	struct Run {
+		size_t peers;
+		size_t payload;
+		size_t handler_ns;
+	};
+
+	std::vector<size_t> parse_list(const std::string& value) {
+		std::vector<size_t> list;
+		std::istringstream stream(value);
+		std::string item;
+		while (std::getline(stream, item, ',')) {
+			list.push_back(std::stoul(item));
+		}
+		return list;
+	}
+
+	Config parse_arguments(int argc, char* argv[]) {
+		Config config;
+		for (int i = 1; i < argc; ++i) {
+			const std::string name = argv[i];
+			if (i + 1 >= argc) {
+				throw std::invalid_argument("Missing value for " + name);
+			}
+			const std::string value = argv[++i];
+			if (name == "--peers") {
+				config.peers = parse_list(value);
+			} else if (name == "--payload") {
+				config.payloads = parse_list(value);
+			} else if (name == "--handler-ns") {
+				config.handler_ns = parse_list(value);
+			} else if (name == "--header") {
+				config.header = value;
+			} else if (name == "--window") {
+				config.window = std::stoul(value);
+			} else if (name == "--client-threads") {
+				config.client_threads = std::max<size_t>(1, std::stoul(value));
+			} else if (name == "--batch") {
+				config.batch_size = std::stoul(value);
+			} else if (name == "--io-uring") {
+				config.io_uring = value != "0";
+			} else if (name == "--warmup") {
+				config.warmup = std::stod(value);
+			} else if (name == "--duration") {
+				config.duration = std::stod(value);
+			} else if (name == "--port") {
+				config.port = static_cast<unsigned short>(std::stoul(value));
+			} else if (name == "--label") {
+				config.label = value;
+			} else if (name == "--output") {
+				config.output = value;
+			} else if (name == "--loss") {
+				config.impairment.loss = std::stod(value);
+			} else if (name == "--burst") {
+				config.impairment.mean_burst_length = std::stod(value);
+			} else if (name == "--duplicate") {
+				config.impairment.duplicate = std::stod(value);
+			} else if (name == "--bandwidth-mbps") {
+				config.impairment.bandwidth = static_cast<uint64_t>(std::stod(value) * 1000000);
+			} else if (name == "--delay-ms") {
+				config.impairment.delay = std::chrono::duration_cast<clock_type::duration>(
+					std::chrono::duration<double, std::milli>(std::stod(value)));
+			} else if (name == "--jitter-ms") {
+				config.impairment.jitter = std::chrono::duration_cast<clock_type::duration>(
+					std::chrono::duration<double, std::milli>(std::stod(value)));
+			} else if (name == "--reorder") {
+				config.impairment.reorder = std::stod(value);
+			} else if (name == "--seed") {
+				config.impairment.seed = std::stoull(value);
+			} else {
+				throw std::invalid_argument("Unknown option " + name);
+			}
+			config.impaired = config.impaired || name == "--loss" || name == "--burst" || name == "--duplicate"
+			                  || name == "--bandwidth-mbps" || name == "--delay-ms" || name == "--jitter-ms"
+			                  || name == "--reorder";
+		}
+		return config;
+	}
+
+	void raise_file_limit() {
+		rlimit limit;
+		if (getrlimit(RLIMIT_NOFILE, &limit) == 0 && limit.rlim_cur < limit.rlim_max) {
+			limit.rlim_cur = limit.rlim_max;
+			setrlimit(RLIMIT_NOFILE, &limit);
+		}
+	}
+
+	uint64_t to_ns(clock_type::duration duration) {
+		return static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(duration).count());
+	}
+
+	uint64_t process_cpu_ns() {
+		rusage usage;
+		getrusage(RUSAGE_SELF, &usage);
+		return (uint64_t(usage.ru_utime.tv_sec) + uint64_t(usage.ru_stime.tv_sec)) * 1000000000
+		       + (uint64_t(usage.ru_utime.tv_usec) + uint64_t(usage.ru_stime.tv_usec)) * 1000;
+	}
+
+	uint64_t thread_cpu_ns(std::thread& thread) {
+		clockid_t clock;
+		timespec time;
+		if (pthread_getcpuclockid(thread.native_handle(), &clock) != 0 || clock_gettime(clock, &time) != 0) {
+			return 0;
+		}
+		return uint64_t(time.tv_sec) * 1000000000 + uint64_t(time.tv_nsec);
+	}
+
+	void spin_for(size_t ns) {
+		if (ns == 0) {
+			return;
+		}
+		const clock_type::time_point end = clock_type::now() + std::chrono::nanoseconds(ns);
+		while (clock_type::now() < end) {
+		}
+	}
+
+	// Echoes every message back to its sender after spinning for the handler cost.
+	template <typename Header>
+	class Server {
+	public:
+		Server(const Config& config, size_t handler_ns)
+			: m_socket(m_io_service, BUFFER_SIZE, config.batch_size, { udp::v4(), config.port })
+			, m_handler_ns(handler_ns)
+		{
+			if (config.io_uring && !m_socket.use_io_uring()) {
+				std::cerr << "io_uring not available, running on asio" << std::endl;
+			}
+			if (config.impaired) {
+				m_socket.impair(config.impairment);
+			}
+			m_socket.set_challenge_rate(1000000); // lets thousands of clients in at once
+			m_socket.set_receive_handler([this](const rudp::PacketView<Header>& packet, size_t, const rudp::Peer& peer) {
+				spin_for(m_handler_ns);
+				const rudp::ByteSpan message = packet.get_message();
+				rudp::SendBuffer buffer = m_socket.acquire_send_buffer(rudp::header_size<Header>() + message.size());
+				const size_t header_size = rudp::WireFormat<Header>::write(buffer.data(), Header(m_socket.self().uuid));
+				std::memcpy(buffer.data() + header_size, message.data(), message.size());
+				buffer.resize(header_size + message.size());
+				m_socket.async_send_to(std::move(buffer), peer);
+			});
+			m_thread = std::thread([this]() { m_io_service.run(); });
+		}
+
+		~Server() {
+			m_io_service.stop();
+			m_thread.join();
+		}
+
+		const rudp::SocketMetrics& metrics() const noexcept { return m_socket.metrics(); }
+
+		uint64_t cpu_ns() { return thread_cpu_ns(m_thread); }
+
+	private:
+		boost::asio::io_service m_io_service;
+		rudp::Socket<Header, rudp::SocketMetrics> m_socket;
+		size_t m_handler_ns;
+		std::thread m_thread;
+	};
+
+	// Clients sharing a thread and its io_service.
+	template <typename Header>
+	class ClientGroup {
+	public:
+		ClientGroup(const Config& config, size_t first, size_t count, size_t payload, std::atomic<bool>& measuring,
+		            std::atomic<size_t>& connected)
+			: m_loss_timer(m_io_service)
+			, m_clients(count)
+			, m_payload(std::max(payload, MIN_PAYLOAD))
+			, m_window(config.window)
+			, m_measuring(measuring)
+			, m_connected(connected)
+		{
+			for (Client& client : m_clients) {
+				client.socket.reset(new rudp::Socket<Header>(m_io_service, BUFFER_SIZE));
+				if (config.impaired) {
+					rudp::Impairment impairment = config.impairment;
+					impairment.seed += 1 + first++; // the server draws from the seed itself
+					client.socket->impair(impairment);
+				}
+				Client* self = &client;
+				client.socket->set_connection_handler([this, self](const rudp::Peer& peer) {
+					self->server = peer.handle;
+					++m_connected;
+					fill_window(*self);
+				});
+				client.socket->set_receive_handler([this, self](const rudp::PacketView<Header>& packet, size_t,
+				                                                const rudp::Peer&) {
+					on_echo(*self, packet.get_message());
+				});
+			}
+		}
+
+		~ClientGroup() {
+			m_io_service.stop();
+			if (m_thread.joinable()) {
+				m_thread.join();
+			}
+		}
+
+		void start(udp::endpoint server) {
+			for (Client& client : m_clients) {
+				client.socket->connect(server);
+			}
+			start_loss_timer();
+			m_thread = std::thread([this]() { m_io_service.run(); });
+		}
+
+		uint64_t echoes() const noexcept { return m_echoes.load(); }
+		uint64_t echoed_bytes() const noexcept { return m_echoed_bytes.load(); }
+		uint64_t lost() const noexcept { return m_lost.load(); }
+		rudp::HistogramSnapshot rtt() const noexcept { return m_rtt.snapshot(); }
+
+	private:
+		struct Client {
+			std::unique_ptr<rudp::Socket<Header>> socket;
+			rudp::PeerHandle server;
+			size_t in_flight = 0;
+			uint32_t epoch = 0;
+			clock_type::time_point last_activity;
+		};
+
+		void send(Client& client) {
+			const rudp::Peer* server = client.socket->get_peer(client.server);
+			if (!server) {
+				return;
+			}
+			const size_t header_size = rudp::header_size<Header>();
+			rudp::SendBuffer buffer = client.socket->acquire_send_buffer(header_size + m_payload);
+			rudp::WireFormat<Header>::write(buffer.data(), Header(client.socket->self().uuid));
+			std::memset(buffer.data() + header_size, 0, m_payload);
+			rudp::wire::write_le<uint64_t>(buffer.data() + header_size, to_ns(clock_type::now().time_since_epoch()));
+			rudp::wire::write_le<uint32_t>(buffer.data() + header_size + sizeof(uint64_t), client.epoch);
+			client.socket->async_send_to(std::move(buffer), *server);
+			++client.in_flight;
+		}
+
+		void fill_window(Client& client) {
+			client.last_activity = clock_type::now();
+			while (client.in_flight < m_window) {
+				send(client);
+			}
+		}
+
+		void on_echo(Client& client, rudp::ByteSpan message) {
+			if (message.size() < MIN_PAYLOAD
+			    || rudp::wire::read_le<uint32_t>(message.data() + sizeof(uint64_t)) != client.epoch) {
+				return;
+			}
+			const clock_type::time_point now = clock_type::now();
+			if (m_measuring.load(std::memory_order_relaxed)) {
+				const uint64_t sent = rudp::wire::read_le<uint64_t>(message.data());
+				m_rtt.record(std::chrono::nanoseconds(to_ns(now.time_since_epoch()) - sent));
+				m_echoes.add();
+				m_echoed_bytes.add(message.size());
+			}
+			--client.in_flight;
+			client.last_activity = now;
+			send(client);
+		}
+
+		// Windows silent for LOSS_TIMEOUT are presumed lost and sent again.
+		void start_loss_timer() {
+			m_loss_timer.expires_from_now(boost::posix_time::milliseconds(LOSS_TIMEOUT.count() / 2));
+			m_loss_timer.async_wait([this](const boost::system::error_code& ec) {
+				if (ec) {
+					return;
+				}
+				const clock_type::time_point now = clock_type::now();
+				for (Client& client : m_clients) {
+					if (client.socket->get_peer(client.server) && client.in_flight > 0 && now - client.last_activity >= LOSS_TIMEOUT) {
+						m_lost.add(client.in_flight);
+						client.in_flight = 0;
+						++client.epoch;
+						fill_window(client);
+					}
+				}
+				start_loss_timer();
+			});
+		}
+
+		boost::asio::io_service m_io_service;
+		boost::asio::deadline_timer m_loss_timer;
+		std::vector<Client> m_clients;
+		size_t m_payload;
+		size_t m_window;
+		std::atomic<bool>& m_measuring;
+		std::atomic<size_t>& m_connected;
+		rudp::Histogram m_rtt;
+		rudp::Counter m_echoes;
+		rudp::Counter m_echoed_bytes;
+		rudp::Counter m_lost;
+		std::thread m_thread;
+	};
+
+	void sleep_for(double seconds) {
+		std::this_thread::sleep_for(std::chrono::duration<double>(seconds));
+	}
+
+	double us(clock_type::duration duration) {
+		return std::chrono::duration<double, std::micro>(duration).count();
+	}
+
+	template <typename Header>
+	void run(const Config& config, const Run& run, std::ostream& output) {
+		Server<Header> server(config, run.handler_ns);
+
+		std::atomic<bool> measuring(false);
+		std::atomic<size_t> connected(0);
+		const size_t thread_count = std::min(config.client_threads, run.peers);
+		std::vector<std::unique_ptr<ClientGroup<Header>>> groups;
+		for (size_t i = 0, first = 0; i < thread_count; ++i) {
+			const size_t count = run.peers / thread_count + (i < run.peers % thread_count ? 1 : 0);
+			groups.emplace_back(new ClientGroup<Header>(config, first, count, run.payload, measuring, connected));
+			first += count;
+		}
+		const udp::endpoint server_endpoint(boost::asio::ip::address_v4::loopback(), config.port);
+		for (auto& group : groups) {
+			group->start(server_endpoint);
+		}
+
+		const clock_type::time_point connect_deadline = clock_type::now() + CONNECT_TIMEOUT;
+		while (connected.load() < run.peers && clock_type::now() < connect_deadline) {
+			sleep_for(0.01);
+		}
+		sleep_for(config.warmup);
+
+		const rudp::MetricsSnapshot server_before = server.metrics().snapshot();
+		const uint64_t server_cpu_before = server.cpu_ns();
+		const uint64_t process_cpu_before = process_cpu_ns();
+		const clock_type::time_point start = clock_type::now();
+		measuring = true;
+		sleep_for(config.duration);
+		measuring = false;
+		const double elapsed = std::chrono::duration<double>(clock_type::now() - start).count();
+		const uint64_t process_cpu = process_cpu_ns() - process_cpu_before;
+		const uint64_t server_cpu = server.cpu_ns() - server_cpu_before;
+		const rudp::MetricsSnapshot server_after = server.metrics().snapshot();
+
+		uint64_t echoes = 0;
+		uint64_t echoed_bytes = 0;
+		uint64_t lost = 0;
+		rudp::HistogramSnapshot rtt;
+		for (const auto& group : groups) {
+			echoes += group->echoes();
+			echoed_bytes += group->echoed_bytes();
+			lost += group->lost();
+			rtt += group->rtt();
+		}
+		const uint64_t server_packets = (server_after.received_packets - server_before.received_packets)
+		                                + (server_after.sent_packets - server_before.sent_packets);
+		uint64_t server_drops = 0;
+		for (size_t i = 0; i < rudp::DROP_REASON_COUNT; ++i) {
+			server_drops += server_after.drops[i] - server_before.drops[i];
+		}
+
+		output << "{\"label\":\"" << config.label << "\""
+		       << ",\"header\":\"" << config.header << "\""
+		       << ",\"peers\":" << run.peers
+		       << ",\"connected\":" << connected.load()
+		       << ",\"payload\":" << std::max(run.payload, MIN_PAYLOAD)
+		       << ",\"handler_ns\":" << run.handler_ns
+		       << ",\"window\":" << config.window
+		       << ",\"loss\":" << config.impairment.loss
+		       << ",\"burst\":" << config.impairment.mean_burst_length
+		       << ",\"duplicate\":" << config.impairment.duplicate
+		       << ",\"bandwidth_bps\":" << config.impairment.bandwidth
+		       << ",\"delay_ms\":" << std::chrono::duration<double, std::milli>(config.impairment.delay).count()
+		       << ",\"jitter_ms\":" << std::chrono::duration<double, std::milli>(config.impairment.jitter).count()
+		       << ",\"reorder\":" << config.impairment.reorder
+		       << ",\"seed\":" << config.impairment.seed
+		       << ",\"client_threads\":" << thread_count
+		       << ",\"duration_s\":" << elapsed
+		       << ",\"echoes\":" << echoes
+		       << ",\"echoes_per_s\":" << echoes / elapsed
+		       << ",\"server_pps\":" << server_packets / elapsed
+		       << ",\"goodput_bytes_per_s\":" << echoed_bytes / elapsed
+		       << ",\"rtt_mean_us\":" << us(rtt.mean())
+		       << ",\"rtt_p50_us\":" << us(rtt.percentile(0.5))
+		       << ",\"rtt_p99_us\":" << us(rtt.percentile(0.99))
+		       << ",\"rtt_p999_us\":" << us(rtt.percentile(0.999))
+		       << ",\"lost\":" << lost
+		       << ",\"server_drops\":" << server_drops
+		       << ",\"server_cpu_ns_per_packet\":" << (server_packets ? double(server_cpu) / server_packets : 0.0)
+		       << ",\"process_cpu_ns_per_echo\":" << (echoes ? double(process_cpu) / echoes : 0.0)
+		       << "}" << std::endl;
+
+		groups.clear(); // clients stop before the server
+	}
+}
+
+int main(int argc, char* argv[]) {
+	Config config;
+	try {
+		config = parse_arguments(argc, argv);
+	} catch (const std::exception& e) {
+		std::cerr << e.what() << std::endl;
+		return EXIT_FAILURE;
+	}
+	raise_file_limit();
+
+	std::ofstream file;
+	if (config.output != "-") {
+		file.open(config.output, std::ios::app);
+	}
+	std::ostream& output = config.output != "-" ? file : std::cout;
+
+	for (size_t peers : config.peers) {
+		for (size_t payload : config.payloads) {
+			for (size_t handler_ns : config.handler_ns) {
+				const Run current = { peers, payload, handler_ns };
+				std::cerr << "peers " << peers << ", payload " << payload << ", handler " << handler_ns << " ns" << std::endl;
+				if (config.header == "basic") {
+					run<rudp::BasicHeader>(config, current, output);
+				} else if (config.header == "reliable") {
+					run<rudp::ReliableOrderHeader>(config, current, output);
+				} else if (config.header == "time-critical") {
+					run<rudp::TimeCriticalHeader>(config, current, output);
+				} else {
+					std::cerr << "Unknown header " << config.header << std::endl;
+					return EXIT_FAILURE;
+				}
+			}
+		}
+	}
+
+	return EXIT_SUCCESS;
+}
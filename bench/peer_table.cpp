@@ -0,0 +1,154 @@
+///////////////////////////////////////////////////////////////////////////////////////////////////
+//                                                                                               //
+// Copyright 2017 Benoît CORTIER                                                                 //
+//                                                                                               //
+// This file is part of RUDP project which is released under the                                 //
+// European Union Public License v1.1. If a copy of the EUPL was                                 //
+// not distributed with this software, you can obtain one at :                                   //
+// https://joinup.ec.europa.eu/community/eupl/og_page/european-union-public-licence-eupl-v11     //
+//                                                                                               //
+///////////////////////////////////////////////////////////////////////////////////////////////////
+
+// Compares rudp::PeerTable against the std::vector<rudp::Peer> + std::find_if scan it replaced.
+
+#include <algorithm>
+#include <chrono>
+#include <cstdlib>
+#include <iomanip>
+#include <iostream>
+#include <random>
+#include <vector>
+
+#include <boost/uuid/uuid.hpp>
+#include <boost/uuid/uuid_generators.hpp>
+
+#include "RUDP/Peer.hpp"
+#include "RUDP/PeerTable.hpp"
+
+using boost::asio::ip::udp;
+using clock_type = std::chrono::steady_clock;
+
+namespace {
+	const size_t LOOKUPS = 1000000;
+	const size_t CHURNS = 10000;
+
+	volatile size_t sink;
+
+	double ns_per_op(clock_type::duration duration, size_t operations) {
+		return std::chrono::duration<double, std::nano>(duration).count() / operations;
+	}
+
+	// A distinct endpoint per peer, so that the endpoint index is exercised too.
+	udp::endpoint endpoint_of(size_t index) {
+		return udp::endpoint(boost::asio::ip::address_v4(0x0A000000 + static_cast<uint32_t>(index / 50000)),
+		                     static_cast<unsigned short>(10000 + index % 50000));
+	}
+
+	struct Result {
+		double lookup_ns;
+		double churn_ns;
+	};
+
+	Result bench_vector(const std::vector<boost::uuids::uuid>& uuids, const std::vector<size_t>& order) {
+		std::vector<rudp::Peer> peers;
+		for (const auto& uuid : uuids) {
+			peers.emplace_back(udp::endpoint(), uuid);
+		}
+
+		// Lookups are capped for the linear scan, it would take minutes at 100k peers otherwise.
+		const size_t lookups = std::min(LOOKUPS, LOOKUPS * 1000 / uuids.size());
+		auto start = clock_type::now();
+		for (size_t i = 0; i < lookups; ++i) {
+			const auto& uuid = uuids[order[i % order.size()]];
+			auto it = std::find_if(peers.begin(), peers.end(), [&uuid](const rudp::Peer& peer) { return peer.uuid == uuid; });
+			sink = sink + (it != peers.end());
+		}
+		const double lookup_ns = ns_per_op(clock_type::now() - start, lookups);
+
+		const size_t churns = std::min(CHURNS, CHURNS * 1000 / uuids.size());
+		start = clock_type::now();
+		for (size_t i = 0; i < churns; ++i) {
+			const auto uuid = uuids[order[i % order.size()]];
+			peers.erase(std::remove_if(peers.begin(), peers.end(), [&uuid](const rudp::Peer& peer) {
+				return peer.uuid == uuid;
+			}), peers.end());
+			peers.emplace_back(udp::endpoint(), uuid);
+		}
+		const double churn_ns = ns_per_op(clock_type::now() - start, churns);
+
+		return { lookup_ns, churn_ns };
+	}
+
+	Result bench_table(const std::vector<boost::uuids::uuid>& uuids, const std::vector<size_t>& order) {
+		rudp::PeerTable peers;
+		for (size_t i = 0; i < uuids.size(); ++i) {
+			peers.emplace(endpoint_of(i), uuids[i]);
+		}
+
+		auto start = clock_type::now();
+		for (size_t i = 0; i < LOOKUPS; ++i) {
+			sink = sink + (peers.find(uuids[order[i % order.size()]]) != nullptr);
+		}
+		const double lookup_ns = ns_per_op(clock_type::now() - start, LOOKUPS);
+
+		start = clock_type::now();
+		for (size_t i = 0; i < CHURNS; ++i) {
+			const size_t index = order[i % order.size()];
+			peers.erase(peers.find(uuids[index])->handle);
+			peers.emplace(endpoint_of(index), uuids[index]);
+		}
+		const double churn_ns = ns_per_op(clock_type::now() - start, CHURNS);
+
+		// An erased peer shall no longer be found, and be found again once re-added.
+		for (size_t i = 0; i < uuids.size(); ++i) {
+			const auto& uuid = uuids[i];
+			peers.erase(peers.find(uuid)->handle);
+			if (peers.find(uuid) != nullptr || peers.find(endpoint_of(i)) != nullptr) {
+				std::cerr << "erased peer still found" << std::endl;
+				std::exit(EXIT_FAILURE);
+			}
+			peers.emplace(endpoint_of(i), uuid);
+			if (peers.find(uuid) == nullptr || peers.find(endpoint_of(i)) == nullptr) {
+				std::cerr << "re-added peer not found" << std::endl;
+				std::exit(EXIT_FAILURE);
+			}
+		}
+
+		return { lookup_ns, churn_ns };
+	}
+}
+
+int main() {
+	std::mt19937_64 rng(42);
+	boost::uuids::basic_random_generator<std::mt19937_64> uuid_generator(rng);
+
+	std::cout << std::setw(8) << "peers"
+	          << std::setw(20) << "vector lookup ns"
+	          << std::setw(20) << "table lookup ns"
+	          << std::setw(20) << "vector churn ns"
+	          << std::setw(20) << "table churn ns" << std::endl;
+
+	for (size_t count : { 1000, 10000, 100000 }) {
+		std::vector<boost::uuids::uuid> uuids(count);
+		for (auto& uuid : uuids) {
+			uuid = uuid_generator();
+		}
+
+		std::vector<size_t> order(count);
+		for (size_t i = 0; i < count; ++i) {
+			order[i] = i;
+		}
+		std::shuffle(order.begin(), order.end(), rng);
+
+		const Result vector_result = bench_vector(uuids, order);
+		const Result table_result = bench_table(uuids, order);
+
+		std::cout << std::setw(8) << count << std::fixed << std::setprecision(1)
+		          << std::setw(20) << vector_result.lookup_ns
+		          << std::setw(20) << table_result.lookup_ns
+		          << std::setw(20) << vector_result.churn_ns
+		          << std::setw(20) << table_result.churn_ns << std::endl;
+	}
+
+	return EXIT_SUCCESS;
+}
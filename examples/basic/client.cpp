@@ -29,10 +29,10 @@ using Header = rudp::BasicHeader;
 boost::asio::io_service io_service;
 rudp::Socket<Header> sock(io_service, 512);
 
-void receive_handler(const rudp::Packet<Header>& packet,
+void receive_handler(const rudp::PacketView<Header>& packet,
                      size_t bytes_transferred,
                      const rudp::Peer /*peer*/) {
-	std::string message(packet.get_message().begin(), packet.get_message().begin() + bytes_transferred - sizeof(packet.get_header()));
+	std::string message(packet.get_message().begin(), packet.get_message().end());
 	std::cout << message << std::endl;
 }
 
@@ -76,11 +76,10 @@ int main(int argc, char* argv[]) {
 
 		Header header;
 		header.uuid = sock.self().uuid;
-		size_t packet_size = sizeof(header) + message.size();
-		uint8_t buffer[packet_size];
-		build_buffer(buffer, header, message);
+		rudp::SendBuffer buffer = sock.acquire_send_buffer(rudp::header_size<Header>() + message.size());
+		build_buffer(buffer.data(), header, message);
 
-		sock.async_send_to(buffer, packet_size, remote_endpoint);
+		sock.async_send_to(buffer, remote_endpoint);
 	}
 
 	sock.close();
@@ -28,10 +28,10 @@ using Header = rudp::BasicHeader;
 boost::asio::io_service io_service;
 rudp::Socket<Header> sock(io_service, 512, { udp::v4(), 2000 });
 
-void receive_handler(const rudp::Packet<Header>& packet,
+void receive_handler(const rudp::PacketView<Header>& packet,
 					 size_t bytes_transferred,
                      const rudp::Peer& peer) {
-	std::string message(packet.get_message().begin(), packet.get_message().begin() + bytes_transferred - sizeof(packet.get_header()));
+	std::string message(packet.get_message().begin(), packet.get_message().end());
 	std::cout << boost::uuids::to_string(peer.uuid) << ": " << message << std::endl;
 
 	Header answer_header;
@@ -44,10 +44,9 @@ void receive_handler(const rudp::Packet<Header>& packet,
 	} else {
 		answer_message = boost::uuids::to_string(peer.uuid) + ": " + message;
 	}
-	size_t packet_size = sizeof(answer_header) + answer_message.size();
-	uint8_t buffer[packet_size];
-	build_buffer(buffer, answer_header, answer_message);
-	sock.async_send_to_all(buffer, packet_size);
+	rudp::SendBuffer buffer = sock.acquire_send_buffer(rudp::header_size<Header>() + answer_message.size());
+	build_buffer(buffer.data(), answer_header, answer_message);
+	sock.async_send_to_all(buffer);
 
 	if (stop_server) {
 		sock.close();
@@ -59,11 +58,10 @@ void disconnection_timeout_handler(const rudp::Peer& peer) {
 	Header answer_header;
 	answer_header.uuid = sock.self().uuid;
 	std::string answer_message = boost::uuids::to_string(peer.uuid) + "'s connection has timed out!";
-	size_t packet_size = sizeof(answer_header) + answer_message.size();
-	uint8_t buffer[packet_size];
-	build_buffer(buffer, answer_header, answer_message);
+	rudp::SendBuffer buffer = sock.acquire_send_buffer(rudp::header_size<Header>() + answer_message.size());
+	build_buffer(buffer.data(), answer_header, answer_message);
 
-	sock.async_send_to_all(buffer, packet_size);
+	sock.async_send_to_all(buffer);
 	std::cout << answer_message << std::endl;
 }
 
@@ -71,11 +69,10 @@ void disconnection_handler(const rudp::Peer& peer) {
 	Header answer_header;
 	answer_header.uuid = sock.self().uuid;
 	std::string answer_message = boost::uuids::to_string(peer.uuid) + " disconnected!";
-	size_t packet_size = sizeof(answer_header) + answer_message.size();
-	uint8_t buffer[packet_size];
-	build_buffer(buffer, answer_header, answer_message);
+	rudp::SendBuffer buffer = sock.acquire_send_buffer(rudp::header_size<Header>() + answer_message.size());
+	build_buffer(buffer.data(), answer_header, answer_message);
 
-	sock.async_send_to_all(buffer, packet_size);
+	sock.async_send_to_all(buffer);
 	std::cout << answer_message << std::endl;
 }
 
@@ -83,11 +80,10 @@ void connection_handler(const rudp::Peer& peer) {
 	Header answer_header;
 	answer_header.uuid = sock.self().uuid;
 	std::string answer_message = boost::uuids::to_string(peer.uuid) + " connected!";
-	size_t packet_size = sizeof(answer_header) + answer_message.size();
-	uint8_t buffer[packet_size];
-	build_buffer(buffer, answer_header, answer_message);
+	rudp::SendBuffer buffer = sock.acquire_send_buffer(rudp::header_size<Header>() + answer_message.size());
+	build_buffer(buffer.data(), answer_header, answer_message);
 
-	sock.async_send_to_all(buffer, packet_size);
+	sock.async_send_to_all(buffer);
 	std::cout << answer_message << std::endl;
 }
 
@@ -0,0 +1,213 @@
+///////////////////////////////////////////////////////////////////////////////////////////////////
+//                                                                                               //
+// Copyright 2017 Benoît CORTIER                                                                 //
+//                                                                                               //
+// This file is part of RUDP project which is released under the                                 //
+// European Union Public License v1.1. If a copy of the EUPL was                                 //
+// not distributed with this software, you can obtain one at :                                   //
+// https://joinup.ec.europa.eu/community/eupl/og_page/european-union-public-licence-eupl-v11     //
+//                                                                                               //
+///////////////////////////////////////////////////////////////////////////////////////////////////
+
+#ifndef RELIABLEUDP_BUFFERPOOL_HPP
+#define RELIABLEUDP_BUFFERPOOL_HPP
+
+#include <algorithm> // std::copy
+#include <atomic>
+#include <cstddef> // size_t
+#include <cstdint> // uint8_t, uint32_t
+#include <mutex>
+#include <utility> // std::swap
+#include <vector>
+
+#include <boost/asio/buffer.hpp>
+
+namespace rudp {
+
+// Largest UDP payload fitting in an Ethernet frame without IP fragmentation (1500 - 20 - 8).
+const size_t DEFAULT_MTU = 1472;
+
+namespace detail {
+	struct PoolState;
+
+	struct Slab {
+		explicit Slab(size_t capacity, PoolState* pool)
+			: refs(0)
+			, size(0)
+			, pool(pool)
+			, next_free(nullptr)
+			, data(capacity)
+		{}
+
+		std::atomic<uint32_t> refs;
+		size_t size;
+		PoolState* pool; // nullptr for buffers bigger than the pool's slabs
+		Slab* next_free;
+		std::vector<uint8_t> data;
+	};
+
+	// Outlives the BufferPool as long as some of its slabs are still referenced,
+	// e.g. by a send handler still queued in the io_service.
+	struct PoolState {
+		explicit PoolState(size_t slab_size)
+			: slab_size(slab_size)
+			, free_list(nullptr)
+			, slab_count(0)
+			, closed(false)
+		{}
+
+		~PoolState() {
+			while (free_list) {
+				Slab* slab = free_list;
+				free_list = slab->next_free;
+				delete slab;
+			}
+		}
+
+		Slab* acquire() {
+			std::lock_guard<std::mutex> lock(mutex);
+			if (free_list) {
+				Slab* slab = free_list;
+				free_list = slab->next_free;
+				return slab;
+			}
+			++slab_count;
+			return new Slab(slab_size, this);
+		}
+
+		// Returns true if the state shall be deleted.
+		bool recycle(Slab* slab) {
+			std::lock_guard<std::mutex> lock(mutex);
+			if (closed) {
+				delete slab;
+				return --slab_count == 0;
+			}
+			slab->next_free = free_list;
+			free_list = slab;
+			return false;
+		}
+
+		// Returns true if the state shall be deleted.
+		bool close() {
+			std::lock_guard<std::mutex> lock(mutex);
+			closed = true;
+			while (free_list) {
+				Slab* slab = free_list;
+				free_list = slab->next_free;
+				delete slab;
+				--slab_count;
+			}
+			return slab_count == 0;
+		}
+
+		const size_t slab_size;
+		std::mutex mutex;
+		Slab* free_list;
+		size_t slab_count;
+		bool closed;
+	};
+}
+
+// Reference-counted handle to a send buffer.
+// Copies share the same memory, which goes back to its pool when the last handle is destroyed.
+class SendBuffer {
+public:
+	SendBuffer() noexcept : m_slab(nullptr) {}
+
+	SendBuffer(const SendBuffer& other) noexcept : m_slab(other.m_slab) {
+		if (m_slab) {
+			m_slab->refs.fetch_add(1, std::memory_order_relaxed);
+		}
+	}
+
+	SendBuffer(SendBuffer&& other) noexcept : m_slab(other.m_slab) {
+		other.m_slab = nullptr;
+	}
+
+	SendBuffer& operator=(SendBuffer other) noexcept {
+		std::swap(m_slab, other.m_slab);
+		return *this;
+	}
+
+	~SendBuffer() {
+		release();
+	}
+
+	explicit operator bool() const noexcept { return m_slab != nullptr; }
+
+	// True if no other handle shares the memory: it may then be modified in place.
+	bool unique() const noexcept { return m_slab->refs.load(std::memory_order_acquire) == 1; }
+
+	uint8_t* data() noexcept { return m_slab->data.data(); }
+
+	const uint8_t* data() const noexcept { return m_slab->data.data(); }
+
+	size_t size() const noexcept { return m_slab->size; }
+
+	size_t capacity() const noexcept { return m_slab->data.size(); }
+
+	// The new size shall not exceed the capacity.
+	void resize(size_t size) noexcept { m_slab->size = size; }
+
+	boost::asio::const_buffer buffer() const noexcept { return boost::asio::buffer(data(), size()); }
+
+private:
+	friend class BufferPool;
+
+	explicit SendBuffer(detail::Slab* slab) noexcept : m_slab(slab) {
+		m_slab->refs.store(1, std::memory_order_relaxed);
+	}
+
+	void release() noexcept {
+		if (m_slab && m_slab->refs.fetch_sub(1, std::memory_order_acq_rel) == 1) {
+			detail::PoolState* pool = m_slab->pool;
+			if (!pool) {
+				delete m_slab;
+			} else if (pool->recycle(m_slab)) {
+				delete pool;
+			}
+		}
+		m_slab = nullptr;
+	}
+
+	detail::Slab* m_slab;
+};
+
+// Thread-safe pool of fixed-size send buffers.
+// Slabs are recycled instead of freed, so a steady send rate does not allocate.
+class BufferPool {
+public:
+	explicit BufferPool(size_t slab_size = DEFAULT_MTU) : m_state(new detail::PoolState(slab_size)) {}
+
+	BufferPool(const BufferPool&) = delete;
+
+	BufferPool& operator=(const BufferPool&) = delete;
+
+	~BufferPool() {
+		if (m_state->close()) {
+			delete m_state;
+		}
+	}
+
+	size_t slab_size() const noexcept { return m_state->slab_size; }
+
+	// Buffers bigger than a slab are allocated on their own and are not recycled.
+	SendBuffer acquire(size_t size) {
+		detail::Slab* slab = size <= m_state->slab_size ? m_state->acquire() : new detail::Slab(size, nullptr);
+		slab->size = size;
+		return SendBuffer(slab);
+	}
+
+	SendBuffer acquire(const void* data, size_t size) {
+		SendBuffer buffer = acquire(size);
+		std::copy(static_cast<const uint8_t*>(data), static_cast<const uint8_t*>(data) + size, buffer.data());
+		return buffer;
+	}
+
+private:
+	detail::PoolState* m_state;
+};
+
+}
+
+#endif //RELIABLEUDP_BUFFERPOOL_HPP
@@ -0,0 +1,262 @@
+///////////////////////////////////////////////////////////////////////////////////////////////////
+//                                                                                               //
+// Copyright 2017 Benoît CORTIER                                                                 //
+//                                                                                               //
+// This file is part of RUDP project which is released under the                                 //
+// European Union Public License v1.1. If a copy of the EUPL was                                 //
+// not distributed with this software, you can obtain one at :                                   //
+// https://joinup.ec.europa.eu/community/eupl/og_page/european-union-public-licence-eupl-v11     //
+//                                                                                               //
+///////////////////////////////////////////////////////////////////////////////////////////////////
+
+#ifndef RELIABLEUDP_CHANNELS_HPP
+#define RELIABLEUDP_CHANNELS_HPP
+
+#include <algorithm> // std::min, std::max
+#include <cstddef> // size_t
+#include <cstdint> // uint8_t, uint64_t
+#include <memory>
+#include <stdexcept>
+#include <utility> // std::move
+#include <vector>
+
+#include "BufferPool.hpp"
+#include "Packet.hpp"
+#include "ProtocolState.hpp"
+#include "protocols.hpp"
+#include "ReliableOrder.hpp"
+#include "TimeCritical.hpp"
+#include "utility.hpp"
+#include "WireFormat.hpp"
+
+namespace rudp {
+
+// Channels a peer may use, numbered from 0.
+const uint8_t MAX_CHANNEL_COUNT = 16;
+
+// Independent channels, each with its own delivery mode, sequence space and reorder buffer: a packet lost
+// on a reliable channel only holds back the packets of that channel.
+//
+// A channel is opened by the first packet sent or received on it, with that packet's delivery mode.
+// Reliable channels are a rudp::ReliableOrderState each (send window, congestion control...), sequenced
+// ones a rudp::TimeCriticalState, unreliable ones keep nothing.
+// The acknowledgement fields of a header describe its own channel: user packets carry those of their
+// channel, and stamp() rotates over the channels, those owing an acknowledgement first, so that library
+// messages (keep alive, acknowledgement) carry the others.
+// Packets naming a channel beyond MAX_CHANNEL_COUNT, or another delivery mode than the channel's, are
+// rejected when sent (std::invalid_argument) and dropped when received.
+template <>
+class ProtocolState<ChannelHeader> {
+public:
+	static constexpr bool SEQUENCED = true;
+	static constexpr bool TICKED = true;
+
+	ProtocolState() noexcept { reset(); }
+
+	void reset() noexcept {
+		m_channels.clear();
+		m_next_stamp = 0;
+		m_dropped_count = 0;
+	}
+
+	void stamp(ChannelHeader& header) noexcept {
+		const size_t count = m_channels.size();
+		size_t chosen = count;
+		for (size_t i = 0; i < count && chosen == count; ++i) {
+			const size_t index = (m_next_stamp + i) % count;
+			if (m_channels[index].ack_due()) {
+				chosen = index;
+			}
+		}
+		for (size_t i = 0; i < count && chosen == count; ++i) {
+			const size_t index = (m_next_stamp + i) % count;
+			if (m_channels[index].reliable || m_channels[index].sequenced) {
+				chosen = index;
+			}
+		}
+		if (chosen == count) {
+			return; // unreliable channels only, nothing to acknowledge
+		}
+
+		m_next_stamp = chosen + 1;
+		Channel& channel = m_channels[chosen];
+		header.channel = static_cast<uint8_t>(chosen);
+		header.delivery = static_cast<uint8_t>(channel.delivery);
+		if (channel.reliable) {
+			channel.reliable->stamp(header);
+		} else {
+			channel.sequenced->stamp(header);
+		}
+	}
+
+	template <typename SendFunction>
+	void send(rudp::SendBuffer buffer, clock_type::time_point now, rudp::BufferPool& pool, const SendFunction& send) {
+		if (!WireFormat<ChannelHeader>::fits(buffer.data(), buffer.size())) {
+			send(std::move(buffer));
+			return;
+		}
+
+		const ChannelHeader header = WireFormat<ChannelHeader>::peek_fields(buffer.data());
+		Channel* channel = open_channel(header);
+		if (!channel) {
+			throw std::invalid_argument("Bad channel");
+		}
+		if (channel->reliable) {
+			channel->reliable->send(std::move(buffer), now, pool, send);
+		} else if (channel->sequenced) {
+			channel->sequenced->send(std::move(buffer), now, pool, send);
+		} else {
+			send(std::move(buffer));
+		}
+	}
+
+	template <typename SendFunction>
+	void on_receive_header(const ChannelHeader& header, clock_type::time_point now, rudp::BufferPool& pool,
+	                       const SendFunction& send) {
+		Channel* channel = find_channel(header);
+		if (!channel) {
+			return; // nothing sent on it yet, or unreliable
+		}
+		if (channel->reliable) {
+			channel->reliable->on_receive_header(header, now, pool, send);
+		} else if (channel->sequenced) {
+			channel->sequenced->on_receive_header(header, now, pool, send);
+		}
+	}
+
+	template <typename DeliverFunction>
+	void receive(const rudp::PacketView<ChannelHeader>& packet, clock_type::time_point now, rudp::BufferPool& pool,
+	             const DeliverFunction& deliver) {
+		Channel* channel = open_channel(packet.get_header());
+		if (!channel) {
+			++m_dropped_count;
+			return;
+		}
+		if (channel->reliable) {
+			channel->reliable->receive(packet, now, pool, deliver);
+		} else if (channel->sequenced) {
+			channel->sequenced->receive(packet, now, pool, deliver);
+		} else {
+			deliver(packet);
+		}
+	}
+
+	template <typename SendFunction>
+	bool tick(clock_type::time_point now, rudp::BufferPool& pool, const SendFunction& send) {
+		bool ack_due = false;
+		for (auto& channel : m_channels) {
+			if (channel.reliable) {
+				ack_due = channel.reliable->tick(now, pool, send) || ack_due;
+			} else if (channel.sequenced) {
+				ack_due = channel.sequenced->tick(now, pool, send) || ack_due;
+			}
+		}
+		return ack_due;
+	}
+
+	clock_type::time_point next_tick() const noexcept {
+		clock_type::time_point next = clock_type::time_point::max();
+		for (const auto& channel : m_channels) {
+			if (channel.reliable) {
+				next = std::min(next, channel.reliable->next_tick());
+			} else if (channel.sequenced) {
+				next = std::min(next, channel.sequenced->next_tick());
+			}
+		}
+		return next;
+	}
+
+	// Returns nullptr if the channel is not open, or not reliable.
+	const ReliableOrderState<ChannelHeader>* reliable_channel(uint8_t channel) const noexcept {
+		return channel < m_channels.size() ? m_channels[channel].reliable.get() : nullptr;
+	}
+
+	ReliableOrderState<ChannelHeader>* reliable_channel(uint8_t channel) noexcept {
+		return channel < m_channels.size() ? m_channels[channel].reliable.get() : nullptr;
+	}
+
+	// Returns nullptr if the channel is not open, or not sequenced.
+	const TimeCriticalState<ChannelHeader>* sequenced_channel(uint8_t channel) const noexcept {
+		return channel < m_channels.size() ? m_channels[channel].sequenced.get() : nullptr;
+	}
+
+	TimeCriticalState<ChannelHeader>* sequenced_channel(uint8_t channel) noexcept {
+		return channel < m_channels.size() ? m_channels[channel].sequenced.get() : nullptr;
+	}
+
+	// The largest of the channels', whatever the channel of the datagram.
+	size_t datagram_overhead() const noexcept {
+		size_t overhead = 0;
+		for (const auto& channel : m_channels) {
+			if (channel.reliable) {
+				overhead = std::max(overhead, channel.reliable->datagram_overhead());
+			} else if (channel.sequenced) {
+				overhead = std::max(overhead, channel.sequenced->datagram_overhead());
+			}
+		}
+		return overhead;
+	}
+
+	// Number of incoming packets dropped for naming a bad channel or delivery mode.
+	uint64_t dropped_count() const noexcept { return m_dropped_count; }
+
+private:
+	struct Channel {
+		Channel() : open(false), delivery(DeliveryMode::UNRELIABLE) {}
+
+		bool ack_due() const noexcept {
+			return reliable ? reliable->ack_due() : sequenced && sequenced->ack_due();
+		}
+
+		bool open;
+		DeliveryMode delivery;
+		std::unique_ptr<ReliableOrderState<ChannelHeader>> reliable;
+		std::unique_ptr<TimeCriticalState<ChannelHeader>> sequenced;
+	};
+
+	static bool is_valid(const ChannelHeader& header) noexcept {
+		return header.channel < MAX_CHANNEL_COUNT && header.delivery <= static_cast<uint8_t>(DeliveryMode::RELIABLE);
+	}
+
+	// Returns nullptr if the header names a bad channel, or another delivery mode than the channel's.
+	Channel* open_channel(const ChannelHeader& header) {
+		if (!is_valid(header)) {
+			return nullptr;
+		}
+		if (header.channel >= m_channels.size()) {
+			m_channels.resize(header.channel + 1);
+		}
+
+		Channel& channel = m_channels[header.channel];
+		const DeliveryMode delivery = static_cast<DeliveryMode>(header.delivery);
+		if (channel.open) {
+			return channel.delivery == delivery ? &channel : nullptr;
+		}
+
+		channel.open = true;
+		channel.delivery = delivery;
+		if (delivery == DeliveryMode::RELIABLE) {
+			channel.reliable.reset(new ReliableOrderState<ChannelHeader>());
+		} else if (delivery == DeliveryMode::SEQUENCED) {
+			channel.sequenced.reset(new TimeCriticalState<ChannelHeader>());
+		}
+		return &channel;
+	}
+
+	// Returns nullptr if the channel is not open with the header's delivery mode.
+	Channel* find_channel(const ChannelHeader& header) noexcept {
+		if (!is_valid(header) || header.channel >= m_channels.size()) {
+			return nullptr;
+		}
+		Channel& channel = m_channels[header.channel];
+		return channel.open && channel.delivery == static_cast<DeliveryMode>(header.delivery) ? &channel : nullptr;
+	}
+
+	std::vector<Channel> m_channels; // indexed by channel, grown up to the highest one opened
+	size_t m_next_stamp; // channel stamp() looks at first
+	uint64_t m_dropped_count;
+};
+
+}
+
+#endif //RELIABLEUDP_CHANNELS_HPP
@@ -0,0 +1,120 @@
+///////////////////////////////////////////////////////////////////////////////////////////////////
+//                                                                                               //
+// Copyright 2017 Benoît CORTIER                                                                 //
+//                                                                                               //
+// This file is part of RUDP project which is released under the                                 //
+// European Union Public License v1.1. If a copy of the EUPL was                                 //
+// not distributed with this software, you can obtain one at :                                   //
+// https://joinup.ec.europa.eu/community/eupl/og_page/european-union-public-licence-eupl-v11     //
+//                                                                                               //
+///////////////////////////////////////////////////////////////////////////////////////////////////
+
+#ifndef RELIABLEUDP_CONGESTIONCONTROL_HPP
+#define RELIABLEUDP_CONGESTIONCONTROL_HPP
+
+#include <algorithm> // std::min, std::max
+#include <chrono>
+#include <cstdint> // uint8_t, uint16_t
+#include <limits> // std::numeric_limits
+
+#include "ProtocolState.hpp"
+#include "utility.hpp"
+
+namespace rudp {
+
+// Congestion windows, in packets.
+const double INITIAL_CONGESTION_WINDOW = 4;
+const double MIN_CONGESTION_WINDOW = 2;
+
+// Pacing rate, as a multiple of one congestion window per smoothed round trip time: above 1 so that the
+// window can grow, higher in slow start where it doubles every round trip.
+const double SLOW_START_PACING_GAIN = 2.0;
+const double AVOIDANCE_PACING_GAIN = 1.25;
+
+// Packets sent back to back by the pacer: at least MIN_PACING_BURST, or what the rate allows in
+// PACING_INTERVAL, the resolution of the timers servicing the pacer (rudp::PROTOCOL_TICK).
+const double MIN_PACING_BURST = 2;
+const std::chrono::milliseconds PACING_INTERVAL(10);
+
+// Loss-based AIMD congestion control (NewReno, RFC 5681), counted in packets, up to a maximum window.
+//
+// The window grows by one packet per acknowledgement in slow start, and by one packet per window in
+// congestion avoidance. A loss halves it, at most once per window of data (recovery lasts until a
+// packet sent after the loss is acknowledged), and a retransmission timeout brings it back to
+// MIN_CONGESTION_WINDOW, in slow start.
+// pacing_rate() spreads a window over a round trip time.
+class CongestionController {
+public:
+	enum class Phase : uint8_t {
+		SLOW_START,
+		AVOIDANCE,
+		RECOVERY
+	};
+
+	explicit CongestionController(double max_window) noexcept : m_max_window(max_window) { reset(); }
+
+	void reset() noexcept {
+		m_window = INITIAL_CONGESTION_WINDOW;
+		m_threshold = std::numeric_limits<double>::max();
+		m_recovering = false;
+		m_recovery_end = 0;
+	}
+
+	// `sequence` was acknowledged.
+	void on_ack(uint16_t sequence) noexcept {
+		if (m_recovering) {
+			if (sequence_more_recent(m_recovery_end, sequence)) {
+				return;
+			}
+			m_recovering = false;
+		}
+
+		m_window = std::min(m_max_window, m_window + (m_window < m_threshold ? 1.0 : 1.0 / m_window));
+	}
+
+	// `sequence` was lost while `next_sequence` is the next to be sent.
+	void on_loss(uint16_t sequence, uint16_t next_sequence) noexcept {
+		if (m_recovering && sequence_more_recent(m_recovery_end, sequence)) {
+			return; // same loss event
+		}
+		m_threshold = std::max(m_window / 2, MIN_CONGESTION_WINDOW);
+		m_window = m_threshold;
+		m_recovering = true;
+		m_recovery_end = next_sequence;
+	}
+
+	void on_timeout(uint16_t next_sequence) noexcept {
+		m_threshold = std::max(m_window / 2, MIN_CONGESTION_WINDOW);
+		m_window = MIN_CONGESTION_WINDOW;
+		m_recovering = true;
+		m_recovery_end = next_sequence;
+	}
+
+	double window() const noexcept { return m_window; }
+
+	double slow_start_threshold() const noexcept { return m_threshold; }
+
+	Phase phase() const noexcept {
+		return m_recovering ? Phase::RECOVERY : m_window < m_threshold ? Phase::SLOW_START : Phase::AVOIDANCE;
+	}
+
+	// Packets per second, 0 (unpaced) until the round trip time has been measured.
+	double pacing_rate(const RttEstimator& rtt) const noexcept {
+		if (!rtt.has_sample()) {
+			return 0;
+		}
+		const double srtt = std::max(std::chrono::duration<double>(rtt.srtt()).count(), 1e-6);
+		return (phase() == Phase::SLOW_START ? SLOW_START_PACING_GAIN : AVOIDANCE_PACING_GAIN) * m_window / srtt;
+	}
+
+private:
+	double m_max_window;
+	double m_window;
+	double m_threshold;
+	bool m_recovering;
+	uint16_t m_recovery_end; // first sequence sent after the last reduction
+};
+
+}
+
+#endif //RELIABLEUDP_CONGESTIONCONTROL_HPP
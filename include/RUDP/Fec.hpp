@@ -0,0 +1,266 @@
+///////////////////////////////////////////////////////////////////////////////////////////////////
+//                                                                                               //
+// Copyright 2017 Benoît CORTIER                                                                 //
+//                                                                                               //
+// This file is part of RUDP project which is released under the                                 //
+// European Union Public License v1.1. If a copy of the EUPL was                                 //
+// not distributed with this software, you can obtain one at :                                   //
+// https://joinup.ec.europa.eu/community/eupl/og_page/european-union-public-licence-eupl-v11     //
+//                                                                                               //
+///////////////////////////////////////////////////////////////////////////////////////////////////
+
+#ifndef RELIABLEUDP_FEC_HPP
+#define RELIABLEUDP_FEC_HPP
+
+#include <algorithm> // std::min
+#include <array>
+#include <cstddef> // size_t
+#include <cstdint> // uint8_t, uint16_t, uint64_t
+#include <cstring> // std::memcpy
+#include <utility> // std::move
+#include <vector>
+
+#include "BufferPool.hpp"
+#include "Packet.hpp"
+#include "utility.hpp"
+#include "WireFormat.hpp"
+
+namespace rudp {
+
+// Datagrams protected by a parity datagram.
+const uint8_t MIN_FEC_GROUP_SIZE = 2;
+const uint8_t MAX_FEC_GROUP_SIZE = 16;
+
+// Received datagrams kept to rebuild a lost one: the parity of a group may arrive after the next group.
+const uint16_t FEC_HISTORY_SIZE = 2 * MAX_FEC_GROUP_SIZE;
+
+// Adaptive group size (see rudp::fec_group_size): about that many losses expected per group, as a group
+// recovers a single one, and no parity at all below FEC_MIN_LOSS.
+const double FEC_LOSSES_PER_GROUP = 0.25;
+const double FEC_MIN_LOSS = 0.005;
+
+inline uint8_t fec_group_size(double loss) noexcept {
+	if (loss < FEC_MIN_LOSS) {
+		return 0;
+	}
+	const double size = FEC_LOSSES_PER_GROUP / loss;
+	return size >= MAX_FEC_GROUP_SIZE ? MAX_FEC_GROUP_SIZE
+	       : size <= MIN_FEC_GROUP_SIZE ? MIN_FEC_GROUP_SIZE : static_cast<uint8_t>(size);
+}
+
+// Layout of the message of a parity datagram (rudp::wire::PARITY_FLAG), whose header is the one of the last
+// datagram of the group but for `sequence`, the first of the group:
+//
+//     group size (8 bits) | XOR of the flags (8 bits) | XOR of the message sizes (16 bits) | XOR of the messages
+//
+// Shorter messages are padded with zeros. Only the flags describing the message (coalesced, fragment) are XORed.
+namespace fec_wire {
+	const size_t COUNT_OFFSET = 0;
+	const size_t FLAGS_OFFSET = COUNT_OFFSET + sizeof(uint8_t);
+	const size_t SIZE_OFFSET = FLAGS_OFFSET + sizeof(uint8_t);
+	const size_t PREFIX_SIZE = SIZE_OFFSET + sizeof(uint16_t);
+
+	const uint8_t MESSAGE_FLAGS = wire::COALESCED_FLAG | wire::FRAGMENT_FLAG;
+}
+
+// Forward error correction of a sequenced protocol: after every `group_size` datagrams with consecutive
+// sequences, a parity datagram lets the receiver (rudp::FecDecoder) rebuild any single one of them
+// without waiting for a retransmission.
+// A parity datagram is fec_wire::PREFIX_SIZE bytes larger than the largest message of its group: while the
+// encoder is active(), the socket fragments and coalesces messages that much smaller.
+template <typename Header>
+class FecEncoder {
+public:
+	FecEncoder() noexcept { reset(); }
+
+	void reset() noexcept {
+		m_group_size = 0;
+		m_count = 0;
+		m_parity_count = 0;
+	}
+
+	// 0 disables it. A group being built keeps the size it started with.
+	void set_group_size(uint8_t size) noexcept { m_group_size = std::min(size, MAX_FEC_GROUP_SIZE); }
+
+	uint8_t group_size() const noexcept { return m_group_size; }
+
+	// Parity datagrams may still be sent: enabled, or completing a group.
+	bool active() const noexcept { return m_group_size != 0 || m_count != 0; }
+
+	// Parity datagrams sent.
+	uint64_t parity_count() const noexcept { return m_parity_count; }
+
+	// `datagram` was sent with `sequence`, send(parity) sends the parity datagram once the group is complete.
+	template <typename SendFunction>
+	void add(const rudp::SendBuffer& datagram, uint16_t sequence, rudp::BufferPool& pool, const SendFunction& send) {
+		if (m_count != 0 && sequence != static_cast<uint16_t>(m_first + m_count)) {
+			m_count = 0; // not consecutive, the group is given up
+		}
+		if (m_count == 0) {
+			if (m_group_size == 0) {
+				return;
+			}
+			m_target = m_group_size;
+			m_first = sequence;
+			m_flags = 0;
+			m_size = 0;
+			m_parity.clear();
+		}
+
+		const uint8_t flags = WireFormat<Header>::flags(datagram.data());
+		const size_t header_size = WireFormat<Header>::size(flags);
+		const size_t message_size = datagram.size() - header_size;
+		if (message_size > m_parity.size()) {
+			m_parity.resize(message_size, 0);
+		}
+		xor_bytes(m_parity.data(), m_parity.data(), datagram.data() + header_size, message_size);
+		m_flags ^= flags & fec_wire::MESSAGE_FLAGS;
+		m_size ^= static_cast<uint16_t>(message_size);
+		if (++m_count < m_target) {
+			return;
+		}
+
+		m_count = 0;
+		rudp::SendBuffer parity = pool.acquire(header_size + fec_wire::PREFIX_SIZE + m_parity.size());
+		std::memcpy(parity.data(), datagram.data(), header_size);
+		WireFormat<Header>::set_flags(parity.data(), (flags & wire::COMPACT_FLAG) | wire::PARITY_FLAG);
+		const uint16_t first = m_first;
+		WireFormat<Header>::rewrite_fields(parity.data(), [first](Header& header) {
+			header.sequence = first;
+		});
+
+		uint8_t* prefix = parity.data() + header_size;
+		wire::write_le(prefix + fec_wire::COUNT_OFFSET, m_target);
+		wire::write_le(prefix + fec_wire::FLAGS_OFFSET, m_flags);
+		wire::write_le(prefix + fec_wire::SIZE_OFFSET, m_size);
+		std::memcpy(prefix + fec_wire::PREFIX_SIZE, m_parity.data(), m_parity.size());
+		++m_parity_count;
+		send(std::move(parity));
+	}
+
+private:
+	uint8_t m_group_size;
+
+	// Group being built.
+	uint8_t m_target;
+	uint8_t m_count;
+	uint16_t m_first;
+	uint8_t m_flags;
+	uint16_t m_size;
+	std::vector<uint8_t> m_parity;
+
+	uint64_t m_parity_count;
+};
+
+// Receiving side of a rudp::FecEncoder.
+// Received datagrams are only copied once the peer sent a parity datagram.
+template <typename Header>
+class FecDecoder {
+public:
+	FecDecoder() noexcept { reset(); }
+
+	void reset() noexcept {
+		for (auto& slot : m_history) {
+			slot = Received();
+		}
+		m_active = false;
+		m_recovered_count = 0;
+	}
+
+	// Keeps a copy of a received datagram of the peer, parity datagrams aside.
+	void store(const rudp::PacketView<Header>& packet, rudp::BufferPool& pool) {
+		if (!m_active) {
+			return;
+		}
+		const uint16_t sequence = packet.get_header().sequence;
+		Received& slot = m_history[sequence % FEC_HISTORY_SIZE];
+		slot.sequence = sequence;
+		slot.buffer = pool.acquire(packet.get_datagram().data(), packet.get_datagram().size());
+	}
+
+	// Rebuilds the datagram of the parity's group that did not arrive, if it is the only one.
+	// Returns an empty buffer otherwise, or if the parity datagram is malformed or truncated.
+	rudp::SendBuffer recover(const rudp::PacketView<Header>& parity, rudp::BufferPool& pool) {
+		m_active = true;
+
+		const rudp::ByteSpan message = parity.get_message();
+		if (message.size() < fec_wire::PREFIX_SIZE) {
+			return rudp::SendBuffer();
+		}
+		const uint8_t count = wire::read_le<uint8_t>(message.data() + fec_wire::COUNT_OFFSET);
+		uint8_t flags = wire::read_le<uint8_t>(message.data() + fec_wire::FLAGS_OFFSET);
+		size_t size = wire::read_le<uint16_t>(message.data() + fec_wire::SIZE_OFFSET);
+		if (count == 0 || count > MAX_FEC_GROUP_SIZE) {
+			return rudp::SendBuffer();
+		}
+
+		const uint16_t first = parity.get_header().sequence;
+		std::array<const Received*, MAX_FEC_GROUP_SIZE> received;
+		size_t received_count = 0;
+		bool missing = false;
+		uint16_t missing_sequence = 0;
+		for (uint16_t i = 0; i < count; ++i) {
+			const uint16_t sequence = static_cast<uint16_t>(first + i);
+			const Received& slot = m_history[sequence % FEC_HISTORY_SIZE];
+			if (slot.buffer && slot.sequence == sequence) {
+				received[received_count++] = &slot;
+			} else if (missing) {
+				return rudp::SendBuffer(); // two or more lost
+			} else {
+				missing = true;
+				missing_sequence = sequence;
+			}
+		}
+		if (!missing) {
+			return rudp::SendBuffer();
+		}
+
+		for (size_t i = 0; i < received_count; ++i) {
+			const uint8_t received_flags = WireFormat<Header>::flags(received[i]->buffer.data());
+			flags ^= received_flags & fec_wire::MESSAGE_FLAGS;
+			size ^= received[i]->buffer.size() - WireFormat<Header>::size(received_flags);
+		}
+		if (size > message.size() - fec_wire::PREFIX_SIZE) {
+			return rudp::SendBuffer();
+		}
+
+		const size_t header_size = parity.get_datagram().size() - message.size();
+		rudp::SendBuffer datagram = pool.acquire(header_size + size);
+		std::memcpy(datagram.data(), parity.get_datagram().data(), header_size);
+		WireFormat<Header>::set_flags(datagram.data(), (parity.get_flags() & wire::COMPACT_FLAG)
+		                                               | (flags & fec_wire::MESSAGE_FLAGS));
+		WireFormat<Header>::rewrite_fields(datagram.data(), [missing_sequence](Header& header) {
+			header.sequence = missing_sequence;
+		});
+
+		uint8_t* out = datagram.data() + header_size;
+		std::memcpy(out, message.data() + fec_wire::PREFIX_SIZE, size);
+		for (size_t i = 0; i < received_count; ++i) {
+			const rudp::SendBuffer& other = received[i]->buffer;
+			const size_t other_header_size = WireFormat<Header>::size(WireFormat<Header>::flags(other.data()));
+			xor_bytes(out, out, other.data() + other_header_size, std::min(size, other.size() - other_header_size));
+		}
+
+		++m_recovered_count;
+		return datagram;
+	}
+
+	// Datagrams rebuilt from parity datagrams.
+	uint64_t recovered_count() const noexcept { return m_recovered_count; }
+
+private:
+	struct Received {
+		Received() : sequence(0) {}
+
+		uint16_t sequence;
+		rudp::SendBuffer buffer; // the whole datagram
+	};
+
+	std::array<Received, FEC_HISTORY_SIZE> m_history; // indexed by sequence % FEC_HISTORY_SIZE
+	bool m_active;
+	uint64_t m_recovered_count;
+};
+
+}
+
+#endif //RELIABLEUDP_FEC_HPP
@@ -0,0 +1,219 @@
+///////////////////////////////////////////////////////////////////////////////////////////////////
+//                                                                                               //
+// Copyright 2017 Benoît CORTIER                                                                 //
+//                                                                                               //
+// This file is part of RUDP project which is released under the                                 //
+// European Union Public License v1.1. If a copy of the EUPL was                                 //
+// not distributed with this software, you can obtain one at :                                   //
+// https://joinup.ec.europa.eu/community/eupl/og_page/european-union-public-licence-eupl-v11     //
+//                                                                                               //
+///////////////////////////////////////////////////////////////////////////////////////////////////
+
+#ifndef RELIABLEUDP_FRAGMENTATION_HPP
+#define RELIABLEUDP_FRAGMENTATION_HPP
+
+#include <algorithm> // std::min
+#include <array>
+#include <chrono>
+#include <cstddef> // size_t
+#include <cstdint> // uint8_t, uint16_t, uint32_t
+#include <cstring> // std::memcpy
+#include <vector>
+
+#include "Packet.hpp"
+#include "WireFormat.hpp"
+#include "utility.hpp"
+
+namespace rudp {
+
+const size_t DEFAULT_MAX_MESSAGE_SIZE = 256 * 1024;
+const size_t DEFAULT_REASSEMBLY_MEMORY_LIMIT = 16 * 1024 * 1024; // for all peers of a socket
+const std::chrono::seconds REASSEMBLY_TIMEOUT(5);
+
+// Follows the header of datagrams flagged with rudp::wire::FRAGMENT_FLAG, then comes the fragment's
+// share of the message. Every fragment but the last carries ceil(total_size / count) bytes.
+struct FragmentHeader {
+	static constexpr size_t SIZE = sizeof(uint16_t) * 3 + sizeof(uint32_t);
+
+	uint16_t message_id;
+	uint16_t index;
+	uint16_t count;
+	uint32_t total_size; // of the message, headers excluded
+
+	void write(uint8_t* out) const noexcept {
+		wire::write_le(out, message_id);
+		wire::write_le(out + 2, index);
+		wire::write_le(out + 4, count);
+		wire::write_le(out + 6, total_size);
+	}
+
+	static FragmentHeader read(const uint8_t* in) noexcept {
+		FragmentHeader header;
+		header.message_id = wire::read_le<uint16_t>(in);
+		header.index = wire::read_le<uint16_t>(in + 2);
+		header.count = wire::read_le<uint16_t>(in + 4);
+		header.total_size = wire::read_le<uint32_t>(in + 6);
+		return header;
+	}
+
+	size_t fragment_size() const noexcept { return (total_size + count - 1) / count; }
+};
+
+// Bytes held by the reassembly buffers of a socket, shared by the Reassembler of every peer.
+struct ReassemblyBudget {
+	explicit ReassemblyBudget(size_t limit) : used(0), limit(limit) {}
+
+	size_t used;
+	size_t limit;
+};
+
+// Per-peer reassembly of fragmented messages into a fixed set of slots.
+//
+// A slot holds one message being reassembled; when all slots are busy the oldest message is dropped.
+// Messages above the maximum message size, or that would exceed the socket's memory budget, are dropped,
+// as are messages still incomplete after REASSEMBLY_TIMEOUT (see expire()).
+class Reassembler {
+public:
+	static constexpr size_t SLOT_COUNT = 4;
+
+	Reassembler() = default;
+
+	Reassembler(const Reassembler&) = delete;
+
+	Reassembler(Reassembler&&) = default;
+
+	Reassembler& operator=(const Reassembler&) = delete;
+
+	Reassembler& operator=(Reassembler&&) = default;
+
+	// header and payload are those of one fragment datagram (fragment header excluded from header).
+	// Once the message is complete, complete(data, size) is called with the reassembled datagram:
+	// the fragment's header, without the fragment flag, followed by the whole message.
+	template <typename Header, typename CompleteFunction>
+	void add(ByteSpan header, ByteSpan payload, clock_type::time_point now, size_t max_message_size,
+	         ReassemblyBudget& budget, const CompleteFunction& complete) {
+		if (payload.size() < FragmentHeader::SIZE) {
+			return;
+		}
+		const FragmentHeader fragment = FragmentHeader::read(payload.data());
+		const uint8_t* data = payload.data() + FragmentHeader::SIZE;
+		const size_t size = payload.size() - FragmentHeader::SIZE;
+
+		if (fragment.count == 0 || fragment.index >= fragment.count || fragment.total_size > max_message_size) {
+			return;
+		}
+		const size_t offset = fragment.index * fragment.fragment_size();
+		if (offset >= fragment.total_size || size != std::min(fragment.fragment_size(), fragment.total_size - offset)) {
+			return;
+		}
+
+		Slot* slot = find_slot(fragment, WireFormat<Header>::FULL_SIZE, now, budget);
+		if (!slot || slot->received[fragment.index]) {
+			return;
+		}
+
+		slot->received[fragment.index] = 1;
+		++slot->received_count;
+		std::memcpy(slot->data.data() + WireFormat<Header>::FULL_SIZE + offset, data, size);
+
+		if (slot->received_count == slot->count) {
+			uint8_t* start = slot->data.data() + WireFormat<Header>::FULL_SIZE - header.size();
+			std::memcpy(start, header.data(), header.size());
+			WireFormat<Header>::set_flags(start, WireFormat<Header>::flags(start) & ~wire::FRAGMENT_FLAG);
+			complete(static_cast<const uint8_t*>(start), header.size() + slot->total_size);
+			release(*slot, budget);
+		}
+	}
+
+	// Drops the messages started REASSEMBLY_TIMEOUT ago or more.
+	void expire(clock_type::time_point now, ReassemblyBudget& budget) noexcept {
+		for (auto& slot : m_slots) {
+			if (slot.used && now - slot.started_at >= REASSEMBLY_TIMEOUT) {
+				release(slot, budget);
+			}
+		}
+	}
+
+	// Time at which expire() will drop the oldest message, clock_type::time_point::max() if there is none.
+	clock_type::time_point next_expiry() const noexcept {
+		clock_type::time_point next = clock_type::time_point::max();
+		for (const auto& slot : m_slots) {
+			if (slot.used) {
+				next = std::min(next, slot.started_at + REASSEMBLY_TIMEOUT);
+			}
+		}
+		return next;
+	}
+
+	void clear(ReassemblyBudget& budget) noexcept {
+		for (auto& slot : m_slots) {
+			if (slot.used) {
+				release(slot, budget);
+			}
+		}
+	}
+
+private:
+	struct Slot {
+		bool used = false;
+		uint16_t message_id = 0;
+		uint16_t count = 0;
+		uint16_t received_count = 0;
+		uint32_t total_size = 0;
+		clock_type::time_point started_at;
+		std::vector<uint8_t> received; // one flag per fragment
+		std::vector<uint8_t> data; // room for the largest header, then the message
+	};
+
+	Slot* find_slot(const FragmentHeader& fragment, size_t header_room, clock_type::time_point now,
+	                ReassemblyBudget& budget) {
+		Slot* oldest = nullptr;
+		for (auto& slot : m_slots) {
+			if (slot.used && slot.message_id == fragment.message_id) {
+				const bool consistent = slot.count == fragment.count && slot.total_size == fragment.total_size;
+				return consistent ? &slot : nullptr;
+			}
+		}
+		for (auto& slot : m_slots) {
+			if (!slot.used) {
+				oldest = &slot;
+				break;
+			}
+			if (!oldest || slot.started_at < oldest->started_at) {
+				oldest = &slot;
+			}
+		}
+		if (oldest->used) {
+			release(*oldest, budget);
+		}
+
+		const size_t memory = header_room + fragment.total_size + fragment.count;
+		if (budget.used + memory > budget.limit) {
+			return nullptr;
+		}
+		budget.used += memory;
+
+		oldest->used = true;
+		oldest->message_id = fragment.message_id;
+		oldest->count = fragment.count;
+		oldest->received_count = 0;
+		oldest->total_size = fragment.total_size;
+		oldest->started_at = now;
+		oldest->received.assign(fragment.count, 0);
+		oldest->data.resize(memory - fragment.count);
+		return oldest;
+	}
+
+	static void release(Slot& slot, ReassemblyBudget& budget) noexcept {
+		budget.used -= slot.data.size() + slot.received.size();
+		slot.used = false;
+		std::vector<uint8_t>().swap(slot.data);
+		std::vector<uint8_t>().swap(slot.received);
+	}
+
+	std::array<Slot, SLOT_COUNT> m_slots;
+};
+
+}
+
+#endif //RELIABLEUDP_FRAGMENTATION_HPP
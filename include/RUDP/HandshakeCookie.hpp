@@ -0,0 +1,149 @@
+///////////////////////////////////////////////////////////////////////////////////////////////////
+//                                                                                               //
+// Copyright 2017 Benoît CORTIER                                                                 //
+//                                                                                               //
+// This file is part of RUDP project which is released under the                                 //
+// European Union Public License v1.1. If a copy of the EUPL was                                 //
+// not distributed with this software, you can obtain one at :                                   //
+// https://joinup.ec.europa.eu/community/eupl/og_page/european-union-public-licence-eupl-v11     //
+//                                                                                               //
+///////////////////////////////////////////////////////////////////////////////////////////////////
+
+#ifndef RELIABLEUDP_HANDSHAKECOOKIE_HPP
+#define RELIABLEUDP_HANDSHAKECOOKIE_HPP
+
+#include <chrono>
+#include <cstddef> // size_t
+#include <cstdint> // uint8_t, uint32_t, uint64_t
+#include <cstring> // std::memcpy
+#include <random>
+
+#include <boost/asio.hpp>
+#include <boost/uuid/uuid.hpp>
+
+#include "WireFormat.hpp"
+#include "utility.hpp"
+
+namespace rudp {
+
+// A cookie is accepted during the period it was made in and the next one.
+const std::chrono::seconds COOKIE_PERIOD(2);
+
+namespace detail {
+
+inline uint64_t rotl(uint64_t x, int b) noexcept { return (x << b) | (x >> (64 - b)); }
+
+inline void sip_round(uint64_t& v0, uint64_t& v1, uint64_t& v2, uint64_t& v3) noexcept {
+	v0 += v1; v1 = rotl(v1, 13); v1 ^= v0; v0 = rotl(v0, 32);
+	v2 += v3; v3 = rotl(v3, 16); v3 ^= v2;
+	v0 += v3; v3 = rotl(v3, 21); v3 ^= v0;
+	v2 += v1; v1 = rotl(v1, 17); v1 ^= v2; v2 = rotl(v2, 32);
+}
+
+// SipHash-2-4, a keyed hash meant for short inputs.
+inline uint64_t siphash24(const uint64_t key[2], const uint8_t* data, size_t size) noexcept {
+	uint64_t v0 = 0x736f6d6570736575ULL ^ key[0];
+	uint64_t v1 = 0x646f72616e646f6dULL ^ key[1];
+	uint64_t v2 = 0x6c7967656e657261ULL ^ key[0];
+	uint64_t v3 = 0x7465646279746573ULL ^ key[1];
+
+	const size_t tail = size & 7;
+	for (size_t i = 0; i < size - tail; i += 8) {
+		const uint64_t m = wire::read_le<uint64_t>(data + i);
+		v3 ^= m;
+		sip_round(v0, v1, v2, v3);
+		sip_round(v0, v1, v2, v3);
+		v0 ^= m;
+	}
+
+	uint64_t last = uint64_t(size) << 56;
+	for (size_t i = 0; i < tail; ++i) {
+		last |= uint64_t(data[size - tail + i]) << (8 * i);
+	}
+	v3 ^= last;
+	sip_round(v0, v1, v2, v3);
+	sip_round(v0, v1, v2, v3);
+	v0 ^= last;
+
+	v2 ^= 0xff;
+	for (int i = 0; i < 4; ++i) {
+		sip_round(v0, v1, v2, v3);
+	}
+	return v0 ^ v1 ^ v2 ^ v3;
+}
+
+}
+
+// Challenge sent to an unknown peer asking to connect, echoed back by the peer.
+struct HandshakeCookie {
+	static constexpr size_t SIZE = sizeof(uint32_t) + sizeof(uint64_t);
+
+	uint32_t period = 0;
+	uint64_t mac = 0;
+
+	void write(uint8_t* out) const noexcept {
+		wire::write_le(out, period);
+		wire::write_le(out + 4, mac);
+	}
+
+	static HandshakeCookie read(const uint8_t* in) noexcept {
+		HandshakeCookie cookie;
+		cookie.period = wire::read_le<uint32_t>(in);
+		cookie.mac = wire::read_le<uint64_t>(in + 4);
+		return cookie;
+	}
+};
+
+// Makes and checks stateless handshake cookies: a MAC of the peer's endpoint and uuid and of the current
+// period, keyed by a random secret. Nothing is stored per peer until it echoes a valid cookie, which it
+// can only do if it receives on the endpoint it claims.
+class CookieJar {
+public:
+	CookieJar() {
+		std::random_device random;
+		for (uint64_t& word : m_key) {
+			word = (uint64_t(random()) << 32) ^ random();
+		}
+	}
+
+	HandshakeCookie make(const boost::asio::ip::udp::endpoint& endpoint, const boost::uuids::uuid& uuid,
+	                     clock_type::time_point now) const noexcept {
+		HandshakeCookie cookie;
+		cookie.period = period(now);
+		cookie.mac = mac(cookie.period, endpoint, uuid);
+		return cookie;
+	}
+
+	bool check(const HandshakeCookie& cookie, const boost::asio::ip::udp::endpoint& endpoint,
+	           const boost::uuids::uuid& uuid, clock_type::time_point now) const noexcept {
+		const uint32_t current = period(now);
+		if (cookie.period != current && cookie.period + 1 != current) {
+			return false;
+		}
+		return cookie.mac == mac(cookie.period, endpoint, uuid);
+	}
+
+private:
+	static uint32_t period(clock_type::time_point now) noexcept {
+		return static_cast<uint32_t>(now.time_since_epoch() / COOKIE_PERIOD);
+	}
+
+	uint64_t mac(uint32_t period, const boost::asio::ip::udp::endpoint& endpoint,
+	             const boost::uuids::uuid& uuid) const noexcept {
+		uint8_t input[sizeof(uint32_t) + 16 + sizeof(uint16_t) + 16]; // period, IPv6 address, port, uuid
+		wire::write_le(input, period);
+		const auto address = endpoint.address().is_v4()
+		                     ? boost::asio::ip::address_v6::v4_mapped(endpoint.address().to_v4()).to_bytes()
+		                     : endpoint.address().to_v6().to_bytes();
+		std::memcpy(input + 4, address.data(), 16);
+		wire::write_le(input + 20, endpoint.port());
+		std::memcpy(input + 22, uuid.data, 16);
+		return detail::siphash24(m_key, input, sizeof(input));
+	}
+
+	uint64_t m_key[2];
+};
+
+}
+
+#endif //RELIABLEUDP_HANDSHAKECOOKIE_HPP
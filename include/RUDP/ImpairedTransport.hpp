@@ -0,0 +1,200 @@
+///////////////////////////////////////////////////////////////////////////////////////////////////
+//                                                                                               //
+// Copyright 2017 Benoît CORTIER                                                                 //
+//                                                                                               //
+// This file is part of RUDP project which is released under the                                 //
+// European Union Public License v1.1. If a copy of the EUPL was                                 //
+// not distributed with this software, you can obtain one at :                                   //
+// https://joinup.ec.europa.eu/community/eupl/og_page/european-union-public-licence-eupl-v11     //
+//                                                                                               //
+///////////////////////////////////////////////////////////////////////////////////////////////////
+
+#ifndef RELIABLEUDP_IMPAIREDTRANSPORT_HPP
+#define RELIABLEUDP_IMPAIREDTRANSPORT_HPP
+
+#include <algorithm> // std::max
+#include <chrono>
+#include <cstddef> // size_t
+#include <cstdint> // uint64_t
+#include <functional> // std::greater
+#include <memory>
+#include <queue>
+#include <random>
+#include <vector>
+
+#include <boost/asio.hpp>
+#include <boost/asio/steady_timer.hpp>
+
+#include "BufferPool.hpp"
+#include "Transport.hpp"
+#include "utility.hpp"
+
+namespace rudp {
+
+// Network conditions simulated by a rudp::ImpairedTransport, applied in this order to each outgoing datagram.
+struct Impairment {
+	// Probability that a datagram is lost. With a mean burst length greater than 1, losses come in bursts
+	// (Gilbert-Elliott model) and `loss` is their long-run rate.
+	double loss = 0.0;
+	double mean_burst_length = 1.0;
+	// Probability that a datagram is sent twice.
+	double duplicate = 0.0;
+	// Bits per second leaving the sender, 0 for unlimited. Datagrams that would make the backlog exceed
+	// queue_limit bytes are dropped.
+	uint64_t bandwidth = 0;
+	size_t queue_limit = 256 * 1024;
+	// One-way delay, plus a uniform jitter in [-jitter, jitter]. Datagrams leave in order despite the jitter...
+	clock_type::duration delay = clock_type::duration::zero();
+	clock_type::duration jitter = clock_type::duration::zero();
+	// ...except the ones picked with this probability, which skip the delay and overtake the others.
+	double reorder = 0.0;
+	// Same seed, same decisions for the same sequence of datagrams.
+	uint64_t seed = 1;
+};
+
+// Transport decorator applying a rudp::Impairment to the datagrams sent through another transport, to see
+// how sockets behave on a bad network without root access or tc netem. Receives are passed through:
+// impair both ends for a symmetric link.
+// Errors of delayed sends are not reported, the handler of async_send_many is always called with none.
+class ImpairedTransport : public Transport {
+public:
+	ImpairedTransport(boost::asio::io_service& io_service, Transport& next, const Impairment& impairment)
+		: m_next(next)
+		, m_impairment(impairment)
+		, m_random(impairment.seed)
+		, m_in_burst(false)
+		, m_link_free(clock_type::time_point::min())
+		, m_last_departure(clock_type::time_point::min())
+		, m_order(0)
+		, m_timer(io_service)
+		, m_timer_deadline(clock_type::time_point::max())
+	{}
+
+	void async_receive(const receive_handler_type& handler) override {
+		m_next.async_receive(handler);
+	}
+
+	void async_send(SendBuffer buffer, const boost::asio::ip::udp::endpoint& endpoint) override {
+		const clock_type::time_point now = clock_type::now();
+		if (is_lost()) {
+			return;
+		}
+		if (chance(m_impairment.duplicate)) {
+			schedule(buffer, endpoint, now);
+		}
+		schedule(std::move(buffer), endpoint, now);
+	}
+
+	void async_send_many(std::vector<SendBuffer> payloads, std::vector<boost::asio::ip::udp::endpoint> endpoints,
+	                     const send_handler_type& handler) override {
+		for (size_t i = 0; i < endpoints.size(); ++i) {
+			async_send(payloads.size() == 1 ? payloads[0] : std::move(payloads[i]), endpoints[i]);
+		}
+		if (handler) {
+			handler(std::vector<SendError>());
+		}
+	}
+
+private:
+	struct Pending {
+		clock_type::time_point departure;
+		uint64_t order; // ties broken by send order
+		SendBuffer buffer;
+		boost::asio::ip::udp::endpoint endpoint;
+
+		bool operator>(const Pending& other) const noexcept {
+			return departure > other.departure || (departure == other.departure && order > other.order);
+		}
+	};
+
+	bool chance(double probability) {
+		return probability > 0.0 && std::uniform_real_distribution<double>(0.0, 1.0)(m_random) < probability;
+	}
+
+	bool is_lost() {
+		if (m_impairment.mean_burst_length <= 1.0) {
+			return chance(m_impairment.loss);
+		}
+
+		// Two states, losing everything in the bad one: leaving it has probability 1 / mean burst length, and
+		// entering it is set so that the bad state's share of the time is `loss`.
+		const double leave = 1.0 / m_impairment.mean_burst_length;
+		const double enter = m_impairment.loss < 1.0 ? m_impairment.loss * leave / (1.0 - m_impairment.loss) : 1.0;
+		m_in_burst = m_in_burst ? !chance(leave) : chance(enter);
+		return m_in_burst;
+	}
+
+	void schedule(SendBuffer buffer, const boost::asio::ip::udp::endpoint& endpoint, clock_type::time_point now) {
+		clock_type::time_point departure = now;
+		if (m_impairment.bandwidth) {
+			const clock_type::time_point link_free = std::max(m_link_free, now);
+			const double backlog_bytes = std::chrono::duration<double>(link_free - now).count() * m_impairment.bandwidth / 8;
+			if (backlog_bytes + buffer.size() > m_impairment.queue_limit) {
+				return;
+			}
+			m_link_free = link_free + std::chrono::duration_cast<clock_type::duration>(
+				std::chrono::duration<double>(8.0 * buffer.size() / m_impairment.bandwidth));
+			departure = m_link_free;
+		}
+
+		if (!chance(m_impairment.reorder)) {
+			clock_type::duration delay = m_impairment.delay;
+			if (m_impairment.jitter > clock_type::duration::zero()) {
+				delay += clock_type::duration(std::uniform_int_distribution<clock_type::rep>(
+					-m_impairment.jitter.count(), m_impairment.jitter.count())(m_random));
+			}
+			departure = std::max(departure + std::max(delay, clock_type::duration::zero()), m_last_departure);
+			m_last_departure = departure;
+		}
+
+		if (departure <= now && m_pending.empty()) {
+			m_next.async_send(std::move(buffer), endpoint);
+			return;
+		}
+		m_pending.push(Pending{ departure, m_order++, std::move(buffer), endpoint });
+		start_timer(departure);
+	}
+
+	void start_timer(clock_type::time_point deadline) {
+		if (deadline >= m_timer_deadline) {
+			return;
+		}
+
+		// Replaces the pending wait, if any: its handler is called with operation_aborted.
+		m_timer_deadline = deadline;
+		m_timer.expires_at(deadline);
+		m_timer.async_wait([this](const boost::system::error_code& ec) {
+			if (!ec) {
+				this->send_due();
+			}
+		});
+	}
+
+	void send_due() {
+		m_timer_deadline = clock_type::time_point::max();
+		const clock_type::time_point now = clock_type::now();
+		while (!m_pending.empty() && m_pending.top().departure <= now) {
+			Pending due = m_pending.top();
+			m_pending.pop();
+			m_next.async_send(std::move(due.buffer), due.endpoint);
+		}
+		if (!m_pending.empty()) {
+			start_timer(m_pending.top().departure);
+		}
+	}
+
+	Transport& m_next;
+	Impairment m_impairment;
+	std::mt19937_64 m_random;
+	bool m_in_burst;
+	clock_type::time_point m_link_free; // when the simulated link has sent everything given to it
+	clock_type::time_point m_last_departure; // of the datagrams kept in order
+	uint64_t m_order;
+	std::priority_queue<Pending, std::vector<Pending>, std::greater<Pending>> m_pending;
+	boost::asio::steady_timer m_timer;
+	clock_type::time_point m_timer_deadline; // max() when not waiting
+};
+
+}
+
+#endif //RELIABLEUDP_IMPAIREDTRANSPORT_HPP
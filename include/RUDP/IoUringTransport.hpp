@@ -0,0 +1,699 @@
+///////////////////////////////////////////////////////////////////////////////////////////////////
+//                                                                                               //
+// Copyright 2017 Benoît CORTIER                                                                 //
+//                                                                                               //
+// This file is part of RUDP project which is released under the                                 //
+// European Union Public License v1.1. If a copy of the EUPL was                                 //
+// not distributed with this software, you can obtain one at :                                   //
+// https://joinup.ec.europa.eu/community/eupl/og_page/european-union-public-licence-eupl-v11     //
+//                                                                                               //
+///////////////////////////////////////////////////////////////////////////////////////////////////
+
+#ifndef RELIABLEUDP_IOURINGTRANSPORT_HPP
+#define RELIABLEUDP_IOURINGTRANSPORT_HPP
+
+namespace rudp {
+
+const unsigned int DEFAULT_IO_URING_BUFFER_COUNT = 256; // a power of 2
+
+}
+
+#ifdef __linux__
+
+#include <cerrno>
+#include <cstddef> // size_t
+#include <cstdint> // uint8_t, uint16_t, uint32_t, uint64_t
+#include <cstring> // std::memset, std::memcpy
+#include <deque>
+#include <limits> // std::numeric_limits
+#include <memory>
+#include <system_error>
+#include <vector>
+
+#include <boost/asio.hpp>
+
+#include <linux/io_uring.h>
+#include <netinet/in.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include "BufferPool.hpp"
+#include "Transport.hpp"
+
+namespace rudp {
+
+const unsigned int IO_URING_QUEUE_DEPTH = 256;
+
+// Linux io_uring transport.
+//
+// Receives go through a single multishot recvmsg request drawing from a ring of buffers registered
+// with the kernel (provided buffer ring): no syscall per datagram, nor per batch while it stays armed.
+// Sends are queued as submission entries and submitted together, once per io_service handler.
+// Completions are signalled on an eventfd watched by the io_service.
+// Runs given to async_send_segments are single UDP_SEGMENT sends (GSO) when the kernel supports it.
+// UDP_GRO is turned off on the socket: coalesced buffers would not fit in the provided buffers.
+// Requires Linux 6.0 (multishot recvmsg): the constructor checks it, and throws std::system_error otherwise.
+class IoUringTransport : public Transport {
+public:
+	IoUringTransport(boost::asio::io_service& io_service, boost::asio::ip::udp::socket& socket, size_t buffer_size,
+	                 unsigned int buffer_count = DEFAULT_IO_URING_BUFFER_COUNT)
+		: m_io_service(io_service)
+		, m_socket(socket)
+		, m_event(io_service)
+		, m_buffer_count(buffer_count)
+		, m_buffer_size(sizeof(io_uring_recvmsg_out) + sizeof(sockaddr_storage) + buffer_size)
+		, m_receive_armed(false)
+		, m_offload_checked(false)
+		, m_gso(false)
+		, m_submit_posted(false)
+		, m_in_flight(0)
+		, m_alive(std::make_shared<IoUringTransport*>(this))
+	{
+		std::memset(&m_receive_msg, 0, sizeof(m_receive_msg));
+		m_receive_msg.msg_namelen = sizeof(sockaddr_storage);
+
+		io_uring_params params;
+		std::memset(&params, 0, sizeof(params));
+		params.flags = IORING_SETUP_CQSIZE;
+		params.cq_entries = 4 * IO_URING_QUEUE_DEPTH;
+		m_ring_fd = static_cast<int>(::syscall(__NR_io_uring_setup, IO_URING_QUEUE_DEPTH, &params));
+		if (m_ring_fd < 0) {
+			throw_errno("io_uring_setup");
+		}
+		try {
+			map_rings(params);
+			register_buffers();
+			check_multishot_receive();
+
+			const int event_fd = ::eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+			if (event_fd < 0) {
+				throw_errno("eventfd");
+			}
+			m_event.assign(event_fd);
+			if (::syscall(__NR_io_uring_register, m_ring_fd, IORING_REGISTER_EVENTFD, &event_fd, 1) < 0) {
+				throw_errno("IORING_REGISTER_EVENTFD");
+			}
+		} catch (...) {
+			release();
+			throw;
+		}
+		wait_completions();
+	}
+
+	IoUringTransport(const IoUringTransport&) = delete;
+
+	IoUringTransport& operator=(const IoUringTransport&) = delete;
+
+	~IoUringTransport() override { release(); }
+
+	void async_receive(const receive_handler_type& handler) override {
+		m_receive_handler = handler;
+		if (!m_receive_armed) {
+			arm_receive();
+		}
+	}
+
+	void async_send(SendBuffer buffer, const boost::asio::ip::udp::endpoint& endpoint) override {
+		queue_send(std::move(buffer), endpoint, nullptr);
+	}
+
+	void async_send_many(std::vector<SendBuffer> payloads, std::vector<boost::asio::ip::udp::endpoint> endpoints,
+	                     const send_handler_type& handler) override {
+		auto operation = std::make_shared<SendManyOperation>();
+		operation->remaining = endpoints.size();
+		operation->handler = handler;
+		if (endpoints.empty()) {
+			complete_send_many(operation);
+			return;
+		}
+		for (size_t i = 0; i < endpoints.size(); ++i) {
+			queue_send(payloads.size() == 1 ? payloads[0] : std::move(payloads[i]), endpoints[i], operation);
+		}
+	}
+
+	void async_send_segments(std::vector<SendBuffer> datagrams, const boost::asio::ip::udp::endpoint& endpoint) override {
+		check_offload();
+		size_t first = 0;
+		while (first < datagrams.size()) {
+			const size_t count = m_gso ? detail::segment_run(datagrams, first) : 1;
+			if (count == 1) {
+				queue_send(std::move(datagrams[first]), endpoint, nullptr);
+			} else {
+				queue_segments(&datagrams[first], count, endpoint);
+			}
+			first += count;
+		}
+	}
+
+private:
+	static constexpr uint64_t RECEIVE_TAG = std::numeric_limits<uint64_t>::max();
+	static constexpr uint64_t CANCEL_TAG = RECEIVE_TAG - 1;
+	static constexpr uint16_t BUFFER_GROUP = 0;
+
+	struct SendManyOperation {
+		size_t remaining;
+		std::vector<SendError> errors;
+		send_handler_type handler;
+	};
+
+	// Everything a sendmsg entry points to, alive until its completion.
+	struct SendSlot {
+		msghdr msg;
+		std::vector<iovec> iovs;
+		std::vector<SendBuffer> buffers; // several for a UDP_SEGMENT send
+		boost::asio::ip::udp::endpoint endpoint;
+		std::shared_ptr<SendManyOperation> operation;
+		alignas(cmsghdr) uint8_t control[detail::GSO_CONTROL_SIZE];
+	};
+
+	struct Ring {
+		void* memory = MAP_FAILED;
+		size_t size = 0;
+	};
+
+	static void throw_errno(const char* what) {
+		throw std::system_error(errno, std::system_category(), what);
+	}
+
+	void map_rings(const io_uring_params& params) {
+		m_sq_ring.size = params.sq_off.array + params.sq_entries * sizeof(uint32_t);
+		m_cq_ring.size = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+		if (params.features & IORING_FEAT_SINGLE_MMAP) {
+			m_sq_ring.size = m_cq_ring.size = std::max(m_sq_ring.size, m_cq_ring.size);
+		}
+		m_sq_ring.memory = ::mmap(nullptr, m_sq_ring.size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+		                          m_ring_fd, IORING_OFF_SQ_RING);
+		if (m_sq_ring.memory == MAP_FAILED) {
+			throw_errno("mmap");
+		}
+		if (params.features & IORING_FEAT_SINGLE_MMAP) {
+			m_cq_ring.memory = m_sq_ring.memory;
+		} else {
+			m_cq_ring.memory = ::mmap(nullptr, m_cq_ring.size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+			                          m_ring_fd, IORING_OFF_CQ_RING);
+			if (m_cq_ring.memory == MAP_FAILED) {
+				throw_errno("mmap");
+			}
+		}
+		m_sqes.size = params.sq_entries * sizeof(io_uring_sqe);
+		m_sqes.memory = ::mmap(nullptr, m_sqes.size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+		                       m_ring_fd, IORING_OFF_SQES);
+		if (m_sqes.memory == MAP_FAILED) {
+			throw_errno("mmap");
+		}
+
+		uint8_t* sq = static_cast<uint8_t*>(m_sq_ring.memory);
+		m_sq_head = reinterpret_cast<uint32_t*>(sq + params.sq_off.head);
+		m_sq_tail = reinterpret_cast<uint32_t*>(sq + params.sq_off.tail);
+		m_sq_mask = *reinterpret_cast<uint32_t*>(sq + params.sq_off.ring_mask);
+		m_sq_entries = params.sq_entries;
+		uint32_t* array = reinterpret_cast<uint32_t*>(sq + params.sq_off.array);
+		for (uint32_t i = 0; i < params.sq_entries; ++i) {
+			array[i] = i; // entry i of the ring always uses sqe i
+		}
+
+		uint8_t* cq = static_cast<uint8_t*>(m_cq_ring.memory);
+		m_cq_head = reinterpret_cast<uint32_t*>(cq + params.cq_off.head);
+		m_cq_tail = reinterpret_cast<uint32_t*>(cq + params.cq_off.tail);
+		m_cq_mask = *reinterpret_cast<uint32_t*>(cq + params.cq_off.ring_mask);
+		m_cqes = reinterpret_cast<io_uring_cqe*>(cq + params.cq_off.cqes);
+		m_max_in_flight = params.cq_entries / 2; // the other half is left for the datagrams received
+		m_sq_pending = 0;
+	}
+
+	void register_buffers() {
+		m_buffers.resize(size_t(m_buffer_count) * m_buffer_size);
+		m_buffer_ring.size = m_buffer_count * sizeof(io_uring_buf);
+		m_buffer_ring.memory = ::mmap(nullptr, m_buffer_ring.size, PROT_READ | PROT_WRITE,
+		                              MAP_ANONYMOUS | MAP_PRIVATE, -1, 0);
+		if (m_buffer_ring.memory == MAP_FAILED) {
+			throw_errno("mmap");
+		}
+
+		io_uring_buf_reg registration;
+		std::memset(&registration, 0, sizeof(registration));
+		registration.ring_addr = reinterpret_cast<uint64_t>(m_buffer_ring.memory);
+		registration.ring_entries = m_buffer_count;
+		registration.bgid = BUFFER_GROUP;
+		if (::syscall(__NR_io_uring_register, m_ring_fd, IORING_REGISTER_PBUF_RING, &registration, 1) < 0) {
+			throw_errno("IORING_REGISTER_PBUF_RING");
+		}
+
+		m_buffer_tail = 0;
+		for (uint16_t id = 0; id < m_buffer_count; ++id) {
+			recycle_buffer(id);
+		}
+		publish_buffers();
+	}
+
+	// Provided buffer rings came with Linux 5.19, multishot recvmsg with 6.0: before it, the receive request
+	// fails, or is a single shot. Tried on a throwaway socket sending a datagram to itself.
+	void check_multishot_receive() {
+		const int fd = ::socket(AF_INET, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+		if (fd < 0) {
+			throw_errno("socket");
+		}
+		sockaddr_in address;
+		std::memset(&address, 0, sizeof(address));
+		address.sin_family = AF_INET;
+		address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+		socklen_t address_size = sizeof(address);
+		const uint8_t probe = 0; // not empty: an empty datagram ends a multishot receive, like the end of a stream
+		if (::bind(fd, reinterpret_cast<sockaddr*>(&address), address_size) < 0
+		    || ::getsockname(fd, reinterpret_cast<sockaddr*>(&address), &address_size) < 0
+		    || ::sendto(fd, &probe, sizeof(probe), 0, reinterpret_cast<sockaddr*>(&address), address_size) < 0) {
+			const int error = errno;
+			::close(fd);
+			throw std::system_error(error, std::system_category(), "multishot recvmsg check");
+		}
+
+		queue_receive(fd);
+		m_receive_armed = true;
+		submit();
+		bool supported = false;
+		bool completed = false;
+		while (!completed) {
+			if (::syscall(__NR_io_uring_enter, m_ring_fd, 0, 1, IORING_ENTER_GETEVENTS, nullptr, 0) < 0) {
+				if (errno == EINTR) {
+					continue;
+				}
+				break;
+			}
+			uint32_t head = *m_cq_head;
+			const uint32_t tail = __atomic_load_n(m_cq_tail, __ATOMIC_ACQUIRE);
+			for (; head != tail; ++head) {
+				const io_uring_cqe& cqe = m_cqes[head & m_cq_mask];
+				completed = true;
+				supported = cqe.res >= 0 && (cqe.flags & IORING_CQE_F_MORE);
+				m_receive_armed = (cqe.flags & IORING_CQE_F_MORE) != 0;
+				if (cqe.flags & IORING_CQE_F_BUFFER) {
+					recycle_buffer(static_cast<uint16_t>(cqe.flags >> IORING_CQE_BUFFER_SHIFT));
+				}
+			}
+			__atomic_store_n(m_cq_head, head, __ATOMIC_RELEASE);
+		}
+		publish_buffers();
+		cancel_requests();
+		::close(fd);
+		if (!supported) {
+			throw std::system_error(EOPNOTSUPP, std::system_category(), "multishot recvmsg");
+		}
+	}
+
+	void release() noexcept {
+		if (m_ring_fd >= 0) {
+			cancel_requests();
+			::close(m_ring_fd);
+			m_ring_fd = -1;
+		}
+		for (Ring* ring : { &m_sq_ring, &m_cq_ring, &m_sqes, &m_buffer_ring }) {
+			if (ring->memory != MAP_FAILED && (ring != &m_cq_ring || m_cq_ring.memory != m_sq_ring.memory)) {
+				::munmap(ring->memory, ring->size);
+			}
+		}
+		m_sq_ring.memory = m_cq_ring.memory = m_sqes.memory = m_buffer_ring.memory = MAP_FAILED;
+		boost::system::error_code ignored;
+		m_event.close(ignored);
+	}
+
+	// Cancels the requests in flight and waits for their completions: the ring is torn down asynchronously once
+	// closed, and until then the kernel may still receive into the provided buffers and read the send slots.
+	// Kernels without IORING_ASYNC_CANCEL_ANY (before 5.19) only get the multishot receive cancelled, sends
+	// complete on their own.
+	void cancel_requests() noexcept {
+		if (!m_receive_armed && m_in_flight == 0) {
+			return;
+		}
+		submit(); // so that the kernel knows every request counted as in flight
+		queue_cancel(IORING_ASYNC_CANCEL_ANY, 0);
+		submit();
+
+		bool cancelled = false;
+		bool any_supported = true;
+		while (m_receive_armed || m_in_flight > 0 || !cancelled) {
+			if (::syscall(__NR_io_uring_enter, m_ring_fd, 0, 1, IORING_ENTER_GETEVENTS, nullptr, 0) < 0) {
+				if (errno == EINTR) {
+					continue;
+				}
+				return; // nothing more can be waited for
+			}
+
+			uint32_t head = *m_cq_head;
+			const uint32_t tail = __atomic_load_n(m_cq_tail, __ATOMIC_ACQUIRE);
+			for (; head != tail; ++head) {
+				const io_uring_cqe& cqe = m_cqes[head & m_cq_mask];
+				if (cqe.user_data == RECEIVE_TAG) {
+					m_receive_armed = m_receive_armed && (cqe.flags & IORING_CQE_F_MORE);
+				} else if (cqe.user_data == CANCEL_TAG) {
+					cancelled = true;
+					if (cqe.res == -EINVAL && any_supported) {
+						any_supported = false;
+						cancelled = false;
+						queue_cancel(0, RECEIVE_TAG);
+					}
+				} else {
+					--m_in_flight;
+				}
+			}
+			__atomic_store_n(m_cq_head, head, __ATOMIC_RELEASE);
+			submit();
+		}
+	}
+
+	// Cancels the requests matching `flags`, or the one with `user_data` when 0.
+	void queue_cancel(uint32_t flags, uint64_t user_data) noexcept {
+		io_uring_sqe* sqe = next_sqe(); // the queue was just submitted, it has room
+		sqe->opcode = IORING_OP_ASYNC_CANCEL;
+		sqe->fd = -1;
+		sqe->addr = user_data;
+		sqe->cancel_flags = flags;
+		sqe->user_data = CANCEL_TAG;
+	}
+
+	// Indexed by hand: in C++, the bufs flexible array of io_uring_buf_ring is laid out after an empty struct
+	// and does not start at offset 0 like the kernel's.
+	io_uring_buf* buffer_ring() noexcept { return static_cast<io_uring_buf*>(m_buffer_ring.memory); }
+
+	// Hands the buffer back to the kernel once publish_buffers() is called.
+	void recycle_buffer(uint16_t id) noexcept {
+		io_uring_buf& entry = buffer_ring()[m_buffer_tail & (m_buffer_count - 1)];
+		entry.addr = reinterpret_cast<uint64_t>(m_buffers.data() + size_t(id) * m_buffer_size);
+		entry.len = static_cast<uint32_t>(m_buffer_size);
+		entry.bid = id;
+		++m_buffer_tail;
+	}
+
+	void publish_buffers() noexcept {
+		__atomic_store_n(&reinterpret_cast<io_uring_buf_ring*>(m_buffer_ring.memory)->tail, m_buffer_tail, __ATOMIC_RELEASE);
+	}
+
+	// Returns nullptr if the submission queue is full.
+	io_uring_sqe* next_sqe() noexcept {
+		const uint32_t head = __atomic_load_n(m_sq_head, __ATOMIC_ACQUIRE);
+		const uint32_t tail = *m_sq_tail + m_sq_pending;
+		if (tail - head >= m_sq_entries) {
+			return nullptr;
+		}
+		io_uring_sqe* sqe = static_cast<io_uring_sqe*>(m_sqes.memory) + (tail & m_sq_mask);
+		std::memset(sqe, 0, sizeof(*sqe));
+		++m_sq_pending;
+		return sqe;
+	}
+
+	void submit() {
+		m_submit_posted = false;
+		if (m_sq_pending == 0) {
+			return;
+		}
+		__atomic_store_n(m_sq_tail, *m_sq_tail + m_sq_pending, __ATOMIC_RELEASE);
+		const unsigned int count = m_sq_pending;
+		m_sq_pending = 0;
+		while (::syscall(__NR_io_uring_enter, m_ring_fd, count, 0, 0, nullptr, 0) < 0 && errno == EINTR) {}
+	}
+
+	// Entries queued during a handler are submitted together, right after it.
+	void schedule_submit() {
+		if (!m_submit_posted) {
+			m_submit_posted = true;
+			std::weak_ptr<IoUringTransport*> alive = m_alive;
+			m_io_service.post([alive]() {
+				if (auto transport = alive.lock()) {
+					(*transport)->submit();
+				}
+			});
+		}
+	}
+
+	// Done once the socket is open: a client socket only is once connected.
+	void check_offload() {
+		if (m_offload_checked || !m_socket.is_open()) {
+			return;
+		}
+		m_offload_checked = true;
+
+		int value = 0;
+		socklen_t size = sizeof(value);
+		m_gso = ::getsockopt(m_socket.native_handle(), IPPROTO_UDP, UDP_SEGMENT, &value, &size) == 0;
+		const int disabled = 0; // may have been enabled by the asio transport
+		::setsockopt(m_socket.native_handle(), IPPROTO_UDP, UDP_GRO, &disabled, sizeof(disabled));
+	}
+
+	void arm_receive() {
+		check_offload();
+		queue_receive(m_socket.native_handle());
+		m_receive_armed = true;
+		schedule_submit();
+	}
+
+	void queue_receive(int fd) {
+		io_uring_sqe* sqe = next_sqe();
+		if (!sqe) {
+			submit();
+			sqe = next_sqe();
+		}
+		sqe->opcode = IORING_OP_RECVMSG;
+		sqe->fd = fd;
+		sqe->addr = reinterpret_cast<uint64_t>(&m_receive_msg);
+		sqe->flags = IOSQE_BUFFER_SELECT;
+		sqe->buf_group = BUFFER_GROUP;
+		sqe->ioprio = IORING_RECV_MULTISHOT;
+		sqe->user_data = RECEIVE_TAG;
+	}
+
+	uint32_t acquire_slot() {
+		if (!m_free_slots.empty()) {
+			const uint32_t index = m_free_slots.back();
+			m_free_slots.pop_back();
+			return index;
+		}
+		m_slots.emplace_back(new SendSlot());
+		return static_cast<uint32_t>(m_slots.size() - 1);
+	}
+
+	void queue_send(SendBuffer buffer, const boost::asio::ip::udp::endpoint& endpoint,
+	                const std::shared_ptr<SendManyOperation>& operation) {
+		const uint32_t index = acquire_slot();
+		SendSlot& slot = *m_slots[index];
+		slot.buffers.push_back(std::move(buffer));
+		slot.endpoint = endpoint;
+		slot.operation = operation;
+		prepare_slot(slot);
+		queue_slot(index);
+	}
+
+	void queue_segments(SendBuffer* segments, size_t count, const boost::asio::ip::udp::endpoint& endpoint) {
+		const uint32_t index = acquire_slot();
+		SendSlot& slot = *m_slots[index];
+		for (size_t i = 0; i < count; ++i) {
+			slot.buffers.push_back(std::move(segments[i]));
+		}
+		slot.endpoint = endpoint;
+		prepare_slot(slot);
+		detail::set_segment_size(slot.msg, slot.control, slot.buffers[0].size());
+		queue_slot(index);
+	}
+
+	void prepare_slot(SendSlot& slot) {
+		slot.iovs.resize(slot.buffers.size());
+		for (size_t i = 0; i < slot.buffers.size(); ++i) {
+			slot.iovs[i].iov_base = slot.buffers[i].data();
+			slot.iovs[i].iov_len = slot.buffers[i].size();
+		}
+		slot.msg = msghdr();
+		slot.msg.msg_name = slot.endpoint.data();
+		slot.msg.msg_namelen = static_cast<socklen_t>(slot.endpoint.size());
+		slot.msg.msg_iov = slot.iovs.data();
+		slot.msg.msg_iovlen = slot.iovs.size();
+	}
+
+	void queue_slot(uint32_t index) {
+		if (m_in_flight >= m_max_in_flight) { // would overflow the completion queue
+			m_backlog.push_back(index);
+			return;
+		}
+		submit_send(index);
+	}
+
+	void submit_send(uint32_t index) {
+		io_uring_sqe* sqe = next_sqe();
+		if (!sqe) {
+			submit();
+			sqe = next_sqe();
+		}
+		sqe->opcode = IORING_OP_SENDMSG;
+		sqe->fd = m_socket.native_handle();
+		sqe->addr = reinterpret_cast<uint64_t>(&m_slots[index]->msg);
+		sqe->user_data = index;
+		++m_in_flight;
+		schedule_submit();
+	}
+
+	void wait_completions() {
+		m_event.async_wait(boost::asio::posix::stream_descriptor::wait_read, [this](auto ec) {
+			if (!ec) {
+				this->handle_completions();
+			}
+		});
+	}
+
+	void handle_completions() {
+		uint64_t counter;
+		while (::read(m_event.native_handle(), &counter, sizeof(counter)) < 0 && errno == EINTR) {}
+
+		m_datagrams.clear();
+		m_used_buffers.clear();
+		bool rearm = false;
+		boost::system::error_code receive_error;
+		uint32_t head = *m_cq_head;
+		const uint32_t tail = __atomic_load_n(m_cq_tail, __ATOMIC_ACQUIRE);
+		for (; head != tail; ++head) {
+			const io_uring_cqe& cqe = m_cqes[head & m_cq_mask];
+			if (cqe.user_data == RECEIVE_TAG) {
+				if (!(cqe.flags & IORING_CQE_F_MORE) && (cqe.res >= 0 || cqe.res == -ENOBUFS)) { // out of buffers
+					rearm = true;
+				} else if (!(cqe.flags & IORING_CQE_F_MORE)) {
+					m_receive_armed = false;
+					receive_error = boost::system::error_code(-cqe.res, boost::asio::error::get_system_category());
+				}
+				if (cqe.flags & IORING_CQE_F_BUFFER) {
+					add_datagram(cqe);
+				}
+			} else {
+				complete_send(static_cast<uint32_t>(cqe.user_data), cqe.res);
+			}
+		}
+		__atomic_store_n(m_cq_head, head, __ATOMIC_RELEASE);
+
+		if ((!m_datagrams.empty() || receive_error) && m_receive_handler) {
+			receive_handler_type handler = std::move(m_receive_handler);
+			m_receive_handler = receive_handler_type();
+			handler(receive_error, m_datagrams.data(), receive_error ? 0 : m_datagrams.size());
+		}
+		for (const uint16_t id : m_used_buffers) {
+			recycle_buffer(id);
+		}
+		publish_buffers();
+
+		if (rearm) {
+			m_receive_armed = false;
+			if (m_receive_handler) {
+				arm_receive();
+			}
+		}
+		while (!m_backlog.empty() && m_in_flight < m_max_in_flight) {
+			submit_send(m_backlog.front());
+			m_backlog.pop_front();
+		}
+		wait_completions();
+	}
+
+	void add_datagram(const io_uring_cqe& cqe) {
+		const uint16_t id = static_cast<uint16_t>(cqe.flags >> IORING_CQE_BUFFER_SHIFT);
+		m_used_buffers.push_back(id);
+		if (cqe.res < 0) {
+			return;
+		}
+
+		const uint8_t* buffer = m_buffers.data() + size_t(id) * m_buffer_size;
+		io_uring_recvmsg_out out;
+		std::memcpy(&out, buffer, sizeof(out));
+		if (out.flags & MSG_TRUNC) { // larger than the receive buffer
+			return;
+		}
+		const uint8_t* name = buffer + sizeof(io_uring_recvmsg_out);
+		const size_t name_size = std::min<size_t>(out.namelen, sizeof(sockaddr_storage));
+
+		Datagram datagram;
+		datagram.data = name + m_receive_msg.msg_namelen + m_receive_msg.msg_controllen;
+		datagram.size = out.payloadlen;
+		std::memcpy(datagram.endpoint.data(), name, name_size);
+		datagram.endpoint.resize(name_size);
+		m_datagrams.push_back(datagram);
+	}
+
+	void complete_send(uint32_t index, int32_t result) {
+		--m_in_flight;
+		SendSlot& slot = *m_slots[index];
+		if (slot.operation) {
+			if (result < 0) {
+				slot.operation->errors.push_back(
+					{ slot.endpoint, boost::system::error_code(-result, boost::asio::error::get_system_category()) });
+			}
+			if (--slot.operation->remaining == 0) {
+				complete_send_many(slot.operation);
+			}
+		}
+		std::vector<SendBuffer> segments;
+		if (slot.buffers.size() > 1 && (detail::is_gso_unsupported(-result) || result == -EINVAL)) {
+			m_gso = m_gso && !detail::is_gso_unsupported(-result);
+			segments.swap(slot.buffers); // sent again one by one
+		}
+		slot.buffers.clear();
+		slot.operation.reset();
+		m_free_slots.push_back(index);
+
+		const boost::asio::ip::udp::endpoint endpoint = slot.endpoint;
+		for (auto& segment : segments) {
+			queue_send(std::move(segment), endpoint, nullptr);
+		}
+	}
+
+	static void complete_send_many(const std::shared_ptr<SendManyOperation>& operation) {
+		if (operation->handler) {
+			operation->handler(std::move(operation->errors));
+		}
+	}
+
+	boost::asio::io_service& m_io_service;
+	boost::asio::ip::udp::socket& m_socket;
+	boost::asio::posix::stream_descriptor m_event;
+	int m_ring_fd = -1;
+
+	Ring m_sq_ring;
+	Ring m_cq_ring;
+	Ring m_sqes;
+	uint32_t* m_sq_head;
+	uint32_t* m_sq_tail;
+	uint32_t m_sq_mask;
+	uint32_t m_sq_entries;
+	uint32_t m_sq_pending; // filled entries not yet published to the kernel
+	uint32_t* m_cq_head;
+	uint32_t* m_cq_tail;
+	uint32_t m_cq_mask;
+	io_uring_cqe* m_cqes;
+
+	// Provided buffer ring: m_buffer_count buffers, each holding an io_uring_recvmsg_out, the source address
+	// and the datagram.
+	Ring m_buffer_ring;
+	unsigned int m_buffer_count;
+	size_t m_buffer_size;
+	std::vector<uint8_t> m_buffers;
+	uint16_t m_buffer_tail;
+
+	msghdr m_receive_msg; // layout of the multishot receive buffers
+	receive_handler_type m_receive_handler;
+	bool m_receive_armed;
+	std::vector<Datagram> m_datagrams;
+	std::vector<uint16_t> m_used_buffers;
+
+	bool m_offload_checked;
+	bool m_gso;
+
+	bool m_submit_posted;
+	std::vector<std::unique_ptr<SendSlot>> m_slots;
+	std::vector<uint32_t> m_free_slots;
+	std::deque<uint32_t> m_backlog; // slots waiting for room in the completion queue
+	uint32_t m_in_flight;
+	uint32_t m_max_in_flight;
+
+	std::shared_ptr<IoUringTransport*> m_alive; // lets posted submissions outlive the transport
+};
+
+}
+
+#endif
+
+#endif //RELIABLEUDP_IOURINGTRANSPORT_HPP
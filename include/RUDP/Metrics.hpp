@@ -0,0 +1,306 @@
+///////////////////////////////////////////////////////////////////////////////////////////////////
+//                                                                                               //
+// Copyright 2017 Benoît CORTIER                                                                 //
+//                                                                                               //
+// This file is part of RUDP project which is released under the                                 //
+// European Union Public License v1.1. If a copy of the EUPL was                                 //
+// not distributed with this software, you can obtain one at :                                   //
+// https://joinup.ec.europa.eu/community/eupl/og_page/european-union-public-licence-eupl-v11     //
+//                                                                                               //
+///////////////////////////////////////////////////////////////////////////////////////////////////
+
+#ifndef RELIABLEUDP_METRICS_HPP
+#define RELIABLEUDP_METRICS_HPP
+
+#include <array>
+#include <atomic>
+#include <cstddef> // size_t
+#include <cstdint> // uint64_t
+
+#include "utility.hpp"
+
+namespace rudp {
+
+// Why a received datagram was dropped by the socket.
+enum class DropReason : uint8_t {
+	BAD_PROTOCOL, // could not be parsed
+	UNKNOWN_PEER, // sent by an unknown peer not connecting, or answering a handshake
+	STALE_CONNECTION_ID, // compact header naming no peer, or another peer than its sender
+	TRUNCATED, // coalesced message running past the end of the datagram
+	COUNT
+};
+
+const size_t DROP_REASON_COUNT = static_cast<size_t>(DropReason::COUNT);
+
+// Counter written by a single thread and read by any: relaxed loads and stores, no read-modify-write.
+class Counter {
+public:
+	void add(uint64_t n = 1) noexcept { m_value.store(m_value.load(std::memory_order_relaxed) + n, std::memory_order_relaxed); }
+
+	uint64_t load() const noexcept { return m_value.load(std::memory_order_relaxed); }
+
+private:
+	std::atomic<uint64_t> m_value{0};
+};
+
+// Log-linear buckets of durations, in nanoseconds, as HdrHistogram lays them out: each power of two is
+// split into SUB_BUCKET_COUNT buckets, which bounds the relative error to 1 / SUB_BUCKET_COUNT.
+// Durations of 2^MAX_MAGNITUDE ns (about 18 minutes) and more land in the last bucket.
+struct HistogramLayout {
+	static constexpr unsigned int SUB_BUCKET_BITS = 4;
+	static constexpr uint64_t SUB_BUCKET_COUNT = uint64_t(1) << SUB_BUCKET_BITS;
+	static constexpr unsigned int MAX_MAGNITUDE = 40;
+	static constexpr size_t BUCKET_COUNT = (MAX_MAGNITUDE - SUB_BUCKET_BITS + 1) * SUB_BUCKET_COUNT;
+
+	static size_t bucket(uint64_t value) noexcept {
+		if (value < SUB_BUCKET_COUNT) {
+			return static_cast<size_t>(value);
+		}
+		if (value >> MAX_MAGNITUDE) {
+			return BUCKET_COUNT - 1;
+		}
+		const unsigned int magnitude = log2(value);
+		const unsigned int shift = magnitude - SUB_BUCKET_BITS;
+		return (magnitude - SUB_BUCKET_BITS + 1) * SUB_BUCKET_COUNT + ((value >> shift) & (SUB_BUCKET_COUNT - 1));
+	}
+
+	// Highest value of the bucket.
+	static uint64_t highest(size_t bucket) noexcept {
+		if (bucket < SUB_BUCKET_COUNT) {
+			return bucket;
+		}
+		const unsigned int shift = static_cast<unsigned int>(bucket / SUB_BUCKET_COUNT) - 1;
+		const uint64_t lowest = (SUB_BUCKET_COUNT + bucket % SUB_BUCKET_COUNT) << shift;
+		return lowest + (uint64_t(1) << shift) - 1;
+	}
+
+private:
+	static unsigned int log2(uint64_t value) noexcept {
+#if defined(__GNUC__)
+		return 63 - static_cast<unsigned int>(__builtin_clzll(value));
+#else
+		unsigned int result = 0;
+		while (value >>= 1) {
+			++result;
+		}
+		return result;
+#endif
+	}
+};
+
+// Copy of a rudp::Histogram.
+struct HistogramSnapshot {
+	std::array<uint64_t, HistogramLayout::BUCKET_COUNT> counts{};
+	uint64_t count = 0;
+	uint64_t sum = 0; // nanoseconds
+
+	clock_type::duration mean() const noexcept {
+		return count ? std::chrono::nanoseconds(sum / count) : clock_type::duration::zero();
+	}
+
+	// Smallest duration that `quantile` (between 0 and 1) of the recorded durations do not exceed,
+	// to the precision of the buckets.
+	clock_type::duration percentile(double quantile) const noexcept {
+		if (count == 0) {
+			return clock_type::duration::zero();
+		}
+		const double target = quantile * static_cast<double>(count);
+		uint64_t seen = 0;
+		for (size_t i = 0; i < counts.size(); ++i) {
+			seen += counts[i];
+			if (counts[i] && static_cast<double>(seen) >= target) {
+				return std::chrono::nanoseconds(HistogramLayout::highest(i));
+			}
+		}
+		return std::chrono::nanoseconds(HistogramLayout::highest(counts.size() - 1));
+	}
+
+	HistogramSnapshot& operator+=(const HistogramSnapshot& other) noexcept {
+		for (size_t i = 0; i < counts.size(); ++i) {
+			counts[i] += other.counts[i];
+		}
+		count += other.count;
+		sum += other.sum;
+		return *this;
+	}
+};
+
+// Durations recorded by a single thread, snapshot by any.
+class Histogram {
+public:
+	void record(clock_type::duration duration) noexcept {
+		const int64_t ns = std::chrono::duration_cast<std::chrono::nanoseconds>(duration).count();
+		const uint64_t value = ns > 0 ? static_cast<uint64_t>(ns) : 0;
+		m_counts[HistogramLayout::bucket(value)].add();
+		m_count.add();
+		m_sum.add(value);
+	}
+
+	// Buckets are read one by one while they may be written: count and sum may be slightly off the buckets.
+	HistogramSnapshot snapshot() const noexcept {
+		HistogramSnapshot snapshot;
+		for (size_t i = 0; i < m_counts.size(); ++i) {
+			snapshot.counts[i] = m_counts[i].load();
+		}
+		snapshot.count = m_count.load();
+		snapshot.sum = m_sum.load();
+		return snapshot;
+	}
+
+private:
+	std::array<Counter, HistogramLayout::BUCKET_COUNT> m_counts;
+	Counter m_count;
+	Counter m_sum;
+};
+
+// Copy of the counters of a socket, see rudp::SocketMetrics.
+struct MetricsSnapshot {
+	uint64_t received_packets = 0;
+	uint64_t received_bytes = 0;
+	uint64_t sent_packets = 0;
+	uint64_t sent_bytes = 0;
+	std::array<uint64_t, DROP_REASON_COUNT> drops{};
+	uint64_t connections = 0;
+	uint64_t disconnections = 0;
+	uint64_t timeouts = 0;
+	HistogramSnapshot handler_latency; // of the receive handler
+	HistogramSnapshot rtt; // round trip time samples, for protocols that measure it
+
+	uint64_t dropped(DropReason reason) const noexcept { return drops[static_cast<size_t>(reason)]; }
+
+	// Sums the snapshots of several sockets, e.g. of the shards of a rudp::ShardedSocket.
+	MetricsSnapshot& operator+=(const MetricsSnapshot& other) noexcept {
+		received_packets += other.received_packets;
+		received_bytes += other.received_bytes;
+		sent_packets += other.sent_packets;
+		sent_bytes += other.sent_bytes;
+		for (size_t i = 0; i < drops.size(); ++i) {
+			drops[i] += other.drops[i];
+		}
+		connections += other.connections;
+		disconnections += other.disconnections;
+		timeouts += other.timeouts;
+		handler_latency += other.handler_latency;
+		rtt += other.rtt;
+		return *this;
+	}
+};
+
+// Per-peer counters of rudp::SocketMetrics, kept and read on the socket's thread.
+struct PeerMetrics {
+	uint64_t received_packets = 0;
+	uint64_t received_bytes = 0;
+	uint64_t sent_packets = 0; // as given to the socket, before fragmentation
+	uint64_t sent_bytes = 0;
+
+	void on_receive(size_t bytes) noexcept {
+		++received_packets;
+		received_bytes += bytes;
+	}
+
+	void on_send(size_t bytes) noexcept {
+		++sent_packets;
+		sent_bytes += bytes;
+	}
+};
+
+// Metrics policy of rudp::Socket, counting what the socket does.
+//
+// Counters are only written by the thread running the socket's io_service, with relaxed atomic stores:
+// snapshot() may be called from any thread and never blocks the socket. Each counter is exact, but a
+// snapshot taken while the socket runs is not an atomic picture of all of them.
+// Sent packets and bytes are counted when handed to the transport.
+class SocketMetrics {
+public:
+	static constexpr bool ENABLED = true;
+
+	using peer_metrics_type = rudp::PeerMetrics;
+
+	void on_receive(size_t bytes) noexcept {
+		m_received_packets.add();
+		m_received_bytes.add(bytes);
+	}
+
+	void on_send(size_t packets, size_t bytes) noexcept {
+		m_sent_packets.add(packets);
+		m_sent_bytes.add(bytes);
+	}
+
+	void on_drop(DropReason reason) noexcept { m_drops[static_cast<size_t>(reason)].add(); }
+
+	void on_connection() noexcept { m_connections.add(); }
+
+	void on_disconnection() noexcept { m_disconnections.add(); }
+
+	void on_timeout() noexcept { m_timeouts.add(); }
+
+	void record_handler_latency(clock_type::duration latency) noexcept { m_handler_latency.record(latency); }
+
+	void record_rtt(clock_type::duration rtt) noexcept { m_rtt.record(rtt); }
+
+	MetricsSnapshot snapshot() const noexcept {
+		MetricsSnapshot snapshot;
+		snapshot.received_packets = m_received_packets.load();
+		snapshot.received_bytes = m_received_bytes.load();
+		snapshot.sent_packets = m_sent_packets.load();
+		snapshot.sent_bytes = m_sent_bytes.load();
+		for (size_t i = 0; i < m_drops.size(); ++i) {
+			snapshot.drops[i] = m_drops[i].load();
+		}
+		snapshot.connections = m_connections.load();
+		snapshot.disconnections = m_disconnections.load();
+		snapshot.timeouts = m_timeouts.load();
+		snapshot.handler_latency = m_handler_latency.snapshot();
+		snapshot.rtt = m_rtt.snapshot();
+		return snapshot;
+	}
+
+private:
+	Counter m_received_packets;
+	Counter m_received_bytes;
+	Counter m_sent_packets;
+	Counter m_sent_bytes;
+	std::array<Counter, DROP_REASON_COUNT> m_drops;
+	Counter m_connections;
+	Counter m_disconnections;
+	Counter m_timeouts;
+	Histogram m_handler_latency;
+	Histogram m_rtt;
+};
+
+struct NoPeerMetrics {
+	void on_receive(size_t /*bytes*/) noexcept {}
+
+	void on_send(size_t /*bytes*/) noexcept {}
+};
+
+// Default metrics policy of rudp::Socket: counts nothing and compiles to nothing.
+class NoMetrics {
+public:
+	static constexpr bool ENABLED = false;
+
+	using peer_metrics_type = rudp::NoPeerMetrics;
+
+	void on_receive(size_t /*bytes*/) noexcept {}
+
+	void on_send(size_t /*packets*/, size_t /*bytes*/) noexcept {}
+
+	void on_drop(DropReason /*reason*/) noexcept {}
+
+	void on_connection() noexcept {}
+
+	void on_disconnection() noexcept {}
+
+	void on_timeout() noexcept {}
+
+	void record_handler_latency(clock_type::duration /*latency*/) noexcept {}
+
+	void record_rtt(clock_type::duration /*rtt*/) noexcept {}
+
+	// All zeros.
+	MetricsSnapshot snapshot() const noexcept { return MetricsSnapshot(); }
+};
+
+}
+
+#endif //RELIABLEUDP_METRICS_HPP
@@ -0,0 +1,75 @@
+///////////////////////////////////////////////////////////////////////////////////////////////////
+//                                                                                               //
+// Copyright 2017 Benoît CORTIER                                                                 //
+//                                                                                               //
+// This file is part of RUDP project which is released under the                                 //
+// European Union Public License v1.1. If a copy of the EUPL was                                 //
+// not distributed with this software, you can obtain one at :                                   //
+// https://joinup.ec.europa.eu/community/eupl/og_page/european-union-public-licence-eupl-v11     //
+//                                                                                               //
+///////////////////////////////////////////////////////////////////////////////////////////////////
+
+#ifndef RELIABLEUDP_MPSCQUEUE_HPP
+#define RELIABLEUDP_MPSCQUEUE_HPP
+
+#include <atomic>
+#include <utility> // std::move
+
+namespace rudp {
+
+// Unbounded multiple-producer single-consumer queue (Vyukov's node-based queue).
+//
+// push() is wait-free and may be called from any thread, try_pop() from the consumer thread only.
+// A push still in progress may be invisible to try_pop() until it completes.
+template <typename T>
+class MpscQueue {
+public:
+	MpscQueue() : m_head(new Node()), m_tail(m_head.load(std::memory_order_relaxed)) {}
+
+	MpscQueue(const MpscQueue&) = delete;
+
+	MpscQueue& operator=(const MpscQueue&) = delete;
+
+	~MpscQueue() {
+		while (m_tail) {
+			Node* next = m_tail->next.load(std::memory_order_relaxed);
+			delete m_tail;
+			m_tail = next;
+		}
+	}
+
+	void push(T value) {
+		Node* node = new Node(std::move(value));
+		Node* previous = m_head.exchange(node, std::memory_order_acq_rel);
+		previous->next.store(node, std::memory_order_release);
+	}
+
+	// Returns false if the queue is empty.
+	bool try_pop(T& value) {
+		Node* next = m_tail->next.load(std::memory_order_acquire);
+		if (!next) {
+			return false;
+		}
+		value = std::move(next->value);
+		delete m_tail;
+		m_tail = next; // next becomes the stub, its value has been moved out
+		return true;
+	}
+
+private:
+	struct Node {
+		Node() : next(nullptr) {}
+
+		explicit Node(T value) : next(nullptr), value(std::move(value)) {}
+
+		std::atomic<Node*> next;
+		T value;
+	};
+
+	std::atomic<Node*> m_head; // last pushed, producers side
+	Node* m_tail; // stub before the first element, consumer side
+};
+
+}
+
+#endif //RELIABLEUDP_MPSCQUEUE_HPP
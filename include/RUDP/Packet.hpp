@@ -13,35 +13,107 @@
 #define RELIABLEUDP_PACKET_HPP
 
 #include <cstdint> // uint8_t, uint16_t, uint32_t
+#include <cstddef> // size_t
 #include <vector>
-#include <exception>
+
+#include "WireFormat.hpp"
 
 namespace rudp {
 
-struct bad_header_exception : std::runtime_error {
-	bad_header_exception() : std::runtime_error("Bad header") {}
-};
+// Non-owning view over a contiguous range of bytes.
+class ByteSpan {
+public:
+	using value_type = uint8_t;
+	using const_iterator = const uint8_t*;
+
+	ByteSpan() noexcept : m_data(nullptr), m_size(0) {}
+
+	ByteSpan(const uint8_t* data, size_t size) noexcept : m_data(data), m_size(size) {}
+
+	const uint8_t* data() const noexcept { return m_data; }
+
+	size_t size() const noexcept { return m_size; }
+
+	bool empty() const noexcept { return m_size == 0; }
+
+	const_iterator begin() const noexcept { return m_data; }
+
+	const_iterator end() const noexcept { return m_data + m_size; }
 
-struct bad_protocol_exception : std::runtime_error {
-	bad_protocol_exception() : std::runtime_error("Bad protocol") {}
+	uint8_t operator[](size_t i) const noexcept { return m_data[i]; }
+
+private:
+	const uint8_t* m_data;
+	size_t m_size;
 };
 
 template<typename Header>
-class Packet {
+class Packet;
+
+template<typename Header, typename Metrics>
+class Socket;
+
+// Non-owning packet pointing into a receive buffer.
+// Only valid for the duration of the handler it is given to: call to_packet() to keep the data.
+template<typename Header>
+class PacketView {
 public:
-	Packet(std::vector<uint8_t> packet_buffer) noexcept(false) {
-		if (packet_buffer.size() < sizeof(Header)) {
-			throw bad_header_exception();
-		}
+	PacketView(const uint8_t* data, size_t size) noexcept(false) {
+		const size_t header_size = WireFormat<Header>::read(data, size, m_header, m_flags, m_connection_id);
+		m_message = ByteSpan(data + header_size, size - header_size);
+		m_datagram = ByteSpan(data, size);
+	}
 
-		m_header = *reinterpret_cast<Header*>(packet_buffer.data());
-		if (m_header.protocol != Header::PROTOCOL_ID) {
-			throw bad_protocol_exception();
-		}
+	// The whole datagram, header included.
+	ByteSpan get_datagram() const noexcept {
+		return m_datagram;
+	}
 
-		m_message = std::vector<uint8_t>(packet_buffer.begin() + sizeof(m_header), packet_buffer.end());
+	// Decoded from the wire. For packets sent with a connection ID, the socket fills in the sender's uuid.
+	const Header& get_header() const noexcept {
+		return m_header;
 	}
 
+	ByteSpan get_message() const noexcept {
+		return m_message;
+	}
+
+	// See rudp::wire flags.
+	uint8_t get_flags() const noexcept {
+		return m_flags;
+	}
+
+	// rudp::NO_CONNECTION_ID for packets identifying their sender by uuid.
+	connection_id_type get_connection_id() const noexcept {
+		return m_connection_id;
+	}
+
+	Packet<Header> to_packet() const {
+		return Packet<Header>(*this);
+	}
+
+private:
+	template<typename, typename> friend class Socket;
+
+	Header m_header;
+	uint8_t m_flags;
+	connection_id_type m_connection_id;
+	ByteSpan m_message;
+	ByteSpan m_datagram;
+};
+
+template<typename Header>
+class Packet {
+public:
+	Packet(const std::vector<uint8_t>& packet_buffer) noexcept(false)
+		: Packet(PacketView<Header>(packet_buffer.data(), packet_buffer.size()))
+	{}
+
+	explicit Packet(const PacketView<Header>& view)
+		: m_header(view.get_header())
+		, m_message(view.get_message().begin(), view.get_message().end())
+	{}
+
 	const Header& get_header() const noexcept {
 		return m_header;
 	}
@@ -13,13 +13,40 @@
 #define RELIABLEUDP_PEER_HPP
 
 #include <chrono>
+#include <cstdint> // uint32_t
 
 #include <boost/uuid/uuid.hpp>
 #include <boost/uuid/uuid_generators.hpp>
 #include <boost/asio/ip/udp.hpp>
 
+#include "protocols.hpp"
+#include "utility.hpp"
+
 namespace rudp {
 
+// Stable reference to a peer of a rudp::PeerTable.
+// Unlike a pointer or a reference to the peer itself, it never dangles: once the peer is erased,
+// looking the handle up yields nothing, even if the underlying slot has been reused.
+struct PeerHandle {
+	PeerHandle() : index(0), generation(0) {}
+
+	PeerHandle(uint32_t index, uint32_t generation)
+		: index(index)
+		, generation(generation)
+	{}
+
+	bool operator==(const PeerHandle& other) const noexcept {
+		return index == other.index && generation == other.generation;
+	}
+
+	bool operator!=(const PeerHandle& other) const noexcept {
+		return !(*this == other);
+	}
+
+	uint32_t index;
+	uint32_t generation;
+};
+
 struct Peer {
 	Peer() {}
 
@@ -33,7 +60,7 @@ struct Peer {
 		, endpoint(endpoint)
 	{}
 
-	Peer(boost::asio::ip::udp::endpoint endpoint, boost::uuids::uuid uuid, std::chrono::seconds last_packet_timestamp)
+	Peer(boost::asio::ip::udp::endpoint endpoint, boost::uuids::uuid uuid, clock_type::time_point last_packet_timestamp)
 		: uuid(uuid)
 		, endpoint(endpoint)
 		, last_packet_timestamp(last_packet_timestamp)
@@ -41,7 +68,10 @@ struct Peer {
 
 	boost::uuids::uuid uuid;
 	boost::asio::ip::udp::endpoint endpoint;
-	std::chrono::seconds last_packet_timestamp;
+	clock_type::time_point last_packet_timestamp;
+	PeerHandle handle;
+	connection_id_type connection_id = NO_CONNECTION_ID; // assigned by us, the peer sends it in place of its uuid
+	connection_id_type remote_connection_id = NO_CONNECTION_ID; // assigned by the peer, sent in place of our uuid
 };
 
 }
@@ -0,0 +1,295 @@
+///////////////////////////////////////////////////////////////////////////////////////////////////
+//                                                                                               //
+// Copyright 2017 Benoît CORTIER                                                                 //
+//                                                                                               //
+// This file is part of RUDP project which is released under the                                 //
+// European Union Public License v1.1. If a copy of the EUPL was                                 //
+// not distributed with this software, you can obtain one at :                                   //
+// https://joinup.ec.europa.eu/community/eupl/og_page/european-union-public-licence-eupl-v11     //
+//                                                                                               //
+///////////////////////////////////////////////////////////////////////////////////////////////////
+
+#ifndef RELIABLEUDP_PEERTABLE_HPP
+#define RELIABLEUDP_PEERTABLE_HPP
+
+#include <cstdint> // uint32_t, uint64_t
+#include <cstring> // std::memcpy
+#include <limits> // std::numeric_limits
+#include <random> // std::random_device
+#include <utility> // std::forward, std::swap
+#include <vector>
+
+#include <boost/asio/ip/udp.hpp>
+#include <boost/uuid/uuid.hpp>
+
+#include "Peer.hpp"
+
+namespace rudp {
+
+// Peer registry indexed by UUID and by endpoint.
+//
+// Peers are stored contiguously (iteration is a plain vector walk) and are reached through
+// open-addressing hash indexes (linear probing, backward shift deletion: no tombstones).
+// Erasing moves the last peer into the hole, so references to peers are only valid until the next
+// emplace or erase. Use the peer's `handle` to keep track of a peer across calls.
+class PeerTable {
+public:
+	using iterator = std::vector<Peer>::iterator;
+	using const_iterator = std::vector<Peer>::const_iterator;
+
+	PeerTable()
+		: m_free_slot(NO_SLOT)
+		, m_seed((uint64_t(std::random_device{}()) << 32) | std::random_device{}())
+		, m_buckets(MIN_BUCKET_COUNT)
+		, m_endpoint_buckets(MIN_BUCKET_COUNT)
+	{}
+
+	iterator begin() noexcept { return m_peers.begin(); }
+	iterator end() noexcept { return m_peers.end(); }
+	const_iterator begin() const noexcept { return m_peers.begin(); }
+	const_iterator end() const noexcept { return m_peers.end(); }
+
+	size_t size() const noexcept { return m_peers.size(); }
+
+	bool empty() const noexcept { return m_peers.empty(); }
+
+	void reserve(size_t count) {
+		m_peers.reserve(count);
+		m_slots.reserve(count);
+		size_t bucket_count = m_buckets.size();
+		while (count * MAX_LOAD_DENOMINATOR > bucket_count * MAX_LOAD_NUMERATOR) {
+			bucket_count *= 2;
+		}
+		if (bucket_count != m_buckets.size()) {
+			rehash(bucket_count);
+		}
+	}
+
+	Peer* find(const boost::uuids::uuid& uuid) noexcept {
+		return find_in(m_buckets, hash_uuid(uuid), [&uuid](const Peer& peer) { return peer.uuid == uuid; });
+	}
+
+	// If several peers share the endpoint, any of them is returned.
+	Peer* find(const boost::asio::ip::udp::endpoint& endpoint) noexcept {
+		return find_in(m_endpoint_buckets, hash_endpoint(endpoint),
+		               [&endpoint](const Peer& peer) { return peer.endpoint == endpoint; });
+	}
+
+	// Resolves the connection ID assigned to a peer on emplace: an array index, no hashing.
+	Peer* find_connection(connection_id_type id) noexcept {
+		const uint32_t index = (id & CONNECTION_INDEX_MASK) - 1;
+		if (index >= m_slots.size()) {
+			return nullptr;
+		}
+		const uint32_t position = m_slots[index].position;
+		if (position >= m_peers.size() || m_peers[position].connection_id != id) { // free slot or stale ID
+			return nullptr;
+		}
+		return &m_peers[position];
+	}
+
+	Peer* get(PeerHandle handle) noexcept {
+		if (handle.index >= m_slots.size() || m_slots[handle.index].generation != handle.generation) {
+			return nullptr;
+		}
+		const uint32_t position = m_slots[handle.index].position;
+		if (position >= m_peers.size() || m_peers[position].handle != handle) { // free slot
+			return nullptr;
+		}
+		return &m_peers[position];
+	}
+
+	const Peer* get(PeerHandle handle) const noexcept {
+		return const_cast<PeerTable*>(this)->get(handle);
+	}
+
+	// The UUID of the new peer shall not be already in the table.
+	template <typename... Args>
+	Peer& emplace(Args&&... args) {
+		// Grown before the peer is added, so that it is indexed exactly once below.
+		if ((m_peers.size() + 1) * MAX_LOAD_DENOMINATOR > m_buckets.size() * MAX_LOAD_NUMERATOR) {
+			rehash(m_buckets.size() * 2);
+		}
+
+		m_peers.emplace_back(std::forward<Args>(args)...);
+		Peer& peer = m_peers.back();
+
+		uint32_t slot;
+		if (m_free_slot != NO_SLOT) {
+			slot = m_free_slot;
+			m_free_slot = m_slots[slot].position;
+		} else {
+			slot = static_cast<uint32_t>(m_slots.size());
+			m_slots.push_back({1, 0});
+		}
+		m_slots[slot].position = static_cast<uint32_t>(m_peers.size() - 1);
+		peer.handle = PeerHandle(slot, m_slots[slot].generation);
+		peer.connection_id = make_connection_id(peer.handle);
+
+		insert_bucket(m_buckets, hash_uuid(peer.uuid), slot);
+		insert_bucket(m_endpoint_buckets, hash_endpoint(peer.endpoint), slot);
+
+		return peer;
+	}
+
+	bool erase(PeerHandle handle) noexcept {
+		if (get(handle) == nullptr) {
+			return false;
+		}
+		erase_at(m_slots[handle.index].position);
+		return true;
+	}
+
+	// Erases every peer for which predicate(peer) returns true.
+	template <typename PredicateT>
+	void erase_if(const PredicateT& predicate) {
+		// Walking backwards, the peer moved into an erased position has already been visited.
+		for (size_t position = m_peers.size(); position-- > 0; ) {
+			if (predicate(m_peers[position])) {
+				erase_at(static_cast<uint32_t>(position));
+			}
+		}
+	}
+
+private:
+	static constexpr uint32_t NO_SLOT = std::numeric_limits<uint32_t>::max();
+	static constexpr size_t MIN_BUCKET_COUNT = 16;
+	static constexpr size_t MAX_LOAD_NUMERATOR = 3;
+	static constexpr size_t MAX_LOAD_DENOMINATOR = 4;
+
+	// Connection IDs are the slot index plus one (0 is rudp::NO_CONNECTION_ID) in the low bits and
+	// the low bits of the slot generation in the high bits, so that a recycled slot gets a new ID.
+	static constexpr uint32_t CONNECTION_INDEX_BITS = 24;
+	static constexpr uint32_t CONNECTION_INDEX_MASK = (uint32_t(1) << CONNECTION_INDEX_BITS) - 1;
+
+	struct Slot {
+		uint32_t generation;
+		uint32_t position; // position in m_peers when used, next free slot otherwise
+	};
+
+	struct Bucket {
+		Bucket() : hash(0), slot(NO_SLOT) {}
+
+		uint32_t hash;
+		uint32_t slot;
+	};
+
+	// Peers beyond the ID space keep being identified by their uuid.
+	static connection_id_type make_connection_id(PeerHandle handle) noexcept {
+		if (handle.index >= CONNECTION_INDEX_MASK) {
+			return NO_CONNECTION_ID;
+		}
+		return (handle.index + 1) | (handle.generation << CONNECTION_INDEX_BITS);
+	}
+
+	static uint64_t mix(uint64_t x) noexcept {
+		x ^= x >> 33;
+		x *= 0xff51afd7ed558ccdULL;
+		x ^= x >> 33;
+		x *= 0xc4ceb9fe1a85ec53ULL;
+		x ^= x >> 33;
+		return x;
+	}
+
+	// Keyed with a per-table seed: UUIDs come from the network and can be chosen by an attacker.
+	uint32_t hash_uuid(const boost::uuids::uuid& uuid) const noexcept {
+		uint64_t low, high;
+		std::memcpy(&low, uuid.data, sizeof(low));
+		std::memcpy(&high, uuid.data + sizeof(low), sizeof(high));
+		return static_cast<uint32_t>(mix(low ^ m_seed) ^ mix(high + m_seed));
+	}
+
+	uint32_t hash_endpoint(const boost::asio::ip::udp::endpoint& endpoint) const noexcept {
+		uint64_t address = 0;
+		if (endpoint.address().is_v4()) {
+			address = endpoint.address().to_v4().to_uint();
+		} else {
+			const auto bytes = endpoint.address().to_v6().to_bytes();
+			uint64_t high;
+			std::memcpy(&address, bytes.data(), sizeof(address));
+			std::memcpy(&high, bytes.data() + sizeof(address), sizeof(high));
+			address = mix(address) ^ high;
+		}
+		return static_cast<uint32_t>(mix((address ^ m_seed) + endpoint.port()));
+	}
+
+	template <typename EqualT>
+	Peer* find_in(std::vector<Bucket>& buckets, uint32_t hash, const EqualT& equal) noexcept {
+		const size_t mask = buckets.size() - 1;
+		for (size_t i = hash & mask; buckets[i].slot != NO_SLOT; i = (i + 1) & mask) {
+			if (buckets[i].hash != hash) {
+				continue;
+			}
+			const uint32_t position = m_slots[buckets[i].slot].position;
+			if (position < m_peers.size() && equal(m_peers[position])) { // a free slot holds no position
+				return &m_peers[position];
+			}
+		}
+		return nullptr;
+	}
+
+	static void insert_bucket(std::vector<Bucket>& buckets, uint32_t hash, uint32_t slot) noexcept {
+		const size_t mask = buckets.size() - 1;
+		size_t i = hash & mask;
+		while (buckets[i].slot != NO_SLOT) {
+			i = (i + 1) & mask;
+		}
+		buckets[i].hash = hash;
+		buckets[i].slot = slot;
+	}
+
+	static void erase_bucket(std::vector<Bucket>& buckets, uint32_t hash, uint32_t slot) noexcept {
+		const size_t mask = buckets.size() - 1;
+		size_t hole = hash & mask;
+		while (buckets[hole].slot != slot) {
+			hole = (hole + 1) & mask;
+		}
+
+		// Backward shift: pull back every following entry that may live in the hole.
+		for (size_t i = (hole + 1) & mask; buckets[i].slot != NO_SLOT; i = (i + 1) & mask) {
+			const size_t ideal = buckets[i].hash & mask;
+			if (((i - ideal) & mask) >= ((i - hole) & mask)) {
+				buckets[hole] = buckets[i];
+				hole = i;
+			}
+		}
+		buckets[hole] = Bucket();
+	}
+
+	void erase_at(uint32_t position) noexcept {
+		const Peer& peer = m_peers[position];
+		const uint32_t slot = peer.handle.index;
+		erase_bucket(m_buckets, hash_uuid(peer.uuid), slot);
+		erase_bucket(m_endpoint_buckets, hash_endpoint(peer.endpoint), slot);
+
+		if (position != m_peers.size() - 1) {
+			std::swap(m_peers[position], m_peers.back());
+			m_slots[m_peers[position].handle.index].position = position;
+		}
+		m_peers.pop_back();
+
+		++m_slots[slot].generation;
+		m_slots[slot].position = m_free_slot;
+		m_free_slot = slot;
+	}
+
+	void rehash(size_t bucket_count) {
+		m_buckets.assign(bucket_count, Bucket());
+		m_endpoint_buckets.assign(bucket_count, Bucket());
+		for (const Peer& peer : m_peers) {
+			insert_bucket(m_buckets, hash_uuid(peer.uuid), peer.handle.index);
+			insert_bucket(m_endpoint_buckets, hash_endpoint(peer.endpoint), peer.handle.index);
+		}
+	}
+
+	std::vector<Peer> m_peers;
+	std::vector<Slot> m_slots;
+	uint32_t m_free_slot;
+	uint64_t m_seed;
+	std::vector<Bucket> m_buckets; // by UUID
+	std::vector<Bucket> m_endpoint_buckets;
+};
+
+}
+
+#endif //RELIABLEUDP_PEERTABLE_HPP
@@ -0,0 +1,175 @@
+///////////////////////////////////////////////////////////////////////////////////////////////////
+//                                                                                               //
+// Copyright 2017 Benoît CORTIER                                                                 //
+//                                                                                               //
+// This file is part of RUDP project which is released under the                                 //
+// European Union Public License v1.1. If a copy of the EUPL was                                 //
+// not distributed with this software, you can obtain one at :                                   //
+// https://joinup.ec.europa.eu/community/eupl/og_page/european-union-public-licence-eupl-v11     //
+//                                                                                               //
+///////////////////////////////////////////////////////////////////////////////////////////////////
+
+#ifndef RELIABLEUDP_PROTOCOLSTATE_HPP
+#define RELIABLEUDP_PROTOCOLSTATE_HPP
+
+#include <algorithm> // std::min, std::max
+#include <chrono>
+#include <cstddef> // size_t
+#include <cstdint> // uint64_t
+#include <utility> // std::move
+
+#include "BufferPool.hpp"
+#include "Packet.hpp"
+#include "utility.hpp"
+
+namespace rudp {
+
+const std::chrono::milliseconds INITIAL_RETRANSMISSION_TIMEOUT(500);
+const std::chrono::milliseconds MIN_RETRANSMISSION_TIMEOUT(50);
+const std::chrono::milliseconds MAX_RETRANSMISSION_TIMEOUT(4000);
+
+// Smoothed round trip time and retransmission timeout, as specified by RFC 6298.
+class RttEstimator {
+public:
+	using duration = clock_type::duration;
+
+	RttEstimator() noexcept { reset(); }
+
+	void reset() noexcept {
+		m_has_sample = false;
+		m_sample_count = 0;
+		m_last_sample = duration::zero();
+		m_srtt = duration::zero();
+		m_rttvar = duration::zero();
+		m_rto = INITIAL_RETRANSMISSION_TIMEOUT;
+	}
+
+	void add_sample(duration rtt) noexcept {
+		++m_sample_count;
+		m_last_sample = rtt;
+		if (!m_has_sample) {
+			m_has_sample = true;
+			m_srtt = rtt;
+			m_rttvar = rtt / 2;
+		} else {
+			const duration error = m_srtt > rtt ? m_srtt - rtt : rtt - m_srtt;
+			m_rttvar = (3 * m_rttvar + error) / 4;
+			m_srtt = (7 * m_srtt + rtt) / 8;
+		}
+		m_rto = clamp(m_srtt + 4 * m_rttvar);
+	}
+
+	// Called when the retransmission timer expires.
+	void back_off() noexcept {
+		m_rto = clamp(2 * m_rto);
+	}
+
+	bool has_sample() const noexcept { return m_has_sample; }
+
+	// Samples taken since the last reset, e.g. to notice new ones.
+	uint64_t sample_count() const noexcept { return m_sample_count; }
+
+	duration last_sample() const noexcept { return m_last_sample; }
+
+	duration srtt() const noexcept { return m_srtt; }
+
+	duration rttvar() const noexcept { return m_rttvar; }
+
+	duration rto() const noexcept { return m_rto; }
+
+private:
+	static duration clamp(duration rto) noexcept {
+		return std::min<duration>(std::max<duration>(rto, MIN_RETRANSMISSION_TIMEOUT), MAX_RETRANSMISSION_TIMEOUT);
+	}
+
+	bool m_has_sample;
+	uint64_t m_sample_count;
+	duration m_last_sample;
+	duration m_srtt;
+	duration m_rttvar;
+	duration m_rto;
+};
+
+// Weight of each new sequence in a rudp::LossEstimator (exponential moving average).
+const double LOSS_SMOOTHING = 1.0 / 16;
+
+// Gaps longer than that count as that many lost sequences.
+const uint16_t MAX_COUNTED_GAP = 32;
+
+// Smoothed fraction of sequences that never arrived, from the gaps between the received ones.
+class LossEstimator {
+public:
+	LossEstimator() noexcept { reset(); }
+
+	void reset() noexcept { m_loss = 0; }
+
+	// A sequence more recent than any other arrived, `skipped` sequences after the previous most recent one.
+	void on_received(uint16_t skipped) noexcept {
+		for (uint16_t i = 0; i < std::min(skipped, MAX_COUNTED_GAP); ++i) {
+			on_lost();
+		}
+		m_loss -= m_loss * LOSS_SMOOTHING;
+	}
+
+	void on_lost() noexcept { m_loss += (1 - m_loss) * LOSS_SMOOTHING; }
+
+	double loss() const noexcept { return m_loss; }
+
+private:
+	double m_loss;
+};
+
+// Per-peer state of the protocol identified by Header, owned by rudp::Socket<Header>.
+//
+// The primary template is a pass-through, used by headers without sequencing (e.g. rudp::BasicHeader).
+// Specializations keep whatever they need per peer (sequence numbers, send windows...) and implement:
+// - stamp(header): fills the acknowledgement fields of an outgoing header.
+// - send(buffer, now, pool, send): called for every user packet sent to the peer, send(buffer) transmits.
+// - on_receive_header(header, now, pool, send): called for every packet received from the peer.
+// - receive(packet, now, pool, deliver): called for user packets, deliver(packet_view) hands them to the user.
+// - tick(now, pool, send): called once next_tick() is reached when TICKED is true, returns true if an
+//   acknowledgement is due.
+// - next_tick(): time at which tick() has something to do (a past time if now), or
+//   clock_type::time_point::max() if nothing is waiting.
+// - datagram_overhead(): bytes the state may add to the largest datagram given to send() (parity...), which the
+//   socket leaves free when it fragments or coalesces messages.
+// The socket's pool provides the buffers the state keeps or sends on its own (reorder buffers, parity...).
+template <typename Header>
+class ProtocolState {
+public:
+	static constexpr bool SEQUENCED = false;
+	static constexpr bool TICKED = false;
+
+	void reset() noexcept {}
+
+	void stamp(Header& /*header*/) noexcept {}
+
+	template <typename SendFunction>
+	void send(rudp::SendBuffer buffer, clock_type::time_point /*now*/, rudp::BufferPool& /*pool*/,
+	          const SendFunction& send) {
+		send(std::move(buffer));
+	}
+
+	template <typename SendFunction>
+	void on_receive_header(const Header& /*header*/, clock_type::time_point /*now*/, rudp::BufferPool& /*pool*/,
+	                       const SendFunction& /*send*/) {}
+
+	template <typename DeliverFunction>
+	void receive(const rudp::PacketView<Header>& packet, clock_type::time_point /*now*/, rudp::BufferPool& /*pool*/,
+	             const DeliverFunction& deliver) {
+		deliver(packet);
+	}
+
+	template <typename SendFunction>
+	bool tick(clock_type::time_point /*now*/, rudp::BufferPool& /*pool*/, const SendFunction& /*send*/) {
+		return false;
+	}
+
+	clock_type::time_point next_tick() const noexcept { return clock_type::time_point::max(); }
+
+	size_t datagram_overhead() const noexcept { return 0; }
+};
+
+}
+
+#endif //RELIABLEUDP_PROTOCOLSTATE_HPP
@@ -0,0 +1,392 @@
+///////////////////////////////////////////////////////////////////////////////////////////////////
+//                                                                                               //
+// Copyright 2017 Benoît CORTIER                                                                 //
+//                                                                                               //
+// This file is part of RUDP project which is released under the                                 //
+// European Union Public License v1.1. If a copy of the EUPL was                                 //
+// not distributed with this software, you can obtain one at :                                   //
+// https://joinup.ec.europa.eu/community/eupl/og_page/european-union-public-licence-eupl-v11     //
+//                                                                                               //
+///////////////////////////////////////////////////////////////////////////////////////////////////
+
+#ifndef RELIABLEUDP_RELIABLEORDER_HPP
+#define RELIABLEUDP_RELIABLEORDER_HPP
+
+#include <algorithm> // std::min, std::max
+#include <array>
+#include <cstdint> // uint16_t, uint32_t, uint64_t
+#include <deque>
+#include <limits> // std::numeric_limits
+
+#include "BufferPool.hpp"
+#include "CongestionControl.hpp"
+#include "Fec.hpp"
+#include "Packet.hpp"
+#include "ProtocolState.hpp"
+#include "protocols.hpp"
+#include "TokenBucket.hpp"
+#include "utility.hpp"
+#include "WireFormat.hpp"
+
+namespace rudp {
+
+// Number of packets that may be in flight to a peer: one per bit of ReliableOrderHeader::ack_bits,
+// so that every packet in flight is covered by the acknowledgement fields of any incoming header.
+const uint16_t RELIABLE_WINDOW_SIZE = 32;
+
+// A packet is deemed lost, and retransmitted without waiting for its timeout, once a packet sent
+// that many sequences after it has been acknowledged.
+const uint16_t FAST_RETRANSMIT_THRESHOLD = 3;
+
+// Reliable in-order delivery, for headers with `sequence`, `ack` and `ack_bits` fields
+// (rudp::ReliableOrderHeader, and the reliable channels of rudp::ChannelHeader).
+//
+// Outgoing packets get consecutive sequence numbers and stay in a send window until acknowledged,
+// packets beyond the window wait in a queue. Each header acknowledges the most recent sequence
+// received (`ack`) and the RELIABLE_WINDOW_SIZE ones before it (`ack_bits`, bit n for ack - n - 1).
+// Unacknowledged packets are retransmitted after the RTT-driven retransmission timeout, or as soon as
+// later packets are acknowledged (fast retransmit).
+// The send window is further limited by a rudp::CongestionController fed by acknowledgements, losses
+// and timeouts, and new packets are paced at its rate by a rudp::TokenBucket, serviced by tick().
+// Incoming packets are released in order: early ones wait in a fixed-size reorder ring.
+// With forward error correction (set_fec), a parity datagram follows every group of first transmissions:
+// a single packet lost in the group is rebuilt on arrival of the parity, a round trip before its
+// retransmission, and acknowledged as received.
+template <typename Header>
+class ReliableOrderState {
+public:
+	static constexpr bool SEQUENCED = true;
+	static constexpr bool TICKED = true;
+
+	ReliableOrderState() noexcept : m_congestion(RELIABLE_WINDOW_SIZE), m_pacer(0, MIN_PACING_BURST) { reset(); }
+
+	void reset() noexcept {
+		m_next_sequence = 0;
+		m_oldest_unacked = 0;
+		for (auto& slot : m_window) {
+			slot = SentPacket();
+		}
+		m_pending.clear();
+		m_rtt.reset();
+		m_congestion.reset();
+		m_retransmissions = 0;
+		m_pacer = TokenBucket(0, MIN_PACING_BURST);
+		m_fec.reset();
+		m_adaptive_fec = false;
+		m_outgoing_loss.reset();
+
+		m_remote_sequence = std::numeric_limits<uint16_t>::max(); // "received" the sequence before 0
+		m_received_bits = 0;
+		m_next_delivery = 0;
+		for (auto& packet : m_reorder_ring) {
+			packet = rudp::SendBuffer();
+		}
+		m_ack_due = false;
+		m_loss.reset();
+		m_fec_decoder.reset();
+	}
+
+	void stamp(Header& header) noexcept {
+		header.ack = m_remote_sequence;
+		header.ack_bits = m_received_bits;
+		m_ack_due = false;
+	}
+
+	template <typename SendFunction>
+	void send(rudp::SendBuffer buffer, clock_type::time_point now, rudp::BufferPool& pool, const SendFunction& send) {
+		if (!WireFormat<Header>::fits(buffer.data(), buffer.size())) {
+			send(std::move(buffer));
+		} else if (m_pending.empty() && can_transmit(now)) {
+			transmit(std::move(buffer), now, pool, send);
+		} else {
+			m_pending.push_back(std::move(buffer));
+		}
+	}
+
+	template <typename SendFunction>
+	void on_receive_header(const Header& header, clock_type::time_point now, rudp::BufferPool& pool,
+	                       const SendFunction& send) {
+		for (uint16_t sequence = m_oldest_unacked; sequence != m_next_sequence; ++sequence) {
+			SentPacket& slot = m_window[sequence % RELIABLE_WINDOW_SIZE];
+			if (!slot.buffer || !is_acked(sequence, header)) {
+				continue;
+			}
+			if (slot.transmissions == 1) {
+				if (sequence == header.ack) { // Karn's algorithm
+					m_rtt.add_sample(now - slot.sent_at);
+				}
+				m_outgoing_loss.on_received(0);
+			}
+			m_congestion.on_ack(sequence);
+			slot = SentPacket();
+		}
+
+		while (m_oldest_unacked != m_next_sequence && !m_window[m_oldest_unacked % RELIABLE_WINDOW_SIZE].buffer) {
+			++m_oldest_unacked;
+		}
+
+		for (uint16_t sequence = m_oldest_unacked; sequence != m_next_sequence; ++sequence) {
+			SentPacket& slot = m_window[sequence % RELIABLE_WINDOW_SIZE];
+			if (slot.buffer && sequence_more_recent(header.ack, sequence)
+			    && static_cast<uint16_t>(header.ack - sequence) >= FAST_RETRANSMIT_THRESHOLD
+			    && now - slot.sent_at >= m_rtt.srtt()) { // the last transmission had time to be acknowledged
+				m_congestion.on_loss(sequence, m_next_sequence);
+				retransmit(slot, now, pool, send);
+			}
+		}
+
+		update_pacing();
+		release_pending(now, pool, send);
+	}
+
+	template <typename DeliverFunction>
+	void receive(const rudp::PacketView<Header>& packet, clock_type::time_point now,
+	             rudp::BufferPool& pool, const DeliverFunction& deliver) {
+		if (packet.get_flags() & wire::PARITY_FLAG) {
+			const rudp::SendBuffer recovered = m_fec_decoder.recover(packet, pool);
+			if (recovered) {
+				receive(rudp::PacketView<Header>(recovered.data(), recovered.size()), now, pool, deliver);
+			}
+			return;
+		}
+		m_fec_decoder.store(packet, pool);
+
+		const uint16_t sequence = packet.get_header().sequence;
+		record_received(sequence);
+		m_ack_due = true;
+
+		if (sequence == m_next_delivery) {
+			++m_next_delivery;
+			deliver(packet);
+
+			for (;;) {
+				rudp::SendBuffer& early = m_reorder_ring[m_next_delivery % RELIABLE_WINDOW_SIZE];
+				if (!early) {
+					break;
+				}
+				const rudp::SendBuffer stored = std::move(early);
+				++m_next_delivery;
+				deliver(rudp::PacketView<Header>(stored.data(), stored.size()));
+			}
+		} else if (sequence_more_recent(sequence, m_next_delivery)
+		           && static_cast<uint16_t>(sequence - m_next_delivery) < RELIABLE_WINDOW_SIZE) {
+			rudp::SendBuffer& early = m_reorder_ring[sequence % RELIABLE_WINDOW_SIZE];
+			if (!early) {
+				early = pool.acquire(packet.get_datagram().data(), packet.get_datagram().size());
+			}
+		} // else: already delivered, only its acknowledgement was lost.
+	}
+
+	template <typename SendFunction>
+	bool tick(clock_type::time_point now, rudp::BufferPool& pool, const SendFunction& send) {
+		bool timed_out = false;
+		for (uint16_t sequence = m_oldest_unacked; sequence != m_next_sequence; ++sequence) {
+			SentPacket& slot = m_window[sequence % RELIABLE_WINDOW_SIZE];
+			if (slot.buffer && now - slot.sent_at >= m_rtt.rto()) {
+				retransmit(slot, now, pool, send);
+				timed_out = true;
+			}
+		}
+		if (timed_out) {
+			m_rtt.back_off();
+			m_congestion.on_timeout(m_next_sequence);
+			update_pacing();
+		}
+		release_pending(now, pool, send);
+
+		return m_ack_due;
+	}
+
+	clock_type::time_point next_tick() const noexcept {
+		if (m_ack_due) {
+			return clock_type::time_point::min();
+		}
+		clock_type::time_point next = clock_type::time_point::max();
+		if (!m_pending.empty() && in_flight() < window()) { // waiting for the pacer
+			next = pacing_enabled() ? m_pacer.available_at(clock_type::now()) : clock_type::time_point::min();
+		}
+		for (uint16_t sequence = m_oldest_unacked; sequence != m_next_sequence; ++sequence) {
+			const SentPacket& slot = m_window[sequence % RELIABLE_WINDOW_SIZE];
+			if (slot.buffer) {
+				next = std::min(next, slot.sent_at + m_rtt.rto());
+			}
+		}
+		return next;
+	}
+
+	const RttEstimator& rtt() const noexcept { return m_rtt; }
+
+	// Packets received since the last stamp().
+	bool ack_due() const noexcept { return m_ack_due; }
+
+	uint16_t in_flight() const noexcept { return static_cast<uint16_t>(m_next_sequence - m_oldest_unacked); }
+
+	// Packets that may be in flight: the congestion window, within RELIABLE_WINDOW_SIZE.
+	uint16_t window() const noexcept {
+		return static_cast<uint16_t>(std::min<double>(RELIABLE_WINDOW_SIZE, m_congestion.window()));
+	}
+
+	const CongestionController& congestion() const noexcept { return m_congestion; }
+
+	// New packets per second, 0 while unpaced.
+	double pacing_rate() const noexcept { return m_pacer.rate(); }
+
+	uint64_t retransmissions() const noexcept { return m_retransmissions; }
+
+	// Smoothed fraction of incoming sequences that had not arrived when a more recent one did.
+	double incoming_loss() const noexcept { return m_loss.loss(); }
+
+	// Sends a parity datagram after every `group_size` first transmissions (see rudp::FecEncoder), 0 to stop.
+	void set_fec(uint8_t group_size) noexcept {
+		m_adaptive_fec = false;
+		m_fec.set_group_size(group_size);
+	}
+
+	// Smoothed fraction of transmissions that had to be repeated.
+	double outgoing_loss() const noexcept { return m_outgoing_loss.loss(); }
+
+	// Picks the group size from the highest of incoming_loss() and outgoing_loss() before each transmission
+	// (see rudp::fec_group_size): outgoing_loss() alone falls as the parity saves retransmissions.
+	void set_adaptive_fec() noexcept { m_adaptive_fec = true; }
+
+	// Room the parity datagrams need beyond the largest datagram of their group.
+	size_t datagram_overhead() const noexcept { return m_fec.active() || m_adaptive_fec ? fec_wire::PREFIX_SIZE : 0; }
+
+	const FecEncoder<Header>& fec() const noexcept { return m_fec; }
+
+	// Incoming packets rebuilt from parity datagrams.
+	uint64_t recovered_count() const noexcept { return m_fec_decoder.recovered_count(); }
+
+	size_t pending() const noexcept { return m_pending.size(); }
+
+	// Sequence the next packet given to send() gets: packets held back take theirs in order, once released.
+	uint16_t next_send_sequence() const noexcept { return static_cast<uint16_t>(m_next_sequence + m_pending.size()); }
+
+	// Whether the peer acknowledged `sequence`, as far as sequences half the sequence space back.
+	bool is_acknowledged(uint16_t sequence) const noexcept {
+		if (sequence_more_recent(m_oldest_unacked, sequence)) {
+			return true;
+		}
+		return static_cast<uint16_t>(sequence - m_oldest_unacked) < in_flight()
+		       && !m_window[sequence % RELIABLE_WINDOW_SIZE].buffer;
+	}
+
+private:
+	struct SentPacket {
+		SentPacket() : transmissions(0) {}
+
+		rudp::SendBuffer buffer; // empty once acknowledged
+		clock_type::time_point sent_at;
+		uint32_t transmissions;
+	};
+
+	static bool is_acked(uint16_t sequence, const Header& header) noexcept {
+		if (sequence == header.ack) {
+			return true;
+		}
+		const uint16_t distance = static_cast<uint16_t>(header.ack - sequence - 1);
+		return distance < RELIABLE_WINDOW_SIZE && (header.ack_bits & (uint32_t(1) << distance));
+	}
+
+	void record_received(uint16_t sequence) noexcept {
+		if (sequence_more_recent(sequence, m_remote_sequence)) {
+			const uint16_t distance = static_cast<uint16_t>(sequence - m_remote_sequence);
+			m_loss.on_received(static_cast<uint16_t>(distance - 1));
+			m_received_bits = distance >= RELIABLE_WINDOW_SIZE ? 0 : m_received_bits << distance;
+			if (distance <= RELIABLE_WINDOW_SIZE) {
+				m_received_bits |= uint32_t(1) << (distance - 1);
+			}
+			m_remote_sequence = sequence;
+		} else if (sequence != m_remote_sequence) {
+			const uint16_t distance = static_cast<uint16_t>(m_remote_sequence - sequence);
+			if (distance <= RELIABLE_WINDOW_SIZE) {
+				m_received_bits |= uint32_t(1) << (distance - 1);
+			}
+		}
+	}
+
+	template <typename SendFunction>
+	void transmit(rudp::SendBuffer buffer, clock_type::time_point now, rudp::BufferPool& pool,
+	              const SendFunction& send) {
+		const uint16_t sequence = m_next_sequence++;
+		WireFormat<Header>::rewrite_fields(buffer.data(), [this, sequence](Header& header) {
+			header.sequence = sequence;
+			stamp(header);
+		});
+
+		SentPacket& slot = m_window[sequence % RELIABLE_WINDOW_SIZE];
+		slot.buffer = buffer;
+		slot.sent_at = now;
+		slot.transmissions = 1;
+
+		if (m_adaptive_fec) {
+			m_fec.set_group_size(fec_group_size(std::max(m_loss.loss(), m_outgoing_loss.loss())));
+		}
+		send(std::move(buffer));
+		m_fec.add(slot.buffer, sequence, pool, send);
+	}
+
+	bool pacing_enabled() const noexcept { return m_pacer.rate() > 0; }
+
+	bool can_transmit(clock_type::time_point now) noexcept {
+		return in_flight() < window() && (!pacing_enabled() || m_pacer.try_consume(now));
+	}
+
+	template <typename SendFunction>
+	void release_pending(clock_type::time_point now, rudp::BufferPool& pool, const SendFunction& send) {
+		while (!m_pending.empty() && can_transmit(now)) {
+			transmit(std::move(m_pending.front()), now, pool, send);
+			m_pending.pop_front();
+		}
+	}
+
+	void update_pacing() noexcept {
+		const double rate = m_congestion.pacing_rate(m_rtt);
+		const double burst = std::max(MIN_PACING_BURST, rate * std::chrono::duration<double>(PACING_INTERVAL).count());
+		m_pacer.set_rate(rate, burst);
+	}
+
+	// Restamps a copy: earlier transmissions of the slot's buffer may still be read by the transport (e.g. the
+	// kernel, with io_uring), which would otherwise send a torn ack/ack_bits pair.
+	template <typename SendFunction>
+	void retransmit(SentPacket& slot, clock_type::time_point now, rudp::BufferPool& pool, const SendFunction& send) {
+		rudp::SendBuffer copy = pool.acquire(slot.buffer.data(), slot.buffer.size());
+		WireFormat<Header>::rewrite_fields(copy.data(), [this](Header& header) {
+			stamp(header);
+		});
+		slot.sent_at = now;
+		++slot.transmissions;
+		++m_retransmissions;
+		m_outgoing_loss.on_lost();
+		send(std::move(copy));
+	}
+
+	// Sending side.
+	uint16_t m_next_sequence;
+	uint16_t m_oldest_unacked;
+	std::array<SentPacket, RELIABLE_WINDOW_SIZE> m_window;
+	std::deque<rudp::SendBuffer> m_pending;
+	RttEstimator m_rtt;
+	CongestionController m_congestion;
+	TokenBucket m_pacer;
+	uint64_t m_retransmissions;
+	FecEncoder<Header> m_fec;
+	bool m_adaptive_fec;
+	LossEstimator m_outgoing_loss;
+
+	// Receiving side.
+	uint16_t m_remote_sequence;
+	uint32_t m_received_bits;
+	uint16_t m_next_delivery;
+	std::array<rudp::SendBuffer, RELIABLE_WINDOW_SIZE> m_reorder_ring;
+	bool m_ack_due;
+	LossEstimator m_loss;
+	FecDecoder<Header> m_fec_decoder;
+};
+
+template <>
+class ProtocolState<ReliableOrderHeader> : public ReliableOrderState<ReliableOrderHeader> {};
+
+}
+
+#endif //RELIABLEUDP_RELIABLEORDER_HPP
@@ -0,0 +1,124 @@
+///////////////////////////////////////////////////////////////////////////////////////////////////
+//                                                                                               //
+// Copyright 2017 Benoît CORTIER                                                                 //
+//                                                                                               //
+// This file is part of RUDP project which is released under the                                 //
+// European Union Public License v1.1. If a copy of the EUPL was                                 //
+// not distributed with this software, you can obtain one at :                                   //
+// https://joinup.ec.europa.eu/community/eupl/og_page/european-union-public-licence-eupl-v11     //
+//                                                                                               //
+///////////////////////////////////////////////////////////////////////////////////////////////////
+
+#ifndef RELIABLEUDP_SHARDEDSOCKET_HPP
+#define RELIABLEUDP_SHARDEDSOCKET_HPP
+
+#include <atomic>
+#include <functional>
+#include <memory>
+#include <thread>
+#include <vector>
+
+#include <boost/asio.hpp>
+#include <boost/uuid/uuid.hpp>
+
+#include "BufferPool.hpp"
+#include "Metrics.hpp"
+#include "MpscQueue.hpp"
+#include "Packet.hpp"
+#include "Peer.hpp"
+#include "Socket.hpp"
+
+namespace rudp {
+
+// Server socket spread over several cores.
+//
+// Opens one SO_REUSEPORT socket per shard on the same endpoint, each with its own thread, io_service and
+// rudp::Socket (hence its own peer table). The kernel hashes each remote address to one shard, so a peer
+// only ever reaches the shard that accepted its connection. Shards share the uuid of self().
+// Handlers are called from the thread of the peer's shard, concurrently for peers of different shards.
+// Without SO_REUSEPORT (non-Linux), a single shard is opened.
+// Metrics is the metrics policy of the shards' sockets, see rudp::Socket.
+template <typename Header, typename Metrics = rudp::NoMetrics>
+class ShardedSocket {
+
+	using receive_handler_type = std::function<void(const rudp::PacketView<Header>&, size_t, const rudp::Peer&)>;
+	using connection_handler_type = std::function<void(const rudp::Peer&)>;
+	using disconnection_handler_type = std::function<void(const rudp::Peer&)>;
+	using disconnection_timeout_handler_type = std::function<void(const rudp::Peer&)>;
+
+public:
+	ShardedSocket(const size_t shard_count, const size_t buffer_size, const size_t batch_size,
+	              const boost::asio::ip::udp::endpoint& endpoint);
+
+	ShardedSocket(const ShardedSocket&) = delete;
+
+	ShardedSocket& operator=(const ShardedSocket&) = delete;
+
+	~ShardedSocket() { stop(); }
+
+	// Handlers shall be set before start().
+	void set_receive_handler(const receive_handler_type& handler);
+
+	void set_connection_handler(const connection_handler_type& handler);
+
+	void set_disconnection_handler(const disconnection_handler_type& handler);
+
+	void set_disconnection_timeout_handler(const disconnection_timeout_handler_type& handler);
+
+	// Runs each shard on its own thread.
+	void start();
+
+	// Closes every shard (peers are told about the disconnection) and joins their threads.
+	void stop();
+
+	size_t shard_count() const noexcept { return m_shards.size(); }
+
+	// The shard's socket shall only be used from its own thread, e.g. from its handlers.
+	rudp::Socket<Header, Metrics>& shard(size_t index) noexcept { return *m_shards[index]->socket; }
+
+	// The shard running the calling thread, nullptr outside of the shards' threads.
+	rudp::Socket<Header, Metrics>* current_shard() noexcept;
+
+	const rudp::Peer& self() { return m_shards[0]->socket->self(); }
+
+	// Sum of the metrics of every shard, from any thread.
+	rudp::MetricsSnapshot metrics() const noexcept;
+
+	// Pools are thread-safe: buffers may be acquired from any thread and sent from any shard.
+	rudp::SendBuffer acquire_send_buffer(size_t size);
+
+	// Shall be called from a handler: the peer belongs to the shard running it (std::logic_error otherwise).
+	void async_send_to(rudp::SendBuffer buffer, const rudp::Peer& peer);
+
+	// Sends to the peers of every shard, from any thread. Other shards than the calling one get the buffer
+	// through their broadcast queue and send it from their own thread.
+	// The buffer shall not be modified afterwards: it is shared by all shards.
+	void async_send_to_all(rudp::SendBuffer buffer);
+
+private:
+	struct Shard {
+		boost::asio::io_service io_service;
+		std::unique_ptr<rudp::Socket<Header, Metrics>> socket;
+		rudp::MpscQueue<rudp::SendBuffer> broadcasts;
+		std::atomic<bool> drain_posted{false};
+		std::thread thread;
+		ShardedSocket* owner;
+	};
+
+	static boost::asio::ip::udp::socket open_shard(boost::asio::io_service& io_service,
+	                                               const boost::asio::ip::udp::endpoint& endpoint);
+
+	// Sends the queued broadcasts, on the shard's thread.
+	void drain_broadcasts(Shard& shard);
+
+	static thread_local Shard* t_current_shard;
+
+	std::vector<std::unique_ptr<Shard>> m_shards;
+	bool m_running;
+};
+
+}
+
+#include "impl/ShardedSocket.tcc"
+
+#endif //RELIABLEUDP_SHARDEDSOCKET_HPP
@@ -0,0 +1,415 @@
+///////////////////////////////////////////////////////////////////////////////////////////////////
+//                                                                                               //
+// Copyright 2017 Benoît CORTIER                                                                 //
+//                                                                                               //
+// This file is part of RUDP project which is released under the                                 //
+// European Union Public License v1.1. If a copy of the EUPL was                                 //
+// not distributed with this software, you can obtain one at :                                   //
+// https://joinup.ec.europa.eu/community/eupl/og_page/european-union-public-licence-eupl-v11     //
+//                                                                                               //
+///////////////////////////////////////////////////////////////////////////////////////////////////
+
+#ifndef RELIABLEUDP_SNAPSHOTS_HPP
+#define RELIABLEUDP_SNAPSHOTS_HPP
+
+#include <algorithm> // std::min
+#include <array>
+#include <cstddef> // size_t
+#include <cstdint> // uint8_t, uint16_t, uint32_t, uint64_t
+#include <cstring> // std::memcpy, std::memset
+#include <limits> // std::numeric_limits
+#include <memory>
+#include <stdexcept>
+#include <type_traits>
+#include <utility> // std::move
+#include <vector>
+
+#include "BufferPool.hpp"
+#include "Packet.hpp"
+#include "Peer.hpp"
+#include "ReliableOrder.hpp"
+#include "Socket.hpp"
+#include "utility.hpp"
+#include "WireFormat.hpp"
+
+namespace rudp {
+
+// Snapshots kept per peer, by the sender to encode deltas against and by the receiver to decode them.
+const uint16_t SNAPSHOT_HISTORY_SIZE = 32;
+
+// Byte-level delta of a snapshot against a baseline: the XOR of both, as runs of
+//
+//     unchanged bytes (varint) | changed bytes (varint) | XOR of the changed bytes
+//
+// Bytes of the snapshot beyond the baseline's end are XORed with zeros, unchanged bytes at the end are left out.
+// Both kernels work on 64-bit words (see rudp::xor_bytes), which compilers further vectorize.
+namespace delta {
+	inline uint64_t load_word(const uint8_t* in) noexcept {
+		uint64_t word;
+		std::memcpy(&word, in, sizeof(word));
+		return word;
+	}
+
+	// LEB128, at most 5 bytes.
+	inline size_t write_varint(uint8_t* out, uint32_t value) noexcept {
+		size_t size = 0;
+		while (value >= 0x80) {
+			out[size++] = static_cast<uint8_t>(value | 0x80);
+			value >>= 7;
+		}
+		out[size++] = static_cast<uint8_t>(value);
+		return size;
+	}
+
+	inline bool read_varint(const uint8_t*& in, const uint8_t* end, uint32_t& value) noexcept {
+		value = 0;
+		for (unsigned int shift = 0; in != end && shift < 35; shift += 7) {
+			const uint8_t byte = *in++;
+			value |= static_cast<uint32_t>(byte & 0x7F) << shift;
+			if (!(byte & 0x80)) {
+				return true;
+			}
+		}
+		return false;
+	}
+
+	// Writes at most `capacity` bytes to out, scratch holds the XOR between calls.
+	// Returns false if the delta does not fit.
+	inline bool encode(const uint8_t* snapshot, size_t size, const uint8_t* baseline, size_t baseline_size,
+	                   uint8_t* out, size_t capacity, size_t& encoded_size, std::vector<uint8_t>& scratch) {
+		const size_t MAX_RUN_SIZE = 10; // two varints
+
+		scratch.resize(size);
+		const size_t common = std::min(size, baseline_size);
+		xor_bytes(scratch.data(), snapshot, baseline, common);
+		std::memcpy(scratch.data() + common, snapshot + common, size - common);
+
+		const uint8_t* x = scratch.data();
+		encoded_size = 0;
+		for (size_t i = 0; ; ) {
+			const size_t unchanged_start = i;
+			while (i + sizeof(uint64_t) <= size && load_word(x + i) == 0) {
+				i += sizeof(uint64_t);
+			}
+			while (i < size && x[i] == 0) {
+				++i;
+			}
+			if (i == size) {
+				return true;
+			}
+
+			// Changed bytes run until a zero word: shorter unchanged runs would cost more than they save.
+			const size_t changed_start = i;
+			while (i + sizeof(uint64_t) <= size && load_word(x + i) != 0) {
+				i += sizeof(uint64_t);
+			}
+			if (i + sizeof(uint64_t) > size) {
+				i = size;
+			}
+			while (x[i - 1] == 0) { // x[changed_start] is not
+				--i;
+			}
+
+			const size_t changed = i - changed_start;
+			if (encoded_size + MAX_RUN_SIZE + changed > capacity) {
+				return false;
+			}
+			encoded_size += write_varint(out + encoded_size, static_cast<uint32_t>(changed_start - unchanged_start));
+			encoded_size += write_varint(out + encoded_size, static_cast<uint32_t>(changed));
+			std::memcpy(out + encoded_size, x + changed_start, changed);
+			encoded_size += changed;
+		}
+	}
+
+	// Rebuilds the snapshot of `size` bytes into out. Returns false if the delta is malformed.
+	inline bool decode(const uint8_t* encoded, size_t encoded_size, const uint8_t* baseline, size_t baseline_size,
+	                   size_t size, std::vector<uint8_t>& out) {
+		out.resize(size);
+		const size_t common = std::min(size, baseline_size);
+		std::memcpy(out.data(), baseline, common);
+		std::memset(out.data() + common, 0, size - common);
+
+		const uint8_t* in = encoded;
+		const uint8_t* const end = encoded + encoded_size;
+		size_t position = 0;
+		while (in != end) {
+			uint32_t unchanged;
+			uint32_t changed;
+			if (!read_varint(in, end, unchanged) || !read_varint(in, end, changed)
+			    || unchanged > size - position || changed > size - position - unchanged
+			    || changed > static_cast<size_t>(end - in)) {
+				return false;
+			}
+			position += unchanged;
+			xor_bytes(out.data() + position, out.data() + position, in, changed);
+			position += changed;
+			in += changed;
+		}
+		return true;
+	}
+}
+
+// Layout of the message of a snapshot packet:
+//
+//     snapshot ID (16 bits) | baseline age (8 bits) | snapshot size (32 bits) | snapshot, or delta
+//
+// The baseline is the snapshot sent `age` snapshots earlier to the same peer, 0 for a full snapshot.
+namespace snapshot_wire {
+	const size_t ID_OFFSET = 0;
+	const size_t AGE_OFFSET = ID_OFFSET + sizeof(uint16_t);
+	const size_t SIZE_OFFSET = AGE_OFFSET + sizeof(uint8_t);
+	const size_t PREFIX_SIZE = SIZE_OFFSET + sizeof(uint32_t);
+}
+
+// Sends snapshots of a state (e.g. the world of a game server) to the peers of a reliable socket, each
+// delta-encoded against the newest snapshot the peer acknowledged, see rudp::delta.
+//
+// A snapshot is acknowledged once the ack and ack_bits fields of the peer's headers cover all of its
+// datagrams: in-order delivery guarantees the peer decoded it before any later snapshot. Snapshots fall
+// back to full ones when no snapshot of the last SNAPSHOT_HISTORY_SIZE is acknowledged (e.g. right after
+// connecting), or when the delta would not be smaller.
+// The receiving socket shall give every snapshot packet to a rudp::SnapshotReceiver.
+// Like the socket's sends, calls are made from the thread running its io_service.
+template <typename Header, typename Metrics = rudp::NoMetrics>
+class SnapshotSender {
+	static_assert(std::is_base_of<ReliableOrderState<Header>, ProtocolState<Header>>::value,
+	              "Snapshots are acknowledged by a reliable protocol, e.g. rudp::ReliableOrderHeader.");
+
+public:
+	explicit SnapshotSender(Socket<Header, Metrics>& socket)
+		: m_socket(socket)
+		, m_snapshot_bytes(0)
+		, m_sent_bytes(0)
+	{}
+
+	// Sends the snapshot to every connected peer as one operation, see Socket::async_send_to_each.
+	void send_to_all(const void* snapshot, size_t size) {
+		const std::shared_ptr<const std::vector<uint8_t>> data = copy(snapshot, size);
+		std::vector<rudp::SendBuffer> payloads;
+		std::vector<rudp::PeerHandle> peers;
+		payloads.reserve(m_socket.peers().size());
+		peers.reserve(m_socket.peers().size());
+		for (const auto& peer : m_socket.peers()) {
+			payloads.push_back(encode(data, peer.handle));
+			peers.push_back(peer.handle);
+		}
+
+		m_socket.async_send_to_each(std::move(payloads), peers);
+		for (const rudp::PeerHandle peer : peers) {
+			record_sent(peer);
+		}
+	}
+
+	void send_to(const void* snapshot, size_t size, const rudp::Peer& peer) {
+		m_socket.async_send_to(encode(copy(snapshot, size), peer.handle), peer);
+		record_sent(peer.handle);
+	}
+
+	// Bytes of the snapshots given to send_to and send_to_all, once per peer.
+	uint64_t snapshot_bytes() const noexcept { return m_snapshot_bytes; }
+
+	// Bytes of the encoded snapshots actually sent, headers aside.
+	uint64_t sent_bytes() const noexcept { return m_sent_bytes; }
+
+private:
+	struct SentSnapshot {
+		SentSnapshot() : id(0), sent(false), first_sequence(0), end_sequence(0) {}
+
+		std::shared_ptr<const std::vector<uint8_t>> data; // shared by the peers it was sent to
+		uint16_t id;
+		bool sent;
+		uint16_t first_sequence; // of its datagrams
+		uint16_t end_sequence; // one past the last of its datagrams
+	};
+
+	struct PeerSnapshots {
+		PeerSnapshots() : next_id(0) {}
+
+		rudp::PeerHandle peer;
+		uint16_t next_id;
+		std::array<SentSnapshot, SNAPSHOT_HISTORY_SIZE> sent; // indexed by id % SNAPSHOT_HISTORY_SIZE
+	};
+
+	static std::shared_ptr<const std::vector<uint8_t>> copy(const void* snapshot, size_t size) {
+		if (size > std::numeric_limits<uint32_t>::max()) {
+			throw std::length_error("Snapshot too large");
+		}
+		const uint8_t* bytes = static_cast<const uint8_t*>(snapshot);
+		return std::make_shared<const std::vector<uint8_t>>(bytes, bytes + size);
+	}
+
+	// Slots reused by another peer start over.
+	PeerSnapshots& peer_snapshots(rudp::PeerHandle peer) {
+		if (peer.index >= m_peers.size()) {
+			m_peers.resize(peer.index + 1);
+		}
+		PeerSnapshots& snapshots = m_peers[peer.index];
+		if (snapshots.peer != peer) {
+			snapshots = PeerSnapshots();
+			snapshots.peer = peer;
+		}
+		return snapshots;
+	}
+
+	bool is_acknowledged(const SentSnapshot& snapshot, const ReliableOrderState<Header>& state) const noexcept {
+		if (!snapshot.sent) {
+			return false;
+		}
+		for (uint16_t sequence = snapshot.first_sequence; sequence != snapshot.end_sequence; ++sequence) {
+			if (!state.is_acknowledged(sequence)) {
+				return false;
+			}
+		}
+		return true;
+	}
+
+	rudp::SendBuffer encode(const std::shared_ptr<const std::vector<uint8_t>>& data, rudp::PeerHandle peer) {
+		using wire_format = rudp::WireFormat<Header>;
+
+		PeerSnapshots& snapshots = peer_snapshots(peer);
+		const ReliableOrderState<Header>& state = *m_socket.get_protocol_state(peer);
+		const uint16_t id = snapshots.next_id++;
+
+		const SentSnapshot* baseline = nullptr;
+		uint8_t age = 1;
+		for (; age < SNAPSHOT_HISTORY_SIZE; ++age) {
+			const SentSnapshot& candidate = snapshots.sent[static_cast<uint16_t>(id - age) % SNAPSHOT_HISTORY_SIZE];
+			if (!candidate.data || candidate.id != static_cast<uint16_t>(id - age)) {
+				break;
+			}
+			if (is_acknowledged(candidate, state)) {
+				baseline = &candidate;
+				break;
+			}
+		}
+
+		const size_t size = data->size();
+		const size_t prefix_size = wire_format::FULL_SIZE + snapshot_wire::PREFIX_SIZE;
+		rudp::SendBuffer buffer = m_socket.acquire_send_buffer(prefix_size + size);
+		wire_format::write(buffer.data(), Header(m_socket.self().uuid));
+		size_t encoded_size = 0;
+		if (!baseline || !delta::encode(data->data(), size, baseline->data->data(), baseline->data->size(),
+		                                buffer.data() + prefix_size, size, encoded_size, m_scratch)) {
+			age = 0;
+			std::memcpy(buffer.data() + prefix_size, data->data(), size);
+			encoded_size = size;
+		}
+
+		uint8_t* prefix = buffer.data() + wire_format::FULL_SIZE;
+		rudp::wire::write_le(prefix + snapshot_wire::ID_OFFSET, id);
+		rudp::wire::write_le(prefix + snapshot_wire::AGE_OFFSET, age);
+		rudp::wire::write_le(prefix + snapshot_wire::SIZE_OFFSET, static_cast<uint32_t>(size));
+		buffer.resize(prefix_size + encoded_size);
+
+		// The slot of the snapshot SNAPSHOT_HISTORY_SIZE ago, which may be the baseline no more.
+		SentSnapshot& slot = snapshots.sent[id % SNAPSHOT_HISTORY_SIZE];
+		slot.data = data;
+		slot.id = id;
+		slot.sent = false;
+		slot.first_sequence = state.next_send_sequence();
+
+		m_snapshot_bytes += size;
+		m_sent_bytes += snapshot_wire::PREFIX_SIZE + encoded_size;
+		return buffer;
+	}
+
+	// The snapshot's datagrams are the sequences taken since encode().
+	void record_sent(rudp::PeerHandle peer) {
+		const rudp::ProtocolState<Header>* state = m_socket.get_protocol_state(peer);
+		if (!state) {
+			return;
+		}
+		PeerSnapshots& snapshots = peer_snapshots(peer);
+		SentSnapshot& slot = snapshots.sent[static_cast<uint16_t>(snapshots.next_id - 1) % SNAPSHOT_HISTORY_SIZE];
+		slot.end_sequence = state->next_send_sequence();
+		slot.sent = true;
+	}
+
+	Socket<Header, Metrics>& m_socket;
+	std::vector<PeerSnapshots> m_peers; // indexed by peer handle index
+	std::vector<uint8_t> m_scratch;
+	uint64_t m_snapshot_bytes;
+	uint64_t m_sent_bytes;
+};
+
+// Decodes the snapshots of a rudp::SnapshotSender, keeping the last SNAPSHOT_HISTORY_SIZE of each peer as baselines.
+template <typename Header>
+class SnapshotReceiver {
+public:
+	SnapshotReceiver() : m_max_snapshot_size(DEFAULT_MAX_MESSAGE_SIZE) {}
+
+	// Snapshots announcing more bytes are dropped before anything is allocated for them: a delta may be
+	// much smaller than the snapshot it rebuilds, so the socket's maximum message size does not bound it.
+	void set_max_snapshot_size(size_t max_snapshot_size) noexcept { m_max_snapshot_size = max_snapshot_size; }
+
+	// Returns the snapshot carried by the packet, valid until the next call, or nullptr if the packet is
+	// malformed, too large, or its baseline is unknown (e.g. a snapshot of the peer was not given to decode).
+	const std::vector<uint8_t>* decode(const rudp::PacketView<Header>& packet, const rudp::Peer& peer) {
+		const rudp::ByteSpan message = packet.get_message();
+		if (message.size() < snapshot_wire::PREFIX_SIZE) {
+			return nullptr;
+		}
+		const uint16_t id = rudp::wire::read_le<uint16_t>(message.data() + snapshot_wire::ID_OFFSET);
+		const uint8_t age = rudp::wire::read_le<uint8_t>(message.data() + snapshot_wire::AGE_OFFSET);
+		const uint32_t size = rudp::wire::read_le<uint32_t>(message.data() + snapshot_wire::SIZE_OFFSET);
+		const uint8_t* encoded = message.data() + snapshot_wire::PREFIX_SIZE;
+		const size_t encoded_size = message.size() - snapshot_wire::PREFIX_SIZE;
+		if (age >= SNAPSHOT_HISTORY_SIZE || size > m_max_snapshot_size) {
+			return nullptr;
+		}
+
+		PeerSnapshots& snapshots = peer_snapshots(peer.handle);
+		Snapshot& slot = snapshots.received[id % SNAPSHOT_HISTORY_SIZE];
+		slot.valid = false;
+		if (age == 0) {
+			if (encoded_size != size) {
+				return nullptr;
+			}
+			slot.data.assign(encoded, encoded + encoded_size);
+		} else {
+			const uint16_t baseline_id = static_cast<uint16_t>(id - age);
+			const Snapshot& baseline = snapshots.received[baseline_id % SNAPSHOT_HISTORY_SIZE];
+			if (!baseline.valid || baseline.id != baseline_id
+			    || !delta::decode(encoded, encoded_size, baseline.data.data(), baseline.data.size(), size, slot.data)) {
+				return nullptr;
+			}
+		}
+		slot.id = id;
+		slot.valid = true;
+		return &slot.data;
+	}
+
+private:
+	struct Snapshot {
+		Snapshot() : id(0), valid(false) {}
+
+		uint16_t id;
+		bool valid;
+		std::vector<uint8_t> data;
+	};
+
+	struct PeerSnapshots {
+		rudp::PeerHandle peer;
+		std::array<Snapshot, SNAPSHOT_HISTORY_SIZE> received; // indexed by id % SNAPSHOT_HISTORY_SIZE
+	};
+
+	// Slots reused by another peer start over.
+	PeerSnapshots& peer_snapshots(rudp::PeerHandle peer) {
+		if (peer.index >= m_peers.size()) {
+			m_peers.resize(peer.index + 1);
+		}
+		PeerSnapshots& snapshots = m_peers[peer.index];
+		if (snapshots.peer != peer) {
+			snapshots = PeerSnapshots();
+			snapshots.peer = peer;
+		}
+		return snapshots;
+	}
+
+	std::vector<PeerSnapshots> m_peers; // indexed by peer handle index
+	size_t m_max_snapshot_size;
+};
+
+}
+
+#endif //RELIABLEUDP_SNAPSHOTS_HPP
@@ -12,30 +12,57 @@
 #ifndef RELIABLEUDP_SOCKET_HPP
 #define RELIABLEUDP_SOCKET_HPP
 
+#include <memory>
 #include <string>
 #include <type_traits>
-#include <unordered_map>
+#include <utility> // std::pair
+#include <vector>
 
 #include <boost/asio.hpp>
 #include <boost/uuid/uuid.hpp>
-#include <boost/functional/hash.hpp>
 
 #include "protocols.hpp"
+#include "BufferPool.hpp"
+#include "Channels.hpp"
+#include "Fragmentation.hpp"
+#include "HandshakeCookie.hpp"
+#include "ImpairedTransport.hpp"
+#include "IoUringTransport.hpp"
+#include "Metrics.hpp"
 #include "Packet.hpp"
 #include "Peer.hpp"
+#include "PeerTable.hpp"
+#include "ProtocolState.hpp"
+#include "ReliableOrder.hpp"
+#include "TimeCritical.hpp"
+#include "TimerWheel.hpp"
+#include "TokenBucket.hpp"
+#include "Transport.hpp"
+#include "utility.hpp"
+#include "WireFormat.hpp"
 
 namespace rudp {
 
 const unsigned int DEFAULT_CONNECTION_TIMEOUT = 15;
 const unsigned int DEFAULT_KEEP_ALIVE_WAIT = 3;
-
-template <typename Header>
+const unsigned int PROTOCOL_TICK = 10; // milliseconds, resolution of the socket's timers
+const size_t DEFAULT_RECEIVE_BATCH_SIZE = 1;
+const std::chrono::microseconds DEFAULT_COALESCING_DELAY(1000);
+const unsigned int DEFAULT_CHALLENGE_RATE = 1000; // handshake challenges per second
+const unsigned int DEFAULT_BAD_PROTOCOL_REPLY_RATE = 10; // per second
+
+// Sockets whose Header is sequenced (see rudp::ProtocolState) keep per-peer protocol state:
+// with those, sends to connected peers shall be made from the thread running the io_service.
+// Metrics is rudp::SocketMetrics to count what the socket does, rudp::NoMetrics (the default) to count nothing.
+// Counting sockets expect every call, sends included, from the thread running the io_service.
+template <typename Header, typename Metrics = rudp::NoMetrics>
 class Socket {
 
-	using receive_handler_type = std::function<void(const rudp::Packet<Header>&, size_t, const rudp::Peer&)>;
+	using receive_handler_type = std::function<void(const rudp::PacketView<Header>&, size_t, const rudp::Peer&)>;
 	using connection_handler_type = std::function<void(const rudp::Peer&)>;
 	using disconnection_handler_type = std::function<void(const rudp::Peer&)>;
 	using disconnection_timeout_handler_type = std::function<void(const rudp::Peer&)>;
+	using fan_out_handler_type = std::function<void(const std::vector<rudp::SendError>&)>;
 
 public:
 	Socket(boost::asio::io_service& io_service, const size_t buffer_size,
@@ -43,6 +70,18 @@ public:
 
 	Socket(boost::asio::io_service& io_service, const size_t buffer_size);
 
+	// With a batch size greater than 1, a ring of `batch_size` receive buffers is filled by a single
+	// recvmmsg call per readiness event (Linux only, the batch size is ignored elsewhere).
+	Socket(boost::asio::io_service& io_service, const size_t buffer_size, const size_t batch_size,
+	       const boost::asio::ip::udp::endpoint& endpoint);
+
+	Socket(boost::asio::io_service& io_service, const size_t buffer_size, const size_t batch_size);
+
+	// Listens on a socket already opened and bound by the caller, e.g. with socket options that have to be
+	// set before binding (see rudp::ShardedSocket). self() gets the given uuid.
+	Socket(boost::asio::io_service& io_service, boost::asio::ip::udp::socket socket, const size_t buffer_size,
+	       const size_t batch_size, const boost::uuids::uuid& uuid);
+
 	void set_receive_handler(const receive_handler_type& handler) noexcept {
 		m_receive_handler = handler;
 	}
@@ -67,17 +106,98 @@ public:
 
 	void bind(boost::asio::ip::udp::endpoint endpoint) noexcept { m_socket.bind(endpoint); }
 
-	void async_send_to(void* buffer, size_t buffer_size, boost::asio::ip::udp::endpoint& endpoint) {
-		m_socket.async_send_to(boost::asio::buffer(buffer, buffer_size),
-		                       endpoint,
-		                       [](boost::system::error_code ec, size_t br) { }
-		);
+	// Moves the socket's I/O from asio to a rudp::IoUringTransport (Linux 6.0+).
+	// Shall be called before sending anything. Returns false, and keeps asio, if the kernel lacks io_uring or
+	// its multishot recvmsg.
+	bool use_io_uring(unsigned int buffer_count = DEFAULT_IO_URING_BUFFER_COUNT);
+
+	// Receives coalesced UDP GRO buffers with the asio transport (Linux only), split back into datagrams:
+	// fewer receive calls under load, for GRO_BUFFER_SIZE bytes per receive buffer instead of the buffer size.
+	void enable_gro() noexcept { m_asio_transport.enable_gro(); }
+
+	// Sends through a rudp::ImpairedTransport simulating a bad network, for tests and benchmarks.
+	// Shall be called after use_io_uring, if used, and before sending anything.
+	void impair(const rudp::Impairment& impairment);
+
+	// Buffers come from a pool owned by the socket and go back to it once sent.
+	rudp::SendBuffer acquire_send_buffer(size_t size) { return m_buffer_pool.acquire(size); }
+
+	// Sends to a connected peer go through the protocol (sequencing, retransmissions...). Once the peer
+	// assigned us a connection ID, the header is switched to the compact form: a buffer shared with
+	// other handles is copied first.
+	void async_send_to(rudp::SendBuffer buffer, const boost::asio::ip::udp::endpoint& endpoint);
+
+	void async_send_to(rudp::SendBuffer buffer, const rudp::Peer& peer);
+
+	// Copies the buffer into a pooled send buffer: it may be released as soon as this returns.
+	void async_send_to(const void* buffer, size_t buffer_size, const boost::asio::ip::udp::endpoint& endpoint) {
+		async_send_to(m_buffer_pool.acquire(buffer, buffer_size), endpoint);
 	}
 
-	void async_send_to_all(void* buffer, size_t buffer_size) {
-		for (auto& peer : m_peers) {
-			async_send_to(buffer, buffer_size, peer.endpoint);
-		}
+	// Sends the same payload to every endpoint as one operation, sharing one buffer, with sendmmsg
+	// batches on Linux. The handler is called once, with the failed sends only.
+	// The header is sent as built (full form).
+	void async_send_to_many(rudp::SendBuffer buffer, std::vector<boost::asio::ip::udp::endpoint> endpoints,
+	                        const fan_out_handler_type& handler = fan_out_handler_type());
+
+	void async_send_to_many(const void* buffer, size_t buffer_size,
+	                        std::vector<boost::asio::ip::udp::endpoint> endpoints,
+	                        const fan_out_handler_type& handler = fan_out_handler_type()) {
+		async_send_to_many(m_buffer_pool.acquire(buffer, buffer_size), std::move(endpoints), handler);
+	}
+
+	// With a sequenced Header, each peer gets its own copy of the buffer. Packets held back by a full
+	// send window are sent later and are not part of the operation.
+	void async_send_to_all(rudp::SendBuffer buffer, const fan_out_handler_type& handler = fan_out_handler_type());
+
+	void async_send_to_all(const void* buffer, size_t buffer_size,
+	                       const fan_out_handler_type& handler = fan_out_handler_type()) {
+		async_send_to_all(m_buffer_pool.acquire(buffer, buffer_size), handler);
+	}
+
+	// Sends payloads[i] to peers[i] as one operation, each through the protocol as with async_send_to, with
+	// sendmmsg batches on Linux. Peers no longer connected are skipped.
+	void async_send_to_each(std::vector<rudp::SendBuffer> payloads, const std::vector<rudp::PeerHandle>& peers,
+	                        const fan_out_handler_type& handler = fan_out_handler_type());
+
+	// Once enabled, messages given to async_queue_to are packed into one datagram per peer, each
+	// prefixed by its 16-bit length, behind a single header. A datagram is sent when the next message
+	// would not fit in max_datagram_size bytes, on flush(), or flush_delay after its first message.
+	// The receiving socket calls the receive handler once per message.
+	void enable_coalescing(size_t max_datagram_size = DEFAULT_MTU,
+	                       std::chrono::microseconds flush_delay = DEFAULT_COALESCING_DELAY);
+
+	// The message is the payload only: the socket writes `header`, with its own uuid, in front of it.
+	// Messages are only packed with those queued for the same peer under the same header (e.g. the same
+	// channel and delivery mode of a rudp::ChannelHeader); a different one sends the pending datagram first.
+	// Without coalescing, or if it cannot fit in a datagram with others, the message is sent on its own.
+	void async_queue_to(const void* message, size_t message_size, const rudp::Peer& peer, Header header);
+
+	void async_queue_to(const void* message, size_t message_size, const rudp::Peer& peer) {
+		async_queue_to(message, message_size, peer, Header(m_self.uuid));
+	}
+
+	void flush(const rudp::Peer& peer);
+
+	void flush();
+
+	// Datagrams larger than the smaller of the receive buffer size and the maximum datagram size are
+	// split into fragments, sent separately and reassembled by the receiving socket before reaching its
+	// receive handler: both ends are expected to use the same buffer size.
+	// Larger messages are rejected (std::length_error) when sent and dropped when received.
+	void set_max_message_size(size_t max_message_size) noexcept { m_max_message_size = max_message_size; }
+
+	// Bytes all the messages being reassembled may take, beyond which new fragmented messages are dropped.
+	void set_reassembly_memory_limit(size_t limit) noexcept { m_reassembly_budget.limit = limit; }
+
+	// Unknown peers are only added once they echo a stateless cookie sent in reply to their connection
+	// message (see rudp::CookieJar), and packets of unknown peers not trying to connect are dropped.
+	// Replies to connection attempts are limited to this many per second.
+	void set_challenge_rate(unsigned int per_second) noexcept { m_challenge_limiter.set_rate(per_second, per_second); }
+
+	// "Bad protocol" replies to malformed datagrams, 0 disables them.
+	void set_bad_protocol_reply_rate(unsigned int per_second) noexcept {
+		m_bad_protocol_limiter.set_rate(per_second, per_second);
 	}
 
 	/*template <typename SizedContainer>
@@ -97,26 +217,184 @@ public:
 
 	const rudp::Peer& self() { return m_self; }
 
+	// Connected peers, to iterate over.
+	const rudp::PeerTable& peers() const noexcept { return m_peers; }
+
+	// Returns nullptr if the peer is no longer connected.
+	const rudp::Peer* get_peer(rudp::PeerHandle handle) const noexcept { return m_peers.get(handle); }
+
+	// Returns nullptr if the peer is no longer connected.
+	const rudp::ProtocolState<Header>* get_protocol_state(rudp::PeerHandle handle) const noexcept {
+		return m_peers.get(handle) ? &m_peer_states[handle.index].protocol : nullptr;
+	}
+
+	// Returns nullptr if the peer is no longer connected. For settings such as set_fec(), on the socket's thread.
+	rudp::ProtocolState<Header>* get_protocol_state(rudp::PeerHandle handle) noexcept {
+		return m_peers.get(handle) ? &m_peer_states[handle.index].protocol : nullptr;
+	}
+
+	// Snapshots may be taken from any thread: metrics().snapshot().
+	const Metrics& metrics() const noexcept { return m_metrics; }
+
+	// Returns nullptr if the peer is no longer connected.
+	const typename Metrics::peer_metrics_type* get_peer_metrics(rudp::PeerHandle handle) const noexcept {
+		return m_peers.get(handle) ? &m_peer_states[handle.index].metrics : nullptr;
+	}
+
 private:
-	void handle_async_receive_from(const boost::system::error_code &error_code, size_t bytes_transferred);
+	// Target of the public constructors, which start listening when they should.
+	Socket(boost::asio::io_service& io_service, boost::asio::ip::udp::socket&& socket, size_t buffer_size,
+	       size_t batch_size, const rudp::Peer& self, bool listening);
+
+	// Everything the socket keeps per peer besides rudp::Peer.
+	struct PeerState {
+		rudp::ProtocolState<Header> protocol;
+		rudp::SendBuffer outgoing; // coalesced datagram being filled
+		bool flush_queued = false; // the peer's handle is in m_outgoing_peers
+		rudp::Reassembler reassembler;
+		rudp::TimerHandle timeout_timer;
+		rudp::TimerHandle protocol_timer;
+		clock_type::time_point protocol_deadline;
+		rudp::TimerHandle reassembly_timer;
+		typename Metrics::peer_metrics_type metrics;
+	};
+
+	// Payload of the timers of m_timers.
+	struct TimerEvent {
+		enum Type : uint8_t {
+			KEEP_ALIVE,
+			PEER_TIMEOUT,
+			PROTOCOL_TICK, // see rudp::ProtocolState::next_tick
+			REASSEMBLY_TIMEOUT
+		};
+
+		Type type = KEEP_ALIVE;
+		rudp::PeerHandle peer; // unused by KEEP_ALIVE
+	};
+
+	// payloads[i] goes to endpoints[i], a single payload goes to every endpoint.
+	void send_many(std::vector<rudp::SendBuffer> payloads, std::vector<boost::asio::ip::udp::endpoint> endpoints,
+	               const fan_out_handler_type& handler);
+
+	void send_datagram(rudp::SendBuffer buffer, const boost::asio::ip::udp::endpoint& endpoint);
+
+	// Datagrams of a single peer (fragments, retransmissions...): runs of equal size may go out as one GSO send.
+	void send_datagrams(std::vector<rudp::SendBuffer> datagrams, const boost::asio::ip::udp::endpoint& endpoint);
+
+	// Addressed to peer if not null: stamped, in compact form when possible, and carrying the peer's connection ID.
+	rudp::SendBuffer build_lib_message_buffer(uint32_t type, const rudp::Peer* peer);
+
+	// Connection messages to, and challenges from, a peer that is not connected yet: followed by the cookie.
+	void send_handshake(uint32_t type, const boost::asio::ip::udp::endpoint& endpoint, const rudp::HandshakeCookie& cookie);
+
+	// Whether the sender of a packet with an unknown uuid becomes a peer: it answers our connect(), or
+	// echoes a valid cookie. Otherwise, connection attempts are challenged and anything else is dropped.
+	bool admit_peer(const rudp::PacketView<Header>& packet, const boost::asio::ip::udp::endpoint& endpoint);
+
+	void reply_bad_protocol(const uint8_t* data, size_t size, const boost::asio::ip::udp::endpoint& endpoint);
+
+	// Makes the buffer ours to modify and switches it to the compact form when the peer allows it.
+	void prepare_send(rudp::SendBuffer& buffer, const rudp::Peer& peer);
+
+	// Calls f with the datagram, or with each of its fragments if it is too large, leaving `reserved` bytes free
+	// (see rudp::ProtocolState::datagram_overhead).
+	template <typename Function>
+	void for_each_fragment(rudp::SendBuffer buffer, size_t reserved, const Function& f);
+
+	// Called with peers about to be erased from m_peers.
+	void reset_peer_state(const rudp::Peer& peer);
 
-	void handle_keep_alive();
+	// Hands a user packet to the receive handler, split into its messages if coalesced.
+	void deliver(const rudp::PacketView<Header>& packet, const rudp::Peer& peer);
+
+	// Timed when metrics are enabled.
+	void call_receive_handler(const rudp::PacketView<Header>& packet, size_t size, const rudp::Peer& peer);
+
+	void start_flush_timer();
+
+	void send_lib_message(uint32_t type, const boost::asio::ip::udp::endpoint& endpoint);
+
+	void send_lib_message(uint32_t type, rudp::Peer& peer);
+
+	void send_lib_message_to_all(uint32_t type);
+
+	rudp::Peer& add_peer(const boost::asio::ip::udp::endpoint& endpoint, const boost::uuids::uuid& uuid,
+	                     clock_type::time_point timestamp);
+
+	rudp::ProtocolState<Header>& protocol_state(const rudp::Peer& peer) noexcept {
+		return m_peer_states[peer.handle.index].protocol;
+	}
+
+	// `generation` is the m_receive_generation the receive was started with.
+	void handle_receive(const boost::system::error_code& error_code, const rudp::Datagram* datagrams, size_t count,
+	                    uint32_t generation);
+
+	void handle_datagram(const uint8_t* data, size_t bytes_transferred,
+	                     const boost::asio::ip::udp::endpoint& remote_endpoint);
 
 	void start_receive();
 
 	void start_keep_alive();
 
+	rudp::TimerHandle schedule_timer(clock_type::time_point deadline, typename TimerEvent::Type type,
+	                                 rudp::PeerHandle peer);
+
+	// (Re)schedules the peer's protocol timer for ProtocolState::next_tick, after anything that may move it.
+	void schedule_protocol_tick(const rudp::Peer& peer);
+
+	void schedule_reassembly_timeout(const rudp::Peer& peer);
+
+	// Waits for the nearest timer of m_timers, unless an earlier wait is pending.
+	void start_timers(clock_type::time_point wakeup);
+
+	void handle_timers();
+
+	void handle_timer(const TimerEvent& event);
+
+	void handle_peer_timeout(rudp::Peer& peer);
+
 	unsigned int m_connection_timeout;
 	bool m_listening;
 
 	boost::asio::io_service& m_io_service;
+	rudp::BufferPool m_buffer_pool;
 	boost::asio::ip::udp::socket m_socket;
-	boost::asio::ip::udp::endpoint m_remote_endpoint;
-	boost::asio::deadline_timer m_timer;
+	rudp::AsioTransport m_asio_transport;
+	std::unique_ptr<rudp::Transport> m_io_uring_transport;
+	std::unique_ptr<rudp::Transport> m_impaired_transport; // wrapping one of the above
+	rudp::Transport* m_transport; // one of the above
+	uint32_t m_receive_generation; // bumped when the receive loop moves to another transport
+	boost::asio::deadline_timer m_flush_timer;
+
+	// Read once per receive batch or timer expiry, shared by everything that batch triggers.
+	clock_type::time_point m_now;
+	// Keep alive, peer timeouts, retransmissions... all the socket's timers, behind a single asio timer.
+	rudp::TimerWheel<TimerEvent> m_timers;
+	boost::asio::steady_timer m_timers_timer;
+	clock_type::time_point m_timers_wakeup; // max() when not waiting
 
 	rudp::Peer m_self;
-	std::vector<uint8_t> m_recv_buf;
-	std::vector<rudp::Peer> m_peers;
+	size_t m_buffer_size;
+	rudp::PeerTable m_peers;
+	std::vector<PeerState> m_peer_states; // indexed by peer handle index
+
+	bool m_coalescing;
+	size_t m_max_datagram_size;
+	std::chrono::microseconds m_flush_delay;
+	bool m_flush_timer_armed;
+	std::vector<rudp::PeerHandle> m_outgoing_peers; // peers with a datagram being filled
+
+	size_t m_max_message_size;
+	uint16_t m_next_message_id; // of fragmented messages
+	rudp::ReassemblyBudget m_reassembly_budget;
+
+	rudp::CookieJar m_cookies;
+	rudp::TokenBucket m_challenge_limiter;
+	rudp::TokenBucket m_bad_protocol_limiter;
+	// Endpoints given to connect() that did not answer yet, asked again on each keep alive.
+	std::vector<std::pair<boost::asio::ip::udp::endpoint, clock_type::time_point>> m_pending_connects;
+
+	Metrics m_metrics;
 
 	receive_handler_type m_receive_handler;
 	connection_handler_type m_connection_handler;
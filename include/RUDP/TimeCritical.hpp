@@ -0,0 +1,244 @@
+///////////////////////////////////////////////////////////////////////////////////////////////////
+//                                                                                               //
+// Copyright 2017 Benoît CORTIER                                                                 //
+//                                                                                               //
+// This file is part of RUDP project which is released under the                                 //
+// European Union Public License v1.1. If a copy of the EUPL was                                 //
+// not distributed with this software, you can obtain one at :                                   //
+// https://joinup.ec.europa.eu/community/eupl/og_page/european-union-public-licence-eupl-v11     //
+//                                                                                               //
+///////////////////////////////////////////////////////////////////////////////////////////////////
+
+#ifndef RELIABLEUDP_TIMECRITICAL_HPP
+#define RELIABLEUDP_TIMECRITICAL_HPP
+
+#include <array>
+#include <chrono>
+#include <cstdint> // uint16_t, uint64_t
+#include <limits> // std::numeric_limits
+
+#include "BufferPool.hpp"
+#include "Fec.hpp"
+#include "Fragmentation.hpp"
+#include "Packet.hpp"
+#include "ProtocolState.hpp"
+#include "protocols.hpp"
+#include "utility.hpp"
+#include "WireFormat.hpp"
+
+namespace rudp {
+
+// Number of recent send times kept to match incoming acknowledgements against.
+const uint16_t TIME_CRITICAL_HISTORY_SIZE = 32;
+
+// Without outgoing traffic to carry it, an acknowledgement is sent on its own after that delay.
+const std::chrono::milliseconds TIME_CRITICAL_ACK_DELAY(50);
+
+// Newest-wins delivery for data that goes stale within milliseconds, for headers with `sequence` and `ack`
+// fields (rudp::TimeCriticalHeader, and the sequenced channels of rudp::ChannelHeader).
+//
+// Outgoing packets get consecutive sequence numbers and are never retransmitted.
+// Incoming packets older than the last one delivered are dropped before the receive handler runs,
+// so a late packet can neither block nor overwrite newer state.
+// The fragments of a message are judged by the first sequence of the message, so that they may arrive in any
+// order: once one is delivered, packets and fragments of older messages are dropped.
+// Each header acknowledges the most recent sequence received: matched against the send times of the
+// last TIME_CRITICAL_HISTORY_SIZE packets, it feeds the round trip time estimate. Samples include the
+// time the peer waited for outgoing traffic to carry the acknowledgement (at most TIME_CRITICAL_ACK_DELAY).
+// Gaps in incoming sequences feed the loss estimate.
+// With forward error correction (set_fec), a parity datagram follows every group of packets and rebuilds a
+// single lost one of the group, as long as nothing more recent was delivered in the meantime: it arrives
+// after the rest of its group, so it mostly saves the last packet before a pause in the traffic.
+template <typename Header>
+class TimeCriticalState {
+public:
+	static constexpr bool SEQUENCED = true;
+	static constexpr bool TICKED = true;
+
+	TimeCriticalState() noexcept { reset(); }
+
+	void reset() noexcept {
+		m_next_sequence = 0;
+		m_has_ack = false;
+		m_last_ack = 0;
+		for (auto& sent : m_history) {
+			sent = SentPacket();
+		}
+		m_rtt.reset();
+		m_last_stamp = clock_type::time_point();
+		m_fec.reset();
+		m_adaptive_fec = false;
+
+		m_has_received = false;
+		m_remote_sequence = std::numeric_limits<uint16_t>::max();
+		m_stale_sequence = 0;
+		m_ack_due = false;
+		m_loss.reset();
+		m_fec_decoder.reset();
+		m_stale_count = 0;
+	}
+
+	void stamp(Header& header) noexcept {
+		header.ack = m_remote_sequence;
+		m_ack_due = false;
+	}
+
+	template <typename SendFunction>
+	void send(rudp::SendBuffer buffer, clock_type::time_point now, rudp::BufferPool& pool, const SendFunction& send) {
+		if (!WireFormat<Header>::fits(buffer.data(), buffer.size())) {
+			send(std::move(buffer));
+			return;
+		}
+
+		const uint16_t sequence = m_next_sequence++;
+		WireFormat<Header>::rewrite_fields(buffer.data(), [this, sequence](Header& header) {
+			header.sequence = sequence;
+			stamp(header);
+		});
+		m_last_stamp = now;
+
+		SentPacket& sent = m_history[sequence % TIME_CRITICAL_HISTORY_SIZE];
+		sent.sequence = sequence;
+		sent.sent_at = now;
+		sent.sampled = false;
+
+		if (m_adaptive_fec) {
+			m_fec.set_group_size(fec_group_size(m_loss.loss()));
+		}
+		const rudp::SendBuffer datagram = buffer;
+		send(std::move(buffer));
+		m_fec.add(datagram, sequence, pool, send);
+	}
+
+	template <typename SendFunction>
+	void on_receive_header(const Header& header, clock_type::time_point now, rudp::BufferPool& /*pool*/,
+	                       const SendFunction& /*send*/) {
+		if (m_has_ack && !sequence_more_recent(header.ack, m_last_ack)) {
+			return;
+		}
+		if (!sequence_more_recent(m_next_sequence, header.ack)) { // nothing sent yet, or bogus
+			return;
+		}
+		m_has_ack = true;
+		m_last_ack = header.ack;
+
+		SentPacket& sent = m_history[header.ack % TIME_CRITICAL_HISTORY_SIZE];
+		if (sent.sequence == header.ack && !sent.sampled && sent.sent_at != clock_type::time_point()) {
+			sent.sampled = true;
+			m_rtt.add_sample(now - sent.sent_at);
+		}
+	}
+
+	template <typename DeliverFunction>
+	void receive(const rudp::PacketView<Header>& packet, clock_type::time_point now,
+	             rudp::BufferPool& pool, const DeliverFunction& deliver) {
+		if (packet.get_flags() & wire::PARITY_FLAG) {
+			const rudp::SendBuffer recovered = m_fec_decoder.recover(packet, pool);
+			if (recovered) {
+				receive(rudp::PacketView<Header>(recovered.data(), recovered.size()), now, pool, deliver);
+			}
+			return;
+		}
+		m_fec_decoder.store(packet, pool);
+
+		const uint16_t sequence = packet.get_header().sequence;
+		const bool fragment = (packet.get_flags() & wire::FRAGMENT_FLAG) != 0;
+		uint16_t first = sequence; // of the message
+		if (fragment) {
+			if (packet.get_message().size() < FragmentHeader::SIZE) {
+				return;
+			}
+			first = static_cast<uint16_t>(sequence - FragmentHeader::read(packet.get_message().data()).index);
+		}
+		if (m_has_received && !sequence_more_recent(first, m_stale_sequence)) {
+			++m_stale_count;
+			return;
+		}
+
+		if (!m_has_received || sequence_more_recent(sequence, m_remote_sequence)) {
+			m_loss.on_received(m_has_received ? static_cast<uint16_t>(sequence - m_remote_sequence - 1) : 0);
+			m_remote_sequence = sequence;
+		}
+		m_has_received = true;
+		m_stale_sequence = fragment ? static_cast<uint16_t>(first - 1) : sequence;
+		m_ack_due = true;
+		deliver(packet);
+	}
+
+	template <typename SendFunction>
+	bool tick(clock_type::time_point now, rudp::BufferPool& /*pool*/, const SendFunction& /*send*/) {
+		if (m_ack_due && now - m_last_stamp >= TIME_CRITICAL_ACK_DELAY) {
+			m_last_stamp = now;
+			return true;
+		}
+		return false;
+	}
+
+	clock_type::time_point next_tick() const noexcept {
+		return m_ack_due ? m_last_stamp + TIME_CRITICAL_ACK_DELAY : clock_type::time_point::max();
+	}
+
+	const RttEstimator& rtt() const noexcept { return m_rtt; }
+
+	// Packets received since the last stamp().
+	bool ack_due() const noexcept { return m_ack_due; }
+
+	// Smoothed fraction of incoming sequences that never arrived, or arrived too late to be delivered.
+	double incoming_loss() const noexcept { return m_loss.loss(); }
+
+	// Sends a parity datagram after every `group_size` packets (see rudp::FecEncoder), 0 to stop.
+	void set_fec(uint8_t group_size) noexcept {
+		m_adaptive_fec = false;
+		m_fec.set_group_size(group_size);
+	}
+
+	// Picks the group size from incoming_loss() before each packet (see rudp::fec_group_size), assuming the
+	// path loses about as much both ways.
+	void set_adaptive_fec() noexcept { m_adaptive_fec = true; }
+
+	// Room the parity datagrams need beyond the largest datagram of their group.
+	size_t datagram_overhead() const noexcept { return m_fec.active() || m_adaptive_fec ? fec_wire::PREFIX_SIZE : 0; }
+
+	const FecEncoder<Header>& fec() const noexcept { return m_fec; }
+
+	// Incoming packets rebuilt from parity datagrams.
+	uint64_t recovered_count() const noexcept { return m_fec_decoder.recovered_count(); }
+
+	// Number of incoming packets dropped because a more recent one had already been delivered.
+	uint64_t stale_count() const noexcept { return m_stale_count; }
+
+private:
+	struct SentPacket {
+		SentPacket() : sequence(0), sampled(true) {}
+
+		uint16_t sequence;
+		clock_type::time_point sent_at;
+		bool sampled;
+	};
+
+	// Sending side.
+	uint16_t m_next_sequence;
+	bool m_has_ack;
+	uint16_t m_last_ack;
+	std::array<SentPacket, TIME_CRITICAL_HISTORY_SIZE> m_history;
+	RttEstimator m_rtt;
+	clock_type::time_point m_last_stamp;
+	FecEncoder<Header> m_fec;
+	bool m_adaptive_fec;
+
+	// Receiving side.
+	bool m_has_received;
+	uint16_t m_remote_sequence; // most recent received
+	uint16_t m_stale_sequence; // packets up to it are dropped
+	bool m_ack_due;
+	LossEstimator m_loss;
+	FecDecoder<Header> m_fec_decoder;
+	uint64_t m_stale_count;
+};
+
+template <>
+class ProtocolState<TimeCriticalHeader> : public TimeCriticalState<TimeCriticalHeader> {};
+
+}
+
+#endif //RELIABLEUDP_TIMECRITICAL_HPP
@@ -0,0 +1,264 @@
+///////////////////////////////////////////////////////////////////////////////////////////////////
+//                                                                                               //
+// Copyright 2017 Benoît CORTIER                                                                 //
+//                                                                                               //
+// This file is part of RUDP project which is released under the                                 //
+// European Union Public License v1.1. If a copy of the EUPL was                                 //
+// not distributed with this software, you can obtain one at :                                   //
+// https://joinup.ec.europa.eu/community/eupl/og_page/european-union-public-licence-eupl-v11     //
+//                                                                                               //
+///////////////////////////////////////////////////////////////////////////////////////////////////
+
+#ifndef RELIABLEUDP_TIMERWHEEL_HPP
+#define RELIABLEUDP_TIMERWHEEL_HPP
+
+#include <algorithm> // std::min, std::max
+#include <array>
+#include <cstddef> // size_t
+#include <cstdint> // uint32_t, uint64_t
+#include <limits> // std::numeric_limits
+#include <vector>
+
+#include "utility.hpp"
+
+namespace rudp {
+
+// Stable reference to a timer of a rudp::TimerWheel, see rudp::PeerHandle.
+struct TimerHandle {
+	TimerHandle() : index(0), generation(0) {}
+
+	TimerHandle(uint32_t index, uint32_t generation)
+		: index(index)
+		, generation(generation)
+	{}
+
+	// Default constructed handles refer to no timer.
+	explicit operator bool() const noexcept { return generation != 0; }
+
+	uint32_t index;
+	uint32_t generation;
+};
+
+// Hierarchical timer wheel (Varghese & Lauck).
+//
+// Time is cut in ticks of a fixed duration. Level 0 has one slot per tick for the next SLOT_COUNT ticks,
+// each higher level has one slot per SLOT_COUNT ticks of the level below; timers cascade down one level
+// each time the level below wraps around. Scheduling and cancelling are O(1) and advancing costs
+// O(expired + cascaded) per tick, independently of the number of pending timers.
+// Timers hold a Payload, handed back when they expire.
+template <typename Payload>
+class TimerWheel {
+public:
+	static constexpr unsigned int SLOT_BITS = 6;
+	static constexpr size_t SLOT_COUNT = size_t(1) << SLOT_BITS;
+	static constexpr size_t LEVEL_COUNT = 4; // SLOT_COUNT^4 ticks: 194 days with 1 s ticks, 46 hours with 10 ms ticks
+
+	TimerWheel(clock_type::duration tick, clock_type::time_point start)
+		: m_tick(tick)
+		, m_start(start)
+		, m_current(0)
+		, m_size(0)
+		, m_free_node(NONE)
+	{
+		for (auto& level : m_slots) {
+			level.fill(NONE);
+		}
+	}
+
+	size_t size() const noexcept { return m_size; }
+
+	bool empty() const noexcept { return m_size == 0; }
+
+	clock_type::duration tick() const noexcept { return m_tick; }
+
+	// Deadlines are rounded up to the next tick. Past deadlines expire on the next tick.
+	TimerHandle schedule(clock_type::time_point deadline, const Payload& payload) {
+		uint32_t index;
+		if (m_free_node != NONE) {
+			index = m_free_node;
+			m_free_node = m_nodes[index].next;
+		} else {
+			index = static_cast<uint32_t>(m_nodes.size());
+			m_nodes.emplace_back();
+		}
+
+		Node& node = m_nodes[index];
+		node.deadline = to_tick(deadline);
+		node.payload = payload;
+		node.active = true;
+		insert(index, m_current + 1);
+		++m_size;
+		return TimerHandle(index, node.generation);
+	}
+
+	// Returns false if the timer already expired or was cancelled.
+	bool cancel(TimerHandle handle) noexcept {
+		if (!is_pending(handle)) {
+			return false;
+		}
+		unlink(handle.index);
+		release(handle.index);
+		return true;
+	}
+
+	bool is_pending(TimerHandle handle) const noexcept {
+		return handle.index < m_nodes.size() && m_nodes[handle.index].generation == handle.generation
+		       && m_nodes[handle.index].active;
+	}
+
+	// Calls expired(handle, payload) for every timer whose deadline is now past.
+	// The callback may schedule and cancel timers.
+	template <typename ExpiredFunction>
+	void advance(clock_type::time_point now, const ExpiredFunction& expired) {
+		const uint64_t target = now < m_start ? 0 : static_cast<uint64_t>((now - m_start) / m_tick);
+		while (m_current < target) {
+			if (m_size == 0) {
+				m_current = target;
+				break;
+			}
+			++m_current;
+			cascade();
+
+			uint32_t& head = m_slots[0][m_current & SLOT_MASK];
+			while (head != NONE) {
+				const uint32_t index = head;
+				unlink(index);
+				const Payload payload = m_nodes[index].payload;
+				const TimerHandle handle(index, m_nodes[index].generation);
+				release(index);
+				expired(handle, payload);
+			}
+		}
+	}
+
+	// Time at which advance() should be called next: the deadline of the nearest timer of level 0,
+	// or the next time higher levels cascade. Only meaningful if the wheel is not empty.
+	clock_type::time_point next_wakeup() const noexcept {
+		for (uint64_t tick = m_current + 1; tick <= m_current + SLOT_COUNT; ++tick) {
+			if (m_slots[0][tick & SLOT_MASK] != NONE) {
+				return m_start + m_tick * tick;
+			}
+			if ((tick & SLOT_MASK) == 0) { // the next level cascades
+				return m_start + m_tick * tick;
+			}
+		}
+		return m_start + m_tick * (m_current + SLOT_COUNT);
+	}
+
+private:
+	static constexpr uint32_t NONE = std::numeric_limits<uint32_t>::max();
+	static constexpr uint64_t SLOT_MASK = SLOT_COUNT - 1;
+
+	struct Node {
+		uint64_t deadline = 0; // in ticks
+		uint32_t prev = NONE;
+		uint32_t next = NONE; // next free node when not active
+		uint32_t generation = 1;
+		uint8_t level = 0;
+		uint8_t slot = 0;
+		bool active = false;
+		Payload payload;
+	};
+
+	uint64_t to_tick(clock_type::time_point time) const noexcept {
+		if (time <= m_start) {
+			return 0;
+		}
+		const clock_type::duration elapsed = time - m_start;
+		return static_cast<uint64_t>((elapsed + m_tick - clock_type::duration(1)) / m_tick);
+	}
+
+	// Timers due before first_tick go to first_tick's slot.
+	void insert(uint32_t index, uint64_t first_tick) noexcept {
+		Node& node = m_nodes[index];
+		const uint64_t deadline = std::max(node.deadline, first_tick);
+		const uint64_t delta = deadline - m_current;
+
+		size_t level = 0;
+		while (level + 1 < LEVEL_COUNT && delta >= (uint64_t(1) << (SLOT_BITS * (level + 1)))) {
+			++level;
+		}
+		// Beyond the last level, timers wait in its farthest slot and cascade again later.
+		const uint64_t slot_tick = level + 1 == LEVEL_COUNT
+		                           ? std::min(deadline, m_current + (uint64_t(1) << (SLOT_BITS * LEVEL_COUNT)) - 1)
+		                           : deadline;
+		node.level = static_cast<uint8_t>(level);
+		node.slot = static_cast<uint8_t>((slot_tick >> (SLOT_BITS * level)) & SLOT_MASK);
+
+		uint32_t& head = m_slots[level][node.slot];
+		node.prev = NONE;
+		node.next = head;
+		if (head != NONE) {
+			m_nodes[head].prev = index;
+		}
+		head = index;
+	}
+
+	void unlink(uint32_t index) noexcept {
+		Node& node = m_nodes[index];
+		if (node.prev != NONE) {
+			m_nodes[node.prev].next = node.next;
+		} else {
+			m_slots[node.level][node.slot] = node.next;
+		}
+		if (node.next != NONE) {
+			m_nodes[node.next].prev = node.prev;
+		}
+	}
+
+	void release(uint32_t index) noexcept {
+		Node& node = m_nodes[index];
+		node.active = false;
+		node.payload = Payload();
+		if (++node.generation == 0) { // 0 is reserved for default constructed handles
+			node.generation = 1;
+		}
+		node.next = m_free_node;
+		m_free_node = index;
+		--m_size;
+	}
+
+	// Moves the timers of the higher level slots reached by m_current down to the lower levels.
+	void cascade() noexcept {
+		for (size_t level = 1; level < LEVEL_COUNT; ++level) {
+			if ((m_current & ((uint64_t(1) << (SLOT_BITS * level)) - 1)) != 0) {
+				return;
+			}
+			uint32_t& head = m_slots[level][(m_current >> (SLOT_BITS * level)) & SLOT_MASK];
+			uint32_t index = head;
+			head = NONE;
+			while (index != NONE) {
+				const uint32_t next = m_nodes[index].next;
+				insert(index, m_current); // level 0's slot for m_current is processed right after
+				index = next;
+			}
+		}
+	}
+
+	clock_type::duration m_tick;
+	clock_type::time_point m_start;
+	uint64_t m_current; // last tick processed
+	size_t m_size;
+	std::vector<Node> m_nodes;
+	uint32_t m_free_node;
+	std::array<std::array<uint32_t, SLOT_COUNT>, LEVEL_COUNT> m_slots;
+};
+
+template <typename Payload>
+constexpr unsigned int TimerWheel<Payload>::SLOT_BITS;
+
+template <typename Payload>
+constexpr size_t TimerWheel<Payload>::SLOT_COUNT;
+
+template <typename Payload>
+constexpr size_t TimerWheel<Payload>::LEVEL_COUNT;
+
+template <typename Payload>
+constexpr uint32_t TimerWheel<Payload>::NONE;
+
+template <typename Payload>
+constexpr uint64_t TimerWheel<Payload>::SLOT_MASK;
+
+}
+
+#endif //RELIABLEUDP_TIMERWHEEL_HPP
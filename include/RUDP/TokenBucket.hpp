@@ -0,0 +1,82 @@
+///////////////////////////////////////////////////////////////////////////////////////////////////
+//                                                                                               //
+// Copyright 2017 Benoît CORTIER                                                                 //
+//                                                                                               //
+// This file is part of RUDP project which is released under the                                 //
+// European Union Public License v1.1. If a copy of the EUPL was                                 //
+// not distributed with this software, you can obtain one at :                                   //
+// https://joinup.ec.europa.eu/community/eupl/og_page/european-union-public-licence-eupl-v11     //
+//                                                                                               //
+///////////////////////////////////////////////////////////////////////////////////////////////////
+
+#ifndef RELIABLEUDP_TOKENBUCKET_HPP
+#define RELIABLEUDP_TOKENBUCKET_HPP
+
+#include <algorithm> // std::min
+#include <chrono>
+
+#include "utility.hpp"
+
+namespace rudp {
+
+// Allows `rate` units per second on average, and bursts of up to `burst` units saved while idle.
+// A rate of 0 allows nothing.
+class TokenBucket {
+public:
+	TokenBucket(double rate, double burst) noexcept
+		: m_rate(rate)
+		, m_burst(burst)
+		, m_tokens(burst)
+		, m_last()
+	{}
+
+	void set_rate(double rate, double burst) noexcept {
+		m_rate = rate;
+		m_burst = burst;
+		m_tokens = std::min(m_tokens, m_burst);
+	}
+
+	double rate() const noexcept { return m_rate; }
+
+	// Takes `cost` units if available.
+	bool try_consume(clock_type::time_point now, double cost = 1.0) noexcept {
+		refill(now);
+		if (m_tokens < cost) {
+			return false;
+		}
+		m_tokens -= cost;
+		return true;
+	}
+
+	// When `cost` units will be available at the current rate, max() never.
+	clock_type::time_point available_at(clock_type::time_point now, double cost = 1.0) const noexcept {
+		const double tokens = now > m_last
+		                      ? std::min(m_burst, m_tokens + std::chrono::duration<double>(now - m_last).count() * m_rate)
+		                      : m_tokens;
+		if (tokens >= cost) {
+			return now;
+		}
+		if (m_rate <= 0 || cost > m_burst) {
+			return clock_type::time_point::max();
+		}
+		return now + std::chrono::duration_cast<clock_type::duration>(std::chrono::duration<double>((cost - tokens) / m_rate));
+	}
+
+private:
+	void refill(clock_type::time_point now) noexcept {
+		if (now > m_last) {
+			const double elapsed = std::chrono::duration<double>(now - m_last).count();
+			m_tokens = std::min(m_burst, m_tokens + elapsed * m_rate);
+			m_last = now;
+		}
+	}
+
+	double m_rate;
+	double m_burst;
+	double m_tokens;
+	clock_type::time_point m_last;
+};
+
+}
+
+#endif //RELIABLEUDP_TOKENBUCKET_HPP
@@ -0,0 +1,549 @@
+///////////////////////////////////////////////////////////////////////////////////////////////////
+//                                                                                               //
+// Copyright 2017 Benoît CORTIER                                                                 //
+//                                                                                               //
+// This file is part of RUDP project which is released under the                                 //
+// European Union Public License v1.1. If a copy of the EUPL was                                 //
+// not distributed with this software, you can obtain one at :                                   //
+// https://joinup.ec.europa.eu/community/eupl/og_page/european-union-public-licence-eupl-v11     //
+//                                                                                               //
+///////////////////////////////////////////////////////////////////////////////////////////////////
+
+#ifndef RELIABLEUDP_TRANSPORT_HPP
+#define RELIABLEUDP_TRANSPORT_HPP
+
+#include <algorithm> // std::min, std::max
+#include <cerrno>
+#include <cstddef> // size_t
+#include <cstdint> // uint8_t
+#include <cstring> // std::memcpy
+#include <deque>
+#include <functional>
+#include <memory>
+#include <vector>
+
+#include <boost/asio.hpp>
+
+#ifdef __linux__
+#include <netinet/in.h> // IPPROTO_UDP
+#include <netinet/udp.h> // UDP_SEGMENT, UDP_GRO
+#include <sys/socket.h> // recvmmsg, sendmmsg, sendmsg
+#endif
+
+#include "BufferPool.hpp"
+
+namespace rudp {
+
+const size_t SEND_BATCH_SIZE = 64;
+
+// Limits of a single UDP_SEGMENT send: the kernel's UDP_MAX_SEGMENTS and the largest IPv4 UDP payload.
+const size_t GSO_MAX_SEGMENTS = 64;
+const size_t GSO_MAX_BYTES = 65507;
+// Receive buffer size with UDP_GRO: the kernel hands over up to a whole coalesced 64KiB payload.
+const size_t GRO_BUFFER_SIZE = 65535;
+
+struct SendError {
+	boost::asio::ip::udp::endpoint endpoint;
+	boost::system::error_code error;
+};
+
+// A datagram received by a rudp::Transport, only valid during the receive handler call.
+struct Datagram {
+	const uint8_t* data;
+	size_t size;
+	boost::asio::ip::udp::endpoint endpoint;
+};
+
+// Moves datagrams in and out of the UDP socket underneath a rudp::Socket, which holds the protocol logic.
+// Handlers are called from the thread running the io_service.
+class Transport {
+public:
+	using receive_handler_type = std::function<void(const boost::system::error_code&, const Datagram*, size_t)>;
+	using send_handler_type = std::function<void(std::vector<SendError>)>;
+
+	virtual ~Transport() {}
+
+	// Calls the handler once, with the next batch of datagrams or with the error that stopped the receive.
+	virtual void async_receive(const receive_handler_type& handler) = 0;
+
+	// The buffer is kept alive until sent. Errors are ignored.
+	virtual void async_send(SendBuffer buffer, const boost::asio::ip::udp::endpoint& endpoint) = 0;
+
+	// Sends payloads[i] to endpoints[i], or a single payload to every endpoint. The handler, if any, is called
+	// once with the failed sends, possibly from within this call.
+	virtual void async_send_many(std::vector<SendBuffer> payloads, std::vector<boost::asio::ip::udp::endpoint> endpoints,
+	                             const send_handler_type& handler) = 0;
+
+	// Sends the datagrams, in order, to a single endpoint. Transports supporting UDP GSO hand each run of
+	// equal-size datagrams (the last of a run may be shorter, as with fragments) to the kernel as one send.
+	virtual void async_send_segments(std::vector<SendBuffer> datagrams, const boost::asio::ip::udp::endpoint& endpoint) {
+		for (auto& datagram : datagrams) {
+			async_send(std::move(datagram), endpoint);
+		}
+	}
+};
+
+#ifdef __linux__
+namespace detail {
+
+const size_t GSO_CONTROL_SIZE = CMSG_SPACE(sizeof(uint16_t));
+const size_t GRO_CONTROL_SIZE = CMSG_SPACE(sizeof(int));
+
+// Number of datagrams, from first on, that fit in one UDP_SEGMENT send.
+inline size_t segment_run(const std::vector<SendBuffer>& datagrams, size_t first) noexcept {
+	const size_t segment_size = datagrams[first].size();
+	size_t total = segment_size;
+	size_t count = 1;
+	while (first + count < datagrams.size() && count < GSO_MAX_SEGMENTS) {
+		const size_t size = datagrams[first + count].size();
+		if (size == 0 || size > segment_size || total + size > GSO_MAX_BYTES) {
+			break;
+		}
+		total += size;
+		++count;
+		if (size < segment_size) { // only the last segment may be shorter
+			break;
+		}
+	}
+	return count;
+}
+
+// Attaches a UDP_SEGMENT control message to msg, stored in control (GSO_CONTROL_SIZE bytes).
+inline void set_segment_size(msghdr& msg, uint8_t* control, size_t segment_size) noexcept {
+	std::memset(control, 0, GSO_CONTROL_SIZE);
+	msg.msg_control = control;
+	msg.msg_controllen = GSO_CONTROL_SIZE;
+	cmsghdr* header = CMSG_FIRSTHDR(&msg);
+	header->cmsg_level = IPPROTO_UDP;
+	header->cmsg_type = UDP_SEGMENT;
+	header->cmsg_len = CMSG_LEN(sizeof(uint16_t));
+	const uint16_t size = static_cast<uint16_t>(segment_size);
+	std::memcpy(CMSG_DATA(header), &size, sizeof(size));
+}
+
+// Errors telling that the route or the kernel cannot segment at all, as opposed to a failure of this send.
+inline bool is_gso_unsupported(int error) noexcept {
+	return error == EIO || error == ENOPROTOOPT || error == EOPNOTSUPP;
+}
+
+}
+#endif
+
+// Default transport: asio's reactor, with recvmmsg and sendmmsg batches on Linux.
+//
+// On Linux, runs given to async_send_segments go out as single UDP_SEGMENT sends (GSO) when the kernel
+// supports it, and all sends go through a single queue, so that datagrams leave in the order they were given.
+// UDP_GRO is only enabled on request (enable_gro): the coalesced buffers it returns are split back into
+// datagrams before reaching the receive handler.
+class AsioTransport : public Transport {
+public:
+	// With a batch size greater than 1, a ring of `batch_size` receive buffers is filled by a single
+	// recvmmsg call per readiness event (Linux only, the batch size is ignored elsewhere).
+	AsioTransport(boost::asio::ip::udp::socket& socket, size_t buffer_size, size_t batch_size)
+		: m_socket(socket)
+		, m_buffer_size(buffer_size)
+		, m_batch_size(batch_size)
+	{
+#ifdef __linux__
+		m_batch_size = std::max<size_t>(m_batch_size, 1);
+		m_offload_checked = false;
+		m_gso = false;
+		m_gro_requested = false;
+		m_gro = false;
+		m_sending = false;
+		init_receive_ring(m_buffer_size);
+#else
+		m_batch_size = 1;
+		m_slot_size = m_buffer_size;
+		m_recv_buf.resize(m_buffer_size);
+#endif
+	}
+
+	// Receives coalesced UDP_GRO buffers, from the next receive on, if the kernel supports it (Linux only).
+	// Each receive buffer then takes GRO_BUFFER_SIZE bytes instead of the buffer size.
+	void enable_gro() noexcept {
+#ifdef __linux__
+		m_gro_requested = true;
+#endif
+	}
+
+	void async_receive(const receive_handler_type& handler) override {
+#ifdef __linux__
+		check_offload();
+		if (m_gro_requested && !m_gro) { // no receive is pending: the ring may be resized
+			enable_socket_gro();
+		}
+		if (m_batch_size > 1 || m_gro) {
+			m_socket.async_wait(boost::asio::ip::udp::socket::wait_read, [this, handler](auto ec) {
+				this->handle_receive_batch(ec, handler);
+			});
+			return;
+		}
+#endif
+
+		// On Linux, MSG_TRUNC makes the receive return the whole size of a datagram larger than the buffer, which
+		// is dropped like on the recvmmsg path. Elsewhere, truncated datagrams cannot be told apart.
+#ifdef __linux__
+		const boost::asio::socket_base::message_flags flags = MSG_TRUNC;
+#else
+		const boost::asio::socket_base::message_flags flags = 0;
+#endif
+		m_socket.async_receive_from(
+			boost::asio::buffer(m_recv_buf.data(), m_buffer_size),
+			m_remote_endpoint,
+			flags,
+			[this, handler](auto ec, auto bytes_transferred) {
+				const Datagram datagram = { m_recv_buf.data(), bytes_transferred, m_remote_endpoint };
+				handler(ec, &datagram, ec || bytes_transferred > m_buffer_size ? 0 : 1);
+			}
+		);
+	}
+
+	void async_send(SendBuffer buffer, const boost::asio::ip::udp::endpoint& endpoint) override {
+#ifdef __linux__
+		Outgoing outgoing;
+		outgoing.segments.push_back(std::move(buffer));
+		outgoing.endpoint = endpoint;
+		queue_send(std::move(outgoing));
+#else
+		const boost::asio::const_buffer data = buffer.buffer();
+		m_socket.async_send_to(data, endpoint, [buffer = std::move(buffer)](boost::system::error_code, size_t) {});
+#endif
+	}
+
+	void async_send_many(std::vector<SendBuffer> payloads, std::vector<boost::asio::ip::udp::endpoint> endpoints,
+	                     const send_handler_type& handler) override {
+		auto operation = std::make_shared<SendManyOperation>();
+		operation->payloads = std::move(payloads);
+		operation->endpoints = std::move(endpoints);
+		operation->next = 0;
+		operation->handler = handler;
+#ifdef __linux__
+		Outgoing outgoing;
+		outgoing.operation = std::move(operation);
+		queue_send(std::move(outgoing));
+#else
+		continue_send_many(operation);
+#endif
+	}
+
+#ifdef __linux__
+	void async_send_segments(std::vector<SendBuffer> datagrams, const boost::asio::ip::udp::endpoint& endpoint) override {
+		check_offload();
+		size_t first = 0;
+		while (first < datagrams.size()) {
+			const size_t count = m_gso ? detail::segment_run(datagrams, first) : 1;
+			Outgoing outgoing;
+			for (size_t i = first; i < first + count; ++i) {
+				outgoing.segments.push_back(std::move(datagrams[i]));
+			}
+			outgoing.endpoint = endpoint;
+			queue_send(std::move(outgoing));
+			first += count;
+		}
+	}
+#endif
+
+private:
+	struct SendManyOperation {
+		std::vector<SendBuffer> payloads; // one per endpoint, or a single one shared by all
+		std::vector<boost::asio::ip::udp::endpoint> endpoints;
+		size_t next;
+		std::vector<SendError> errors;
+		send_handler_type handler;
+	};
+
+#ifdef __linux__
+	// Entry of the send queue.
+	struct Outgoing {
+		std::vector<SendBuffer> segments; // a datagram, or a run sent as one UDP_SEGMENT send
+		boost::asio::ip::udp::endpoint endpoint;
+		std::shared_ptr<SendManyOperation> operation; // instead of the above
+	};
+
+	void init_receive_ring(size_t slot_size) {
+		m_slot_size = slot_size;
+		m_recv_buf.assign(m_batch_size * m_slot_size, 0);
+		m_recv_control.assign(m_batch_size * detail::GRO_CONTROL_SIZE, 0);
+		m_recv_msgs.resize(m_batch_size);
+		m_recv_iovecs.resize(m_batch_size);
+		m_recv_addrs.resize(m_batch_size);
+		for (size_t i = 0; i < m_batch_size; ++i) {
+			m_recv_iovecs[i].iov_base = m_recv_buf.data() + i * m_slot_size;
+			m_recv_iovecs[i].iov_len = m_slot_size;
+			m_recv_msgs[i].msg_hdr = msghdr();
+			m_recv_msgs[i].msg_hdr.msg_name = &m_recv_addrs[i];
+			m_recv_msgs[i].msg_hdr.msg_iov = &m_recv_iovecs[i];
+			m_recv_msgs[i].msg_hdr.msg_iovlen = 1;
+		}
+	}
+
+	// Done once the socket is open: a client socket only is once connected.
+	void check_offload() {
+		if (m_offload_checked || !m_socket.is_open()) {
+			return;
+		}
+		m_offload_checked = true;
+
+		int value = 0;
+		socklen_t size = sizeof(value);
+		m_gso = ::getsockopt(m_socket.native_handle(), IPPROTO_UDP, UDP_SEGMENT, &value, &size) == 0;
+	}
+
+	void enable_socket_gro() {
+		if (!m_socket.is_open()) {
+			return;
+		}
+		m_gro_requested = false; // tried once
+		const int enabled = 1;
+		if (::setsockopt(m_socket.native_handle(), IPPROTO_UDP, UDP_GRO, &enabled, sizeof(enabled)) == 0) {
+			m_gro = true;
+			init_receive_ring(std::max(m_buffer_size, GRO_BUFFER_SIZE));
+		}
+	}
+
+	void queue_send(Outgoing outgoing) {
+		m_send_queue.push_back(std::move(outgoing));
+		if (!m_sending) {
+			flush_sends();
+		}
+	}
+
+	// Sends the queue in order, until it is empty or the socket buffer is full.
+	void flush_sends() {
+		m_sending = true;
+		while (!m_send_queue.empty()) {
+			Outgoing& front = m_send_queue.front();
+			const int error = front.operation ? send_many_now(*front.operation) : send_now(front);
+			if (error == EAGAIN || error == EWOULDBLOCK) {
+				m_socket.async_wait(boost::asio::ip::udp::socket::wait_write, [this](auto ec) {
+					if (ec) {
+						this->fail_sends(ec);
+					} else {
+						this->flush_sends();
+					}
+				});
+				return;
+			}
+			if (error != 0 && front.segments.size() > 1 && (detail::is_gso_unsupported(error) || error == EINVAL)) {
+				m_gso = m_gso && !detail::is_gso_unsupported(error);
+				split_front(); // sent again one by one
+				continue;
+			}
+
+			const std::shared_ptr<SendManyOperation> operation = std::move(front.operation);
+			m_send_queue.pop_front(); // other errors are ignored, as with asio
+			if (operation) {
+				complete_send_many(operation); // may queue more sends, sent by this loop
+			}
+		}
+		m_sending = false;
+	}
+
+	// Returns 0 or the errno of the failed send.
+	int send_now(Outgoing& outgoing) noexcept {
+		iovec iovs[GSO_MAX_SEGMENTS];
+		const size_t count = outgoing.segments.size();
+		for (size_t i = 0; i < count; ++i) {
+			iovs[i].iov_base = outgoing.segments[i].data();
+			iovs[i].iov_len = outgoing.segments[i].size();
+		}
+		alignas(cmsghdr) uint8_t control[detail::GSO_CONTROL_SIZE];
+		msghdr msg = msghdr();
+		msg.msg_name = outgoing.endpoint.data();
+		msg.msg_namelen = static_cast<socklen_t>(outgoing.endpoint.size());
+		msg.msg_iov = iovs;
+		msg.msg_iovlen = count;
+		if (count > 1) {
+			detail::set_segment_size(msg, control, outgoing.segments[0].size());
+		}
+
+		ssize_t sent;
+		do {
+			sent = ::sendmsg(m_socket.native_handle(), &msg, MSG_DONTWAIT);
+		} while (sent < 0 && errno == EINTR);
+		return sent < 0 ? errno : 0;
+	}
+
+	void split_front() {
+		Outgoing run = std::move(m_send_queue.front());
+		m_send_queue.pop_front();
+		for (size_t i = run.segments.size(); i-- > 0; ) {
+			Outgoing single;
+			single.segments.push_back(std::move(run.segments[i]));
+			single.endpoint = run.endpoint;
+			m_send_queue.push_front(std::move(single));
+		}
+	}
+
+	// The socket was closed or cancelled: nothing queued will be sent.
+	void fail_sends(const boost::system::error_code& error_code) {
+		std::deque<Outgoing> failed;
+		failed.swap(m_send_queue);
+		m_sending = false;
+		for (auto& outgoing : failed) {
+			if (outgoing.operation) {
+				SendManyOperation& operation = *outgoing.operation;
+				for (; operation.next < operation.endpoints.size(); ++operation.next) {
+					operation.errors.push_back({ operation.endpoints[operation.next], error_code });
+				}
+				complete_send_many(outgoing.operation);
+			}
+		}
+	}
+
+	void handle_receive_batch(const boost::system::error_code& error_code, const receive_handler_type& handler) {
+		if (error_code) {
+			handler(error_code, nullptr, 0);
+			return;
+		}
+
+		int count;
+		do {
+			for (size_t i = 0; i < m_batch_size; ++i) {
+				msghdr& header = m_recv_msgs[i].msg_hdr;
+				header.msg_namelen = sizeof(sockaddr_storage); // overwritten by the kernel
+				header.msg_control = m_gro ? &m_recv_control[i * detail::GRO_CONTROL_SIZE] : nullptr;
+				header.msg_controllen = m_gro ? detail::GRO_CONTROL_SIZE : 0;
+			}
+			count = ::recvmmsg(m_socket.native_handle(), m_recv_msgs.data(), static_cast<unsigned int>(m_batch_size),
+			                   MSG_DONTWAIT, nullptr);
+		} while (count < 0 && errno == EINTR);
+
+		if (count < 0 && errno != EAGAIN && errno != EWOULDBLOCK) {
+			handler(boost::system::error_code(errno, boost::asio::error::get_system_category()), nullptr, 0);
+			return;
+		}
+
+		// Nothing to read after all (EAGAIN) yields an empty batch, the next receive waits for readiness again.
+		m_datagrams.clear();
+		for (int i = 0; i < count; ++i) {
+			const msghdr& header = m_recv_msgs[i].msg_hdr;
+			if (header.msg_flags & MSG_TRUNC) { // larger than the receive buffer
+				continue;
+			}
+
+			boost::asio::ip::udp::endpoint endpoint;
+			std::memcpy(endpoint.data(), &m_recv_addrs[i], header.msg_namelen);
+			endpoint.resize(header.msg_namelen);
+
+			const uint8_t* data = m_recv_buf.data() + i * m_slot_size;
+			const size_t size = m_recv_msgs[i].msg_len;
+			const size_t segment_size = gro_segment_size(header);
+			for (size_t offset = 0; offset < size; offset += segment_size) {
+				const size_t datagram_size = std::min(segment_size, size - offset);
+				if (datagram_size <= m_buffer_size) { // larger ones would have been truncated without GRO
+					m_datagrams.push_back({ data + offset, datagram_size, endpoint });
+				}
+			}
+			if (size == 0) {
+				m_datagrams.push_back({ data, 0, endpoint });
+			}
+		}
+		handler(error_code, m_datagrams.data(), m_datagrams.size());
+	}
+
+	// Size of the datagrams coalesced into the received buffer, the whole buffer if it is a single one.
+	size_t gro_segment_size(const msghdr& header) const noexcept {
+		for (const cmsghdr* control = CMSG_FIRSTHDR(&header); control;
+		     control = CMSG_NXTHDR(const_cast<msghdr*>(&header), const_cast<cmsghdr*>(control))) {
+			if (control->cmsg_level == IPPROTO_UDP && control->cmsg_type == UDP_GRO) {
+				int size;
+				std::memcpy(&size, CMSG_DATA(control), sizeof(size));
+				if (size > 0) {
+					return static_cast<size_t>(size);
+				}
+			}
+		}
+		return m_slot_size;
+	}
+#endif
+
+#ifdef __linux__
+	// Sends the rest of the operation in sendmmsg batches. Returns EAGAIN if the socket buffer filled up first,
+	// 0 once every datagram was sent or failed.
+	int send_many_now(SendManyOperation& operation) {
+		iovec iovs[SEND_BATCH_SIZE];
+		mmsghdr msgs[SEND_BATCH_SIZE];
+		while (operation.next < operation.endpoints.size()) {
+			const size_t count = std::min(SEND_BATCH_SIZE, operation.endpoints.size() - operation.next);
+			for (size_t i = 0; i < count; ++i) {
+				auto& endpoint = operation.endpoints[operation.next + i];
+				auto& payload = operation.payloads.size() == 1 ? operation.payloads[0]
+				                                               : operation.payloads[operation.next + i];
+				iovs[i].iov_base = payload.data();
+				iovs[i].iov_len = payload.size();
+				msgs[i].msg_hdr = msghdr();
+				msgs[i].msg_hdr.msg_name = endpoint.data();
+				msgs[i].msg_hdr.msg_namelen = static_cast<socklen_t>(endpoint.size());
+				msgs[i].msg_hdr.msg_iov = &iovs[i];
+				msgs[i].msg_hdr.msg_iovlen = 1;
+			}
+
+			const int sent = ::sendmmsg(m_socket.native_handle(), msgs, static_cast<unsigned int>(count), MSG_DONTWAIT);
+			if (sent >= 0) {
+				operation.next += sent;
+			} else if (errno == EAGAIN || errno == EWOULDBLOCK) {
+				return errno;
+			} else if (errno != EINTR) { // sendmmsg only fails on the first datagram of the batch
+				operation.errors.push_back({ operation.endpoints[operation.next],
+				                             boost::system::error_code(errno, boost::asio::error::get_system_category()) });
+				++operation.next;
+			}
+		}
+		return 0;
+	}
+#else
+	// One async_send_to per endpoint.
+	void continue_send_many(const std::shared_ptr<SendManyOperation>& operation) {
+		auto remaining = std::make_shared<size_t>(operation->endpoints.size());
+		if (*remaining == 0) {
+			complete_send_many(operation);
+			return;
+		}
+		for (size_t i = 0; i < operation->endpoints.size(); ++i) {
+			const auto& endpoint = operation->endpoints[i];
+			const auto& payload = operation->payloads.size() == 1 ? operation->payloads[0] : operation->payloads[i];
+			m_socket.async_send_to(payload.buffer(), endpoint,
+			                       [operation, remaining, endpoint](boost::system::error_code ec, size_t) {
+				if (ec) {
+					operation->errors.push_back({ endpoint, ec });
+				}
+				if (--*remaining == 0) {
+					complete_send_many(operation);
+				}
+			});
+		}
+	}
+#endif
+
+	static void complete_send_many(const std::shared_ptr<SendManyOperation>& operation) {
+		if (operation->handler) {
+			operation->handler(std::move(operation->errors));
+		}
+	}
+
+	boost::asio::ip::udp::socket& m_socket;
+	size_t m_buffer_size;
+	size_t m_batch_size;
+	size_t m_slot_size; // of each receive buffer: m_buffer_size, or GRO_BUFFER_SIZE with GRO
+	boost::asio::ip::udp::endpoint m_remote_endpoint;
+	std::vector<uint8_t> m_recv_buf; // m_batch_size buffers of m_slot_size bytes
+#ifdef __linux__
+	std::vector<mmsghdr> m_recv_msgs;
+	std::vector<iovec> m_recv_iovecs;
+	std::vector<sockaddr_storage> m_recv_addrs;
+	std::vector<uint8_t> m_recv_control; // one GRO control message per receive buffer
+	std::vector<Datagram> m_datagrams;
+	bool m_offload_checked;
+	bool m_gso;
+	bool m_gro_requested;
+	bool m_gro;
+	std::deque<Outgoing> m_send_queue; // datagrams and sendmmsg operations, in order
+	bool m_sending; // m_send_queue is being sent, or waits for the socket to be writable
+#endif
+};
+
+}
+
+#endif //RELIABLEUDP_TRANSPORT_HPP
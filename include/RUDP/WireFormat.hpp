@@ -0,0 +1,240 @@
+///////////////////////////////////////////////////////////////////////////////////////////////////
+//                                                                                               //
+// Copyright 2017 Benoît CORTIER                                                                 //
+//                                                                                               //
+// This file is part of RUDP project which is released under the                                 //
+// European Union Public License v1.1. If a copy of the EUPL was                                 //
+// not distributed with this software, you can obtain one at :                                   //
+// https://joinup.ec.europa.eu/community/eupl/og_page/european-union-public-licence-eupl-v11     //
+//                                                                                               //
+///////////////////////////////////////////////////////////////////////////////////////////////////
+
+#ifndef RELIABLEUDP_WIREFORMAT_HPP
+#define RELIABLEUDP_WIREFORMAT_HPP
+
+#include <cstddef> // size_t
+#include <cstdint> // uint8_t, uint16_t, uint32_t
+#include <cstring> // std::memmove, std::memcpy
+#include <stdexcept>
+#include <tuple>
+#include <type_traits>
+#include <utility> // std::index_sequence
+
+#include <boost/uuid/uuid.hpp>
+
+#include "protocols.hpp"
+
+namespace rudp {
+
+struct bad_header_exception : std::runtime_error {
+	bad_header_exception() : std::runtime_error("Bad header") {}
+};
+
+struct bad_protocol_exception : std::runtime_error {
+	bad_protocol_exception() : std::runtime_error("Bad protocol") {}
+};
+
+namespace wire {
+	// Flags byte.
+	const uint8_t COMPACT_FLAG = 0x01; // the sender is identified by a connection ID instead of its UUID
+	const uint8_t CONTROL_FLAG = 0x02; // library message (connection, keep alive...), not for the user
+	const uint8_t COALESCED_FLAG = 0x04; // the payload is a sequence of messages, each prefixed by its 16-bit length
+	const uint8_t FRAGMENT_FLAG = 0x08; // the payload is a rudp::FragmentHeader and a part of a larger message
+	const uint8_t PARITY_FLAG = 0x10; // the payload is the XOR parity of the previous datagrams, see rudp::FecEncoder
+
+	template <typename T>
+	inline void write_le(uint8_t* out, T value) noexcept {
+		static_assert(std::is_unsigned<T>::value, "Wire fields shall be unsigned integers.");
+		for (size_t i = 0; i < sizeof(T); ++i) {
+			out[i] = static_cast<uint8_t>(value >> (8 * i));
+		}
+	}
+
+	template <typename T>
+	inline T read_le(const uint8_t* in) noexcept {
+		static_assert(std::is_unsigned<T>::value, "Wire fields shall be unsigned integers.");
+		T value = 0;
+		for (size_t i = 0; i < sizeof(T); ++i) {
+			value |= static_cast<T>(static_cast<T>(in[i]) << (8 * i));
+		}
+		return value;
+	}
+
+	template <typename... Members>
+	struct FieldsSize;
+
+	template <>
+	struct FieldsSize<> {
+		static constexpr size_t value = 0;
+	};
+
+	template <typename Class, typename T, typename... Rest>
+	struct FieldsSize<T Class::*, Rest...> {
+		static constexpr size_t value = sizeof(T) + FieldsSize<Rest...>::value;
+	};
+
+	template <typename... Members>
+	struct FieldsSize<std::tuple<Members...>> : FieldsSize<Members...> {};
+}
+
+// Packed little-endian layout of a Header, independent of the compiler's struct padding:
+//
+//     protocol (16 bits) | flags (8 bits) | HeaderFields<Header>, in order | uuid (128 bits) or connection ID (32 bits)
+//
+// The full form identifies the sender by its UUID and is always understood.
+// Once connected, the socket switches to the compact form: the connection ID the receiver assigned
+// to the sender, which the receiver resolves with an array index.
+template <typename Header>
+class WireFormat {
+	using fields_type = decltype(HeaderFields<Header>::fields());
+
+	static_assert(Header::PROTOCOL_ID <= 0xFFFF, "'PROTOCOL_ID' shall fit in 16 bits.");
+
+public:
+	static constexpr size_t PREFIX_SIZE = sizeof(uint16_t) + sizeof(uint8_t);
+	static constexpr size_t FIELDS_SIZE = wire::FieldsSize<fields_type>::value;
+	static constexpr size_t FULL_SIZE = PREFIX_SIZE + FIELDS_SIZE + sizeof(boost::uuids::uuid);
+	static constexpr size_t COMPACT_SIZE = PREFIX_SIZE + FIELDS_SIZE + sizeof(connection_id_type);
+
+	static uint8_t flags(const uint8_t* data) noexcept { return data[sizeof(uint16_t)]; }
+
+	static void set_flags(uint8_t* data, uint8_t flags) noexcept { data[sizeof(uint16_t)] = flags; }
+
+	static size_t size(uint8_t flags) noexcept { return flags & wire::COMPACT_FLAG ? COMPACT_SIZE : FULL_SIZE; }
+
+	// True if data starts with a complete header of this protocol.
+	static bool fits(const uint8_t* data, size_t size) noexcept {
+		return size >= PREFIX_SIZE && wire::read_le<uint16_t>(data) == Header::PROTOCOL_ID
+		       && size >= WireFormat::size(flags(data));
+	}
+
+	// Full form. Returns the number of bytes written (FULL_SIZE).
+	static size_t write(uint8_t* out, const Header& header, uint8_t flags = 0) noexcept {
+		write_prefix(out, flags & ~wire::COMPACT_FLAG);
+		write_fields(out + PREFIX_SIZE, header);
+		std::memcpy(out + PREFIX_SIZE + FIELDS_SIZE, header.uuid.data, sizeof(boost::uuids::uuid));
+		return FULL_SIZE;
+	}
+
+	// Compact form. Returns the number of bytes written (COMPACT_SIZE).
+	static size_t write_compact(uint8_t* out, const Header& header, connection_id_type id, uint8_t flags = 0) noexcept {
+		write_prefix(out, flags | wire::COMPACT_FLAG);
+		write_fields(out + PREFIX_SIZE, header);
+		wire::write_le(out + PREFIX_SIZE + FIELDS_SIZE, id);
+		return COMPACT_SIZE;
+	}
+
+	// Decodes the header at data, the uuid is left untouched for the compact form.
+	// Returns the size of the header.
+	static size_t read(const uint8_t* data, size_t size, Header& header, uint8_t& flags,
+	                   connection_id_type& id) noexcept(false) {
+		if (size < PREFIX_SIZE) {
+			throw bad_header_exception();
+		}
+		if (wire::read_le<uint16_t>(data) != Header::PROTOCOL_ID) {
+			throw bad_protocol_exception();
+		}
+		flags = WireFormat::flags(data);
+		const size_t header_size = WireFormat::size(flags);
+		if (size < header_size) {
+			throw bad_header_exception();
+		}
+
+		read_fields(data + PREFIX_SIZE, header);
+		if (flags & wire::COMPACT_FLAG) {
+			id = wire::read_le<connection_id_type>(data + PREFIX_SIZE + FIELDS_SIZE);
+		} else {
+			id = NO_CONNECTION_ID;
+			std::memcpy(header.uuid.data, data + PREFIX_SIZE + FIELDS_SIZE, sizeof(boost::uuids::uuid));
+		}
+		return header_size;
+	}
+
+	// Decodes the fields of the header at data, protocol and uuid aside.
+	static Header peek_fields(const uint8_t* data) noexcept {
+		Header header;
+		read_fields(data + PREFIX_SIZE, header);
+		return header;
+	}
+
+	// Decodes the fields of the header at data, lets f modify them and encodes them back in place.
+	template <typename Function>
+	static void rewrite_fields(uint8_t* data, const Function& f) {
+		Header header;
+		read_fields(data + PREFIX_SIZE, header);
+		f(header);
+		write_fields(data + PREFIX_SIZE, header);
+	}
+
+	// Switches the datagram at data to the compact form in place (the payload moves down).
+	// Returns the new datagram size.
+	static size_t compact(uint8_t* data, size_t size, connection_id_type id) noexcept {
+		const uint8_t current_flags = flags(data);
+		if (!(current_flags & wire::COMPACT_FLAG)) {
+			std::memmove(data + COMPACT_SIZE, data + FULL_SIZE, size - FULL_SIZE);
+			size -= FULL_SIZE - COMPACT_SIZE;
+			set_flags(data, current_flags | wire::COMPACT_FLAG);
+		}
+		wire::write_le(data + PREFIX_SIZE + FIELDS_SIZE, id);
+		return size;
+	}
+
+private:
+	static void write_prefix(uint8_t* out, uint8_t flags) noexcept {
+		wire::write_le(out, static_cast<uint16_t>(Header::PROTOCOL_ID));
+		out[sizeof(uint16_t)] = flags;
+	}
+
+	static void write_fields(uint8_t* out, const Header& header) noexcept {
+		write_fields(out, header, HeaderFields<Header>::fields(),
+		             std::make_index_sequence<std::tuple_size<fields_type>::value>());
+	}
+
+	template <size_t... I>
+	static void write_fields(uint8_t* out, const Header& header, const fields_type& fields,
+	                         std::index_sequence<I...>) noexcept {
+		size_t offset = 0;
+		(void) offset;
+		const int expand[] = { 0, (wire::write_le(out + offset, header.*std::get<I>(fields)),
+		                           offset += sizeof(header.*std::get<I>(fields)), 0)... };
+		(void) expand;
+	}
+
+	static void read_fields(const uint8_t* in, Header& header) noexcept {
+		read_fields(in, header, HeaderFields<Header>::fields(),
+		            std::make_index_sequence<std::tuple_size<fields_type>::value>());
+	}
+
+	template <size_t... I>
+	static void read_fields(const uint8_t* in, Header& header, const fields_type& fields,
+	                        std::index_sequence<I...>) noexcept {
+		size_t offset = 0;
+		(void) offset;
+		const int expand[] = { 0, (header.*std::get<I>(fields) =
+		                               wire::read_le<std::decay_t<decltype(header.*std::get<I>(fields))>>(in + offset),
+		                           offset += sizeof(header.*std::get<I>(fields)), 0)... };
+		(void) expand;
+	}
+};
+
+template <typename Header>
+constexpr size_t WireFormat<Header>::PREFIX_SIZE;
+
+template <typename Header>
+constexpr size_t WireFormat<Header>::FIELDS_SIZE;
+
+template <typename Header>
+constexpr size_t WireFormat<Header>::FULL_SIZE;
+
+template <typename Header>
+constexpr size_t WireFormat<Header>::COMPACT_SIZE;
+
+// Size of the header written by rudp::build_buffer.
+template <typename Header>
+constexpr size_t header_size() noexcept {
+	return WireFormat<Header>::FULL_SIZE;
+}
+
+}
+
+#endif //RELIABLEUDP_WIREFORMAT_HPP
@@ -0,0 +1,192 @@
+///////////////////////////////////////////////////////////////////////////////////////////////////
+//                                                                                               //
+// Copyright 2017 Benoît CORTIER                                                                 //
+//                                                                                               //
+// This file is part of RUDP project which is released under the                                 //
+// European Union Public License v1.1. If a copy of the EUPL was                                 //
+// not distributed with this software, you can obtain one at :                                   //
+// https://joinup.ec.europa.eu/community/eupl/og_page/european-union-public-licence-eupl-v11     //
+//                                                                                               //
+///////////////////////////////////////////////////////////////////////////////////////////////////
+
+#include <algorithm>
+#include <cerrno>
+#include <stdexcept>
+
+#include <boost/uuid/uuid_generators.hpp>
+
+#ifdef __linux__
+#include <sys/socket.h> // SO_REUSEPORT
+#endif
+
+#include "RUDP/ShardedSocket.hpp"
+
+template <typename Header, typename Metrics>
+thread_local typename rudp::ShardedSocket<Header, Metrics>::Shard* rudp::ShardedSocket<Header, Metrics>::t_current_shard = nullptr;
+
+template <typename Header, typename Metrics>
+rudp::ShardedSocket<Header, Metrics>::ShardedSocket(size_t shard_count, size_t buffer_size, size_t batch_size,
+                                                    const boost::asio::ip::udp::endpoint& endpoint)
+			: m_running(false)
+{
+#ifndef __linux__
+	shard_count = 1;
+#endif
+	shard_count = std::max<size_t>(shard_count, 1);
+
+	const boost::uuids::uuid uuid = boost::uuids::random_generator{}();
+	boost::asio::ip::udp::endpoint bound = endpoint;
+	m_shards.reserve(shard_count);
+	for (size_t i = 0; i < shard_count; ++i) {
+		std::unique_ptr<Shard> shard(new Shard());
+		shard->owner = this;
+
+		boost::asio::ip::udp::socket socket = open_shard(shard->io_service, bound);
+		bound = socket.local_endpoint(); // with port 0, the next shards join the port picked for the first one
+		shard->socket.reset(new rudp::Socket<Header, Metrics>(shard->io_service, std::move(socket), buffer_size, batch_size, uuid));
+		m_shards.push_back(std::move(shard));
+	}
+}
+
+template <typename Header, typename Metrics>
+void rudp::ShardedSocket<Header, Metrics>::set_receive_handler(const receive_handler_type& handler) {
+	for (auto& shard : m_shards) {
+		shard->socket->set_receive_handler(handler);
+	}
+}
+
+template <typename Header, typename Metrics>
+void rudp::ShardedSocket<Header, Metrics>::set_connection_handler(const connection_handler_type& handler) {
+	for (auto& shard : m_shards) {
+		shard->socket->set_connection_handler(handler);
+	}
+}
+
+template <typename Header, typename Metrics>
+void rudp::ShardedSocket<Header, Metrics>::set_disconnection_handler(const disconnection_handler_type& handler) {
+	for (auto& shard : m_shards) {
+		shard->socket->set_disconnection_handler(handler);
+	}
+}
+
+template <typename Header, typename Metrics>
+void rudp::ShardedSocket<Header, Metrics>::set_disconnection_timeout_handler(const disconnection_timeout_handler_type& handler) {
+	for (auto& shard : m_shards) {
+		shard->socket->set_disconnection_timeout_handler(handler);
+	}
+}
+
+template <typename Header, typename Metrics>
+void rudp::ShardedSocket<Header, Metrics>::start() {
+	if (m_running) {
+		return;
+	}
+
+	m_running = true;
+	for (auto& shard : m_shards) {
+		Shard* current = shard.get();
+		shard->thread = std::thread([current]() {
+			t_current_shard = current;
+			current->io_service.run();
+			t_current_shard = nullptr;
+		});
+	}
+}
+
+template <typename Header, typename Metrics>
+void rudp::ShardedSocket<Header, Metrics>::stop() {
+	if (!m_running) {
+		return;
+	}
+
+	for (auto& shard : m_shards) {
+		Shard* current = shard.get();
+		shard->io_service.post([current]() {
+			current->socket->close();
+			current->io_service.stop();
+		});
+	}
+	for (auto& shard : m_shards) {
+		shard->thread.join();
+	}
+	m_running = false;
+}
+
+template <typename Header, typename Metrics>
+rudp::Socket<Header, Metrics>* rudp::ShardedSocket<Header, Metrics>::current_shard() noexcept {
+	return t_current_shard && t_current_shard->owner == this ? t_current_shard->socket.get() : nullptr;
+}
+
+template <typename Header, typename Metrics>
+rudp::MetricsSnapshot rudp::ShardedSocket<Header, Metrics>::metrics() const noexcept {
+	rudp::MetricsSnapshot sum;
+	for (const auto& shard : m_shards) {
+		sum += shard->socket->metrics().snapshot();
+	}
+	return sum;
+}
+
+template <typename Header, typename Metrics>
+rudp::SendBuffer rudp::ShardedSocket<Header, Metrics>::acquire_send_buffer(size_t size) {
+	rudp::Socket<Header, Metrics>* socket = current_shard();
+	return (socket ? *socket : *m_shards[0]->socket).acquire_send_buffer(size);
+}
+
+template <typename Header, typename Metrics>
+void rudp::ShardedSocket<Header, Metrics>::async_send_to(rudp::SendBuffer buffer, const rudp::Peer& peer) {
+	rudp::Socket<Header, Metrics>* socket = current_shard();
+	if (!socket) {
+		throw std::logic_error("Peers can only be sent to from their shard's thread");
+	}
+	socket->async_send_to(std::move(buffer), peer);
+}
+
+template <typename Header, typename Metrics>
+void rudp::ShardedSocket<Header, Metrics>::async_send_to_all(rudp::SendBuffer buffer) {
+	for (auto& shard : m_shards) {
+		if (shard.get() == t_current_shard) {
+			continue;
+		}
+
+		shard->broadcasts.push(buffer);
+		// One drain in flight per shard at most: pushes made before it runs are sent by it.
+		if (!shard->drain_posted.exchange(true, std::memory_order_acq_rel)) {
+			Shard* target = shard.get();
+			shard->io_service.post([this, target]() {
+				this->drain_broadcasts(*target);
+			});
+		}
+	}
+
+	rudp::Socket<Header, Metrics>* socket = current_shard();
+	if (socket) {
+		socket->async_send_to_all(std::move(buffer));
+	}
+}
+
+template <typename Header, typename Metrics>
+boost::asio::ip::udp::socket rudp::ShardedSocket<Header, Metrics>::open_shard(boost::asio::io_service& io_service,
+                                                                              const boost::asio::ip::udp::endpoint& endpoint) {
+	boost::asio::ip::udp::socket socket(io_service);
+	socket.open(endpoint.protocol());
+#ifdef __linux__
+	const int enabled = 1;
+	if (::setsockopt(socket.native_handle(), SOL_SOCKET, SO_REUSEPORT, &enabled, sizeof(enabled)) != 0) {
+		throw boost::system::system_error(boost::system::error_code(errno, boost::asio::error::get_system_category()),
+		                                  "SO_REUSEPORT");
+	}
+#endif
+	socket.bind(endpoint);
+	return socket;
+}
+
+template <typename Header, typename Metrics>
+void rudp::ShardedSocket<Header, Metrics>::drain_broadcasts(Shard& shard) {
+	// Reset first: a broadcast pushed from now on posts a new drain if this one misses it.
+	shard.drain_posted.exchange(false, std::memory_order_acq_rel);
+
+	rudp::SendBuffer buffer;
+	while (shard.broadcasts.try_pop(buffer)) {
+		shard.socket->async_send_to_all(std::move(buffer));
+	}
+}
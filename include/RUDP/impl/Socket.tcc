@@ -10,7 +10,11 @@
 ///////////////////////////////////////////////////////////////////////////////////////////////////
 
 #include <algorithm>
+#include <cerrno>
 #include <chrono>
+#include <cstring>
+#include <limits>
+#include <stdexcept>
 
 #include <boost/uuid/uuid_io.hpp>
 #include <boost/log/core.hpp>
@@ -48,176 +52,913 @@ namespace {
 	const lib_message_type KEEP_ALIVE_MESSAGE = 424967295;
 	const lib_message_type CONNECTION_MESSAGE = 424967296;
 	const lib_message_type DISCONNECTION_MESSAGE = 424967297;
+	const lib_message_type ACK_MESSAGE = 424967298;
+	const lib_message_type CHALLENGE_MESSAGE = 424967299;
 
-	template <typename Header>
-	struct LibMessage {
-		Header header;
-		lib_message_type message;
-	};
+	const char BAD_PROTOCOL_REPLY[] = "Bad protocol";
 
-	template <typename Header>
-	inline LibMessage<Header> build_lib_message(boost::uuids::uuid self_uuid, const lib_message_type type) {
-		LibMessage<Header> lib_message;
-		lib_message.header = Header(self_uuid);
-		lib_message.message = type;
-		return lib_message;
-	}
+	// Round trip time estimator of a protocol state, nullptr for protocols that do not measure it.
+	template <typename State>
+	auto rtt_estimator(const State& state, int) -> decltype(&state.rtt()) { return &state.rtt(); }
+
+	template <typename State>
+	const rudp::RttEstimator* rtt_estimator(const State& /*state*/, long) { return nullptr; }
 }
 
-template <typename Header>
-rudp::Socket<Header>::Socket(boost::asio::io_service& io_service, size_t buffer_size,
-                             const boost::asio::ip::udp::endpoint& endpoint)
-			: m_connection_timeout(DEFAULT_CONNECTION_TIMEOUT)
-			, m_listening(true)
-			, m_io_service(io_service)
-			, m_socket(io_service, endpoint)
-			, m_timer(io_service)
-			, m_self(endpoint)
-			, m_recv_buf(buffer_size)
+template <typename Header, typename Metrics>
+rudp::Socket<Header, Metrics>::Socket(boost::asio::io_service& io_service, size_t buffer_size,
+                                      const boost::asio::ip::udp::endpoint& endpoint)
+			: Socket(io_service, buffer_size, DEFAULT_RECEIVE_BATCH_SIZE, endpoint)
+{}
+
+template <typename Header, typename Metrics>
+rudp::Socket<Header, Metrics>::Socket(boost::asio::io_service& io_service, size_t buffer_size)
+			: Socket(io_service, buffer_size, DEFAULT_RECEIVE_BATCH_SIZE)
+{}
+
+template <typename Header, typename Metrics>
+rudp::Socket<Header, Metrics>::Socket(boost::asio::io_service& io_service, size_t buffer_size, size_t batch_size,
+                                      const boost::asio::ip::udp::endpoint& endpoint)
+			: Socket(io_service, boost::asio::ip::udp::socket(io_service, endpoint), buffer_size, batch_size,
+			         rudp::Peer(endpoint), true)
 {
-	is_valid_specialization<Header>();
 	start_keep_alive();
 	start_receive();
 }
 
-template <typename Header>
-rudp::Socket<Header>::Socket(boost::asio::io_service& io_service, size_t buffer_size)
+template <typename Header, typename Metrics>
+rudp::Socket<Header, Metrics>::Socket(boost::asio::io_service& io_service, size_t buffer_size, size_t batch_size)
+			: Socket(io_service, boost::asio::ip::udp::socket(io_service), buffer_size, batch_size,
+			         rudp::Peer(boost::asio::ip::udp::endpoint(boost::asio::ip::address_v4::loopback(), 0)), false)
+{}
+
+template <typename Header, typename Metrics>
+rudp::Socket<Header, Metrics>::Socket(boost::asio::io_service& io_service, boost::asio::ip::udp::socket socket,
+                                      size_t buffer_size, size_t batch_size, const boost::uuids::uuid& uuid)
+			: Socket(io_service, std::move(socket), buffer_size, batch_size, rudp::Peer(socket.local_endpoint(), uuid),
+			         true)
+{
+	start_keep_alive();
+	start_receive();
+}
+
+template <typename Header, typename Metrics>
+rudp::Socket<Header, Metrics>::Socket(boost::asio::io_service& io_service, boost::asio::ip::udp::socket&& socket,
+                                      size_t buffer_size, size_t batch_size, const rudp::Peer& self, bool listening)
 			: m_connection_timeout(DEFAULT_CONNECTION_TIMEOUT)
-            , m_listening(false)
+			, m_listening(listening)
 			, m_io_service(io_service)
-			, m_socket(io_service)
-			, m_timer(io_service)
-			, m_self(boost::asio::ip::udp::endpoint(boost::asio::ip::address_v4::loopback(), 0))
-			, m_recv_buf(buffer_size)
-{ is_valid_specialization<Header>(); }
+			, m_socket(std::move(socket))
+			, m_asio_transport(m_socket, buffer_size, batch_size)
+			, m_transport(&m_asio_transport)
+			, m_receive_generation(0)
+			, m_flush_timer(io_service)
+			, m_now(clock_type::now())
+			, m_timers(std::chrono::milliseconds(PROTOCOL_TICK), m_now)
+			, m_timers_timer(io_service)
+			, m_timers_wakeup(clock_type::time_point::max())
+			, m_self(self)
+			, m_buffer_size(buffer_size)
+			, m_coalescing(false)
+			, m_max_datagram_size(DEFAULT_MTU)
+			, m_flush_delay(DEFAULT_COALESCING_DELAY)
+			, m_flush_timer_armed(false)
+			, m_max_message_size(DEFAULT_MAX_MESSAGE_SIZE)
+			, m_next_message_id(0)
+			, m_reassembly_budget(DEFAULT_REASSEMBLY_MEMORY_LIMIT)
+			, m_challenge_limiter(DEFAULT_CHALLENGE_RATE, DEFAULT_CHALLENGE_RATE)
+			, m_bad_protocol_limiter(DEFAULT_BAD_PROTOCOL_REPLY_RATE, DEFAULT_BAD_PROTOCOL_REPLY_RATE)
+{
+	is_valid_specialization<Header>();
+}
 
-template <typename Header>
-void rudp::Socket<Header>::close() noexcept {
-	LibMessage<Header> lib_message = build_lib_message<Header>(m_self.uuid, DISCONNECTION_MESSAGE);
-	async_send_to_all(reinterpret_cast<void*>(&lib_message), sizeof(lib_message));
+template <typename Header, typename Metrics>
+void rudp::Socket<Header, Metrics>::close() noexcept {
+	send_lib_message_to_all(DISCONNECTION_MESSAGE);
 
 	m_listening = false;
+	m_pending_connects.clear();
 }
 
-template <typename Header>
-void rudp::Socket<Header>::connect(boost::asio::ip::udp::endpoint& remote_endpoint) {
+template <typename Header, typename Metrics>
+void rudp::Socket<Header, Metrics>::connect(boost::asio::ip::udp::endpoint& remote_endpoint) {
 	m_socket.open(remote_endpoint.protocol());
 
-	LibMessage<Header> lib_message = build_lib_message<Header>(m_self.uuid, CONNECTION_MESSAGE);
-	async_send_to(reinterpret_cast<void*>(&lib_message), sizeof(lib_message), remote_endpoint);
-
 	m_listening = true;
+	m_now = clock_type::now();
+
+	if (m_peers.find(remote_endpoint)) {
+		send_lib_message(CONNECTION_MESSAGE, remote_endpoint);
+	} else {
+		m_pending_connects.emplace_back(remote_endpoint, m_now);
+		send_handshake(CONNECTION_MESSAGE, remote_endpoint, rudp::HandshakeCookie()); // challenged by the peer
+	}
 
 	start_keep_alive();
 	start_receive();
 }
 
-template <typename Header>
-void rudp::Socket<Header>::handle_async_receive_from(const boost::system::error_code &error_code, size_t bytes_transferred) {
-	if (!error_code) {
-		try {
-			rudp::Packet<Header> packet(m_recv_buf);
-
-			std::vector<Peer>::iterator peer_it = std::find_if(m_peers.begin(), m_peers.end(), [this, &packet](rudp::Peer& peer) -> bool {
-				if (peer.uuid == packet.get_header().uuid) {
-					peer.last_packet_timestamp =
-						std::chrono::duration_cast<std::chrono::seconds>(std::chrono::system_clock::now().time_since_epoch());
-					return true;
-				}
-				return false;
+template <typename Header, typename Metrics>
+bool rudp::Socket<Header, Metrics>::use_io_uring(unsigned int buffer_count) {
+#ifdef __linux__
+	if (m_io_uring_transport) {
+		return true;
+	}
+	try {
+		m_io_uring_transport.reset(new rudp::IoUringTransport(m_io_service, m_socket, m_buffer_size, buffer_count));
+	} catch (const std::system_error&) {
+		return false;
+	}
+
+	// The pending asio receive handles the datagram it gets, if any, and is not restarted. Cancelling it would
+	// also abort the asio sends still queued.
+	++m_receive_generation;
+	m_transport = m_io_uring_transport.get();
+	if (m_listening) {
+		start_receive();
+	}
+	return true;
+#else
+	(void) buffer_count;
+	return false;
+#endif
+}
+
+template <typename Header, typename Metrics>
+void rudp::Socket<Header, Metrics>::impair(const rudp::Impairment& impairment) {
+	// The receive pending on the wrapped transport stays, later ones are passed through to it.
+	m_impaired_transport.reset(new rudp::ImpairedTransport(m_io_service, *m_transport, impairment));
+	m_transport = m_impaired_transport.get();
+}
+
+template <typename Header, typename Metrics>
+void rudp::Socket<Header, Metrics>::async_send_to(rudp::SendBuffer buffer, const boost::asio::ip::udp::endpoint& endpoint) {
+	const rudp::Peer* peer = m_peers.find(endpoint);
+	if (peer) {
+		async_send_to(std::move(buffer), *peer);
+		return;
+	}
+
+	std::vector<rudp::SendBuffer> datagrams;
+	for_each_fragment(std::move(buffer), 0, [&datagrams](rudp::SendBuffer datagram) {
+		datagrams.push_back(std::move(datagram));
+	});
+	send_datagrams(std::move(datagrams), endpoint);
+}
+
+template <typename Header, typename Metrics>
+void rudp::Socket<Header, Metrics>::async_send_to(rudp::SendBuffer buffer, const rudp::Peer& peer) {
+	m_peer_states[peer.handle.index].metrics.on_send(buffer.size());
+	prepare_send(buffer, peer);
+	const boost::asio::ip::udp::endpoint endpoint = peer.endpoint;
+	const clock_type::time_point now = clock_type::now();
+	rudp::ProtocolState<Header>& state = protocol_state(peer);
+	std::vector<rudp::SendBuffer> datagrams;
+	const size_t reserved = state.datagram_overhead();
+	for_each_fragment(std::move(buffer), reserved, [this, &datagrams, &state, now](rudp::SendBuffer piece) {
+		state.send(std::move(piece), now, m_buffer_pool, [&datagrams](rudp::SendBuffer datagram) {
+			datagrams.push_back(std::move(datagram));
+		});
+	});
+	send_datagrams(std::move(datagrams), endpoint);
+	schedule_protocol_tick(peer);
+}
+
+template <typename Header, typename Metrics>
+void rudp::Socket<Header, Metrics>::async_send_to_many(rudp::SendBuffer buffer,
+                                                       std::vector<boost::asio::ip::udp::endpoint> endpoints,
+                                                       const fan_out_handler_type& handler) {
+	std::vector<rudp::SendBuffer> fragments;
+	for_each_fragment(std::move(buffer), 0, [&fragments](rudp::SendBuffer piece) {
+		fragments.push_back(std::move(piece));
+	});
+	if (fragments.size() == 1) {
+		send_many(std::move(fragments), std::move(endpoints), handler);
+		return;
+	}
+
+	// One payload per endpoint, each fragment being shared by all the endpoints.
+	std::vector<rudp::SendBuffer> payloads;
+	std::vector<boost::asio::ip::udp::endpoint> destinations;
+	payloads.reserve(fragments.size() * endpoints.size());
+	destinations.reserve(fragments.size() * endpoints.size());
+	for (const auto& fragment : fragments) {
+		for (const auto& endpoint : endpoints) {
+			payloads.push_back(fragment);
+			destinations.push_back(endpoint);
+		}
+	}
+	send_many(std::move(payloads), std::move(destinations), handler);
+}
+
+template <typename Header, typename Metrics>
+void rudp::Socket<Header, Metrics>::async_send_to_all(rudp::SendBuffer buffer, const fan_out_handler_type& handler) {
+	if (!rudp::ProtocolState<Header>::SEQUENCED) {
+		std::vector<boost::asio::ip::udp::endpoint> endpoints;
+		endpoints.reserve(m_peers.size());
+		for (const auto& peer : m_peers) {
+			endpoints.push_back(peer.endpoint);
+			m_peer_states[peer.handle.index].metrics.on_send(buffer.size());
+		}
+
+		async_send_to_many(std::move(buffer), std::move(endpoints), handler);
+		return;
+	}
+
+	std::vector<rudp::SendBuffer> copies;
+	std::vector<rudp::PeerHandle> peers;
+	copies.reserve(m_peers.size());
+	peers.reserve(m_peers.size());
+	for (const auto& peer : m_peers) {
+		copies.push_back(m_buffer_pool.acquire(buffer.data(), buffer.size()));
+		peers.push_back(peer.handle);
+	}
+
+	async_send_to_each(std::move(copies), peers, handler);
+}
+
+template <typename Header, typename Metrics>
+void rudp::Socket<Header, Metrics>::async_send_to_each(std::vector<rudp::SendBuffer> payloads,
+                                                       const std::vector<rudp::PeerHandle>& peers,
+                                                       const fan_out_handler_type& handler) {
+	std::vector<rudp::SendBuffer> datagrams;
+	std::vector<boost::asio::ip::udp::endpoint> endpoints;
+	const clock_type::time_point now = clock_type::now();
+	for (size_t i = 0; i < peers.size(); ++i) {
+		const rudp::Peer* peer = m_peers.get(peers[i]);
+		if (!peer) {
+			continue;
+		}
+
+		rudp::SendBuffer payload = std::move(payloads[i]);
+		m_peer_states[peer->handle.index].metrics.on_send(payload.size());
+		prepare_send(payload, *peer);
+		rudp::ProtocolState<Header>& state = protocol_state(*peer);
+		const size_t reserved = state.datagram_overhead();
+		for_each_fragment(std::move(payload), reserved, [this, &datagrams, &endpoints, peer, &state, now](rudp::SendBuffer piece) {
+			state.send(std::move(piece), now, m_buffer_pool, [&datagrams, &endpoints, peer](rudp::SendBuffer datagram) {
+				datagrams.push_back(std::move(datagram));
+				endpoints.push_back(peer->endpoint);
+			});
+		});
+		schedule_protocol_tick(*peer);
+	}
+
+	send_many(std::move(datagrams), std::move(endpoints), handler);
+}
+
+template <typename Header, typename Metrics>
+void rudp::Socket<Header, Metrics>::enable_coalescing(size_t max_datagram_size, std::chrono::microseconds flush_delay) {
+	m_coalescing = true;
+	m_max_datagram_size = max_datagram_size;
+	m_flush_delay = flush_delay;
+}
+
+template <typename Header, typename Metrics>
+void rudp::Socket<Header, Metrics>::async_queue_to(const void* message, size_t message_size, const rudp::Peer& peer,
+                                                   Header header) {
+	using wire_format = rudp::WireFormat<Header>;
+	const size_t prefixed_size = sizeof(uint16_t) + message_size;
+	const size_t datagram_limit = m_max_datagram_size - protocol_state(peer).datagram_overhead();
+	header.uuid = m_self.uuid;
+
+	if (!m_coalescing || wire_format::FULL_SIZE + prefixed_size > datagram_limit
+	    || message_size > std::numeric_limits<uint16_t>::max()) {
+		rudp::SendBuffer buffer = m_buffer_pool.acquire(wire_format::FULL_SIZE + message_size);
+		wire_format::write(buffer.data(), header);
+		std::memcpy(buffer.data() + wire_format::FULL_SIZE, message, message_size);
+		async_send_to(std::move(buffer), peer);
+		return;
+	}
+
+	uint8_t header_bytes[wire_format::FULL_SIZE];
+	wire_format::write(header_bytes, header, rudp::wire::COALESCED_FLAG);
+
+	// A datagram has a single header: messages for another channel or delivery mode start a new one.
+	rudp::SendBuffer& datagram = m_peer_states[peer.handle.index].outgoing;
+	if (datagram && (datagram.size() + prefixed_size > datagram_limit
+	                 || std::memcmp(datagram.data(), header_bytes, wire_format::FULL_SIZE) != 0)) {
+		flush(peer);
+	}
+	if (!datagram) {
+		datagram = m_buffer_pool.acquire(m_max_datagram_size);
+		std::memcpy(datagram.data(), header_bytes, wire_format::FULL_SIZE);
+		datagram.resize(wire_format::FULL_SIZE);
+		bool& flush_queued = m_peer_states[peer.handle.index].flush_queued;
+		if (!flush_queued) { // the datagram replaces one flushed early
+			flush_queued = true;
+			m_outgoing_peers.push_back(peer.handle);
+		}
+		start_flush_timer();
+	}
+
+	uint8_t* end = datagram.data() + datagram.size();
+	rudp::wire::write_le(end, static_cast<uint16_t>(message_size));
+	std::memcpy(end + sizeof(uint16_t), message, message_size);
+	datagram.resize(datagram.size() + prefixed_size);
+}
+
+template <typename Header, typename Metrics>
+void rudp::Socket<Header, Metrics>::flush(const rudp::Peer& peer) {
+	rudp::SendBuffer datagram = std::move(m_peer_states[peer.handle.index].outgoing);
+	if (datagram) {
+		async_send_to(std::move(datagram), peer);
+	}
+}
+
+template <typename Header, typename Metrics>
+void rudp::Socket<Header, Metrics>::flush() {
+	std::vector<rudp::PeerHandle> peers;
+	peers.swap(m_outgoing_peers);
+	for (const rudp::PeerHandle handle : peers) {
+		m_peer_states[handle.index].flush_queued = false;
+		const rudp::Peer* peer = m_peers.get(handle);
+		if (peer) {
+			flush(*peer);
+		}
+	}
+}
+
+template <typename Header, typename Metrics>
+void rudp::Socket<Header, Metrics>::send_many(std::vector<rudp::SendBuffer> payloads,
+                                              std::vector<boost::asio::ip::udp::endpoint> endpoints,
+                                              const fan_out_handler_type& handler) {
+	if (Metrics::ENABLED) {
+		size_t bytes = 0;
+		for (const auto& payload : payloads) {
+			bytes += payload.size();
+		}
+		if (payloads.size() == 1) {
+			m_metrics.on_send(endpoints.size(), bytes * endpoints.size());
+		} else {
+			m_metrics.on_send(payloads.size(), bytes);
+		}
+	}
+
+	rudp::Transport::send_handler_type completion;
+	if (handler) {
+		completion = [this, handler](std::vector<rudp::SendError> errors) {
+			// Never called from within the initiating function.
+			m_io_service.post([handler, errors = std::move(errors)]() {
+				handler(errors);
+			});
+		};
+	}
+	m_transport->async_send_many(std::move(payloads), std::move(endpoints), completion);
+}
+
+template <typename Header, typename Metrics>
+void rudp::Socket<Header, Metrics>::send_datagram(rudp::SendBuffer buffer, const boost::asio::ip::udp::endpoint& endpoint) {
+	m_metrics.on_send(1, buffer.size());
+	m_transport->async_send(std::move(buffer), endpoint);
+}
+
+template <typename Header, typename Metrics>
+void rudp::Socket<Header, Metrics>::send_datagrams(std::vector<rudp::SendBuffer> datagrams,
+                                                   const boost::asio::ip::udp::endpoint& endpoint) {
+	if (datagrams.size() == 1) {
+		send_datagram(std::move(datagrams[0]), endpoint);
+	} else if (!datagrams.empty()) {
+		if (Metrics::ENABLED) {
+			size_t bytes = 0;
+			for (const auto& datagram : datagrams) {
+				bytes += datagram.size();
+			}
+			m_metrics.on_send(datagrams.size(), bytes);
+		}
+		m_transport->async_send_segments(std::move(datagrams), endpoint);
+	}
+}
+
+template <typename Header, typename Metrics>
+rudp::SendBuffer rudp::Socket<Header, Metrics>::build_lib_message_buffer(uint32_t type, const rudp::Peer* peer) {
+	using wire_format = rudp::WireFormat<Header>;
+
+	rudp::SendBuffer buffer = m_buffer_pool.acquire(wire_format::FULL_SIZE + sizeof(lib_message_type) + sizeof(rudp::connection_id_type));
+	Header header(m_self.uuid);
+	size_t size;
+	if (!peer) {
+		size = wire_format::write(buffer.data(), header, rudp::wire::CONTROL_FLAG);
+	} else {
+		protocol_state(*peer).stamp(header);
+		size = peer->remote_connection_id != NO_CONNECTION_ID
+		       ? wire_format::write_compact(buffer.data(), header, peer->remote_connection_id, rudp::wire::CONTROL_FLAG)
+		       : wire_format::write(buffer.data(), header, rudp::wire::CONTROL_FLAG);
+	}
+
+	rudp::wire::write_le<lib_message_type>(buffer.data() + size, type);
+	size += sizeof(lib_message_type);
+	if (peer && peer->connection_id != NO_CONNECTION_ID) { // tells the peer how to identify itself to us
+		rudp::wire::write_le<rudp::connection_id_type>(buffer.data() + size, peer->connection_id);
+		size += sizeof(rudp::connection_id_type);
+	}
+	buffer.resize(size);
+	return buffer;
+}
+
+template <typename Header, typename Metrics>
+void rudp::Socket<Header, Metrics>::prepare_send(rudp::SendBuffer& buffer, const rudp::Peer& peer) {
+	if (!rudp::WireFormat<Header>::fits(buffer.data(), buffer.size())) {
+		return; // not ours to interpret, sent as is
+	}
+
+	const bool compact = peer.remote_connection_id != NO_CONNECTION_ID;
+	if ((compact || rudp::ProtocolState<Header>::SEQUENCED) && !buffer.unique()) {
+		buffer = m_buffer_pool.acquire(buffer.data(), buffer.size());
+	}
+	if (compact) {
+		buffer.resize(rudp::WireFormat<Header>::compact(buffer.data(), buffer.size(), peer.remote_connection_id));
+	}
+}
+
+template <typename Header, typename Metrics>
+template <typename Function>
+void rudp::Socket<Header, Metrics>::for_each_fragment(rudp::SendBuffer buffer, size_t reserved, const Function& f) {
+	using wire_format = rudp::WireFormat<Header>;
+
+	const size_t datagram_limit = std::min(m_buffer_size, m_max_datagram_size) - reserved;
+	if (buffer.size() <= datagram_limit || !wire_format::fits(buffer.data(), buffer.size())) {
+		f(std::move(buffer));
+		return;
+	}
+
+	const size_t header_size = wire_format::size(wire_format::flags(buffer.data()));
+	const size_t total_size = buffer.size() - header_size;
+	if (total_size > m_max_message_size || datagram_limit <= header_size + rudp::FragmentHeader::SIZE) {
+		throw std::length_error("Message too large");
+	}
+	const size_t max_fragment_size = datagram_limit - header_size - rudp::FragmentHeader::SIZE;
+	const size_t count = (total_size + max_fragment_size - 1) / max_fragment_size;
+	if (count > std::numeric_limits<uint16_t>::max()) {
+		throw std::length_error("Message too large");
+	}
+
+	rudp::FragmentHeader fragment;
+	fragment.message_id = m_next_message_id++;
+	fragment.count = static_cast<uint16_t>(count);
+	fragment.total_size = static_cast<uint32_t>(total_size);
+	const size_t fragment_size = fragment.fragment_size();
+	for (size_t i = 0; i < count; ++i) {
+		const size_t offset = i * fragment_size;
+		const size_t size = std::min(fragment_size, total_size - offset);
+
+		rudp::SendBuffer piece = m_buffer_pool.acquire(header_size + rudp::FragmentHeader::SIZE + size);
+		std::memcpy(piece.data(), buffer.data(), header_size);
+		wire_format::set_flags(piece.data(), wire_format::flags(piece.data()) | rudp::wire::FRAGMENT_FLAG);
+		fragment.index = static_cast<uint16_t>(i);
+		fragment.write(piece.data() + header_size);
+		std::memcpy(piece.data() + header_size + rudp::FragmentHeader::SIZE, buffer.data() + header_size + offset, size);
+		f(std::move(piece));
+	}
+}
+
+template <typename Header, typename Metrics>
+void rudp::Socket<Header, Metrics>::reset_peer_state(const rudp::Peer& peer) {
+	PeerState& state = m_peer_states[peer.handle.index];
+	state.protocol.reset();
+	state.outgoing = rudp::SendBuffer();
+	state.flush_queued = false; // a handle of the previous peer may still be listed, and is skipped
+	state.metrics = typename Metrics::peer_metrics_type();
+	state.reassembler.clear(m_reassembly_budget);
+	m_timers.cancel(state.timeout_timer);
+	m_timers.cancel(state.protocol_timer);
+	m_timers.cancel(state.reassembly_timer);
+}
+
+template <typename Header, typename Metrics>
+void rudp::Socket<Header, Metrics>::deliver(const rudp::PacketView<Header>& packet, const rudp::Peer& peer) {
+	if (!m_receive_handler) {
+		return;
+	}
+
+	if (packet.get_flags() & rudp::wire::FRAGMENT_FLAG) {
+		const rudp::ByteSpan datagram = packet.get_datagram();
+		const rudp::ByteSpan header(datagram.data(), datagram.size() - packet.get_message().size());
+		m_peer_states[peer.handle.index].reassembler.template add<Header>(
+			header, packet.get_message(), m_now, m_max_message_size, m_reassembly_budget,
+			[this, &peer](const uint8_t* data, size_t size) {
+				this->deliver(rudp::PacketView<Header>(data, size), peer);
 			});
+		schedule_reassembly_timeout(peer);
+		return;
+	}
+
+	rudp::PacketView<Header> named = packet;
+	if (packet.get_flags() & rudp::wire::COMPACT_FLAG) { // e.g. released from a reorder buffer
+		named.m_header.uuid = peer.uuid;
+	}
+
+	if (!(packet.get_flags() & rudp::wire::COALESCED_FLAG)) {
+		call_receive_handler(named, named.get_datagram().size(), peer);
+		return;
+	}
+
+	// One call per message, as if each had been sent on its own.
+	const rudp::ByteSpan messages = packet.get_message();
+	const size_t header_size = packet.get_datagram().size() - messages.size();
+	named.m_flags &= ~rudp::wire::COALESCED_FLAG;
+	for (size_t offset = 0; offset + sizeof(uint16_t) <= messages.size(); ) {
+		const size_t message_size = rudp::wire::read_le<uint16_t>(messages.data() + offset);
+		offset += sizeof(uint16_t);
+		if (offset + message_size > messages.size()) { // truncated
+			m_metrics.on_drop(rudp::DropReason::TRUNCATED);
+			return;
+		}
+		named.m_message = rudp::ByteSpan(messages.data() + offset, message_size);
+		offset += message_size;
+		call_receive_handler(named, header_size + message_size, peer);
+	}
+}
+
+template <typename Header, typename Metrics>
+void rudp::Socket<Header, Metrics>::call_receive_handler(const rudp::PacketView<Header>& packet, size_t size,
+                                                         const rudp::Peer& peer) {
+	if (!Metrics::ENABLED) {
+		m_receive_handler(packet, size, peer);
+		return;
+	}
+
+	const clock_type::time_point start = clock_type::now();
+	m_receive_handler(packet, size, peer);
+	m_metrics.record_handler_latency(clock_type::now() - start);
+}
 
-			if (peer_it == m_peers.end()) { // peer doesn't exist
+template <typename Header, typename Metrics>
+void rudp::Socket<Header, Metrics>::send_handshake(uint32_t type, const boost::asio::ip::udp::endpoint& endpoint,
+                                                   const rudp::HandshakeCookie& cookie) {
+	using wire_format = rudp::WireFormat<Header>;
+
+	// A connection message is never smaller than the challenge it gets, which cannot amplify a spoofed flood.
+	rudp::SendBuffer buffer = m_buffer_pool.acquire(wire_format::FULL_SIZE + sizeof(lib_message_type)
+	                                                + sizeof(rudp::connection_id_type) + rudp::HandshakeCookie::SIZE);
+	size_t size = wire_format::write(buffer.data(), Header(m_self.uuid), rudp::wire::CONTROL_FLAG);
+	rudp::wire::write_le<lib_message_type>(buffer.data() + size, type);
+	size += sizeof(lib_message_type);
+	if (type == CONNECTION_MESSAGE) { // same layout as a connection message sent to a peer
+		rudp::wire::write_le<rudp::connection_id_type>(buffer.data() + size, rudp::NO_CONNECTION_ID);
+		size += sizeof(rudp::connection_id_type);
+	}
+	cookie.write(buffer.data() + size);
+	buffer.resize(size + rudp::HandshakeCookie::SIZE);
+	send_datagram(std::move(buffer), endpoint);
+}
+
+template <typename Header, typename Metrics>
+void rudp::Socket<Header, Metrics>::send_lib_message(uint32_t type, const boost::asio::ip::udp::endpoint& endpoint) {
+	rudp::Peer* peer = m_peers.find(endpoint);
+	if (peer) {
+		send_lib_message(type, *peer);
+	} else {
+		send_datagram(build_lib_message_buffer(type, nullptr), endpoint);
+	}
+}
+
+template <typename Header, typename Metrics>
+void rudp::Socket<Header, Metrics>::send_lib_message(uint32_t type, rudp::Peer& peer) {
+	send_datagram(build_lib_message_buffer(type, &peer), peer.endpoint);
+}
+
+template <typename Header, typename Metrics>
+void rudp::Socket<Header, Metrics>::send_lib_message_to_all(uint32_t type) {
+	// Each peer gets its own connection ID and acknowledgement fields.
+	std::vector<rudp::SendBuffer> payloads;
+	std::vector<boost::asio::ip::udp::endpoint> endpoints;
+	payloads.reserve(m_peers.size());
+	endpoints.reserve(m_peers.size());
+	for (const auto& peer : m_peers) {
+		payloads.push_back(build_lib_message_buffer(type, &peer));
+		endpoints.push_back(peer.endpoint);
+	}
+
+	send_many(std::move(payloads), std::move(endpoints), fan_out_handler_type());
+}
+
+template <typename Header, typename Metrics>
+rudp::Peer& rudp::Socket<Header, Metrics>::add_peer(const boost::asio::ip::udp::endpoint& endpoint,
+                                                    const boost::uuids::uuid& uuid, clock_type::time_point timestamp) {
+	rudp::Peer& peer = m_peers.emplace(endpoint, uuid, timestamp);
+	if (peer.handle.index >= m_peer_states.size()) {
+		m_peer_states.resize(peer.handle.index + 1);
+	}
+	reset_peer_state(peer);
+	m_metrics.on_connection();
+	m_peer_states[peer.handle.index].timeout_timer =
+		schedule_timer(timestamp + std::chrono::seconds(m_connection_timeout), TimerEvent::PEER_TIMEOUT, peer.handle);
+	return peer;
+}
+
+template <typename Header, typename Metrics>
+void rudp::Socket<Header, Metrics>::handle_receive(const boost::system::error_code& error_code,
+                                                   const rudp::Datagram* datagrams, size_t count, uint32_t generation) {
+	if (!error_code) {
+		m_now = clock_type::now();
+		for (size_t i = 0; i < count; ++i) {
+			handle_datagram(datagrams[i].data, datagrams[i].size, datagrams[i].endpoint);
+		}
+
+		if (m_listening && generation == m_receive_generation) { // else replaced by another transport's loop
+			start_receive();
+		}
+	}
+}
+
+template <typename Header, typename Metrics>
+void rudp::Socket<Header, Metrics>::handle_datagram(const uint8_t* data, size_t bytes_transferred,
+                                                    const boost::asio::ip::udp::endpoint& remote_endpoint) {
+	m_metrics.on_receive(bytes_transferred);
+	try {
+		rudp::PacketView<Header> packet(data, bytes_transferred);
+
+		rudp::Peer* peer;
+		if (packet.get_flags() & rudp::wire::COMPACT_FLAG) {
+			peer = m_peers.find_connection(packet.get_connection_id());
+			if (!peer || peer->endpoint != remote_endpoint) { // stale ID, or not sent by the peer it names
+				m_metrics.on_drop(rudp::DropReason::STALE_CONNECTION_ID);
+				return;
+			}
+			packet.m_header.uuid = peer->uuid;
+			peer->last_packet_timestamp = m_now;
+		} else {
+			peer = m_peers.find(packet.get_header().uuid);
+			if (peer) {
+				peer->last_packet_timestamp = m_now;
+			} else { // peer doesn't exist
+				if (!admit_peer(packet, remote_endpoint)) {
+					m_metrics.on_drop(rudp::DropReason::UNKNOWN_PEER);
+					return;
+				}
 				//BOOST_LOG_TRIVIAL(trace) << "New peer: " << boost::uuids::to_string(packet.get_header().uuid);
 
-				m_peers.emplace_back(m_remote_endpoint,
-				                    packet.get_header().uuid,
-				                    std::chrono::duration_cast<std::chrono::seconds>(std::chrono::system_clock::now().time_since_epoch()));
-				peer_it = m_peers.end() - 1;
+				peer = &add_peer(remote_endpoint, packet.get_header().uuid, m_now);
 
 				if (m_connection_handler) {
-					m_connection_handler(*peer_it);
-
-					LibMessage<Header> lib_message = build_lib_message<Header>(m_self.uuid, CONNECTION_MESSAGE);
-					async_send_to(reinterpret_cast<void*>(&lib_message), sizeof(lib_message), peer_it->endpoint);
+					m_connection_handler(*peer);
 				}
+				// Completes the handshake, and tells the peer the connection ID to use, handler or not.
+				send_lib_message(CONNECTION_MESSAGE, *peer);
 			}
+		}
 
-			bool is_a_user_message = true;
-			if (bytes_transferred - sizeof(Header) == sizeof(lib_message_type)) {
-				const lib_message_type lib_message = *reinterpret_cast<const lib_message_type*>(packet.get_message().data());
-				if (lib_message == CONNECTION_MESSAGE || lib_message == KEEP_ALIVE_MESSAGE) {
-					is_a_user_message = false;
-				} else if (lib_message == DISCONNECTION_MESSAGE) {
-					is_a_user_message = false;
-					if (m_disconnection_handler) {
-						m_disconnection_handler(*peer_it);
-					}
-
-					m_peers.erase(std::remove_if(m_peers.begin(), m_peers.end(), [this, peer_it](const auto& other_peer) -> bool {
-						if (peer_it->uuid == other_peer.uuid)
-							return true;
-						return false;
-					}), m_peers.end());
+		m_peer_states[peer->handle.index].metrics.on_receive(bytes_transferred);
+
+		rudp::ProtocolState<Header>& state = protocol_state(*peer);
+		const rudp::RttEstimator* rtt = Metrics::ENABLED ? rtt_estimator(state, 0) : nullptr;
+		const uint64_t rtt_samples = rtt ? rtt->sample_count() : 0;
+		std::vector<rudp::SendBuffer> released; // held back by the send window until now
+		state.on_receive_header(packet.get_header(), m_now, m_buffer_pool, [&released](rudp::SendBuffer datagram) {
+			released.push_back(std::move(datagram));
+		});
+		if (rtt && rtt->sample_count() != rtt_samples) {
+			m_metrics.record_rtt(rtt->last_sample());
+		}
+		send_datagrams(std::move(released), peer->endpoint);
+		schedule_protocol_tick(*peer);
+
+		if (packet.get_flags() & rudp::wire::CONTROL_FLAG) {
+			const rudp::ByteSpan message = packet.get_message();
+			if (message.size() < sizeof(lib_message_type)) {
+				return;
+			}
+			if (message.size() >= sizeof(lib_message_type) + sizeof(rudp::connection_id_type)) {
+				const rudp::connection_id_type id =
+					rudp::wire::read_le<rudp::connection_id_type>(message.data() + sizeof(lib_message_type));
+				if (id != NO_CONNECTION_ID) { // not from a handshake message
+					peer->remote_connection_id = id;
 				}
 			}
 
-			if (is_a_user_message && m_receive_handler) {
-				m_receive_handler(packet, bytes_transferred, *peer_it);
+			if (rudp::wire::read_le<lib_message_type>(message.data()) == DISCONNECTION_MESSAGE) {
+				m_metrics.on_disconnection();
+				if (m_disconnection_handler) {
+					m_disconnection_handler(*peer);
+				}
+
+				reset_peer_state(*peer);
+				m_peers.erase(peer->handle);
 			}
-		} catch (std::exception& e) {
-			//BOOST_LOG_TRIVIAL(info) << "Received packet with a bad protocol.";
-			m_socket.send_to(boost::asio::buffer("Bad protocol"), m_remote_endpoint);
-			// FIXME: possible network loop...
+			return;
 		}
 
-		if (m_listening) {
-			start_receive();
-		}
+		state.receive(packet, m_now, m_buffer_pool, [this, peer](const rudp::PacketView<Header>& delivered) {
+			this->deliver(delivered, *peer);
+		});
+		schedule_protocol_tick(*peer);
+	} catch (std::exception& e) {
+		//BOOST_LOG_TRIVIAL(info) << "Received packet with a bad protocol.";
+		m_metrics.on_drop(rudp::DropReason::BAD_PROTOCOL);
+		reply_bad_protocol(data, bytes_transferred, remote_endpoint);
 	}
 }
 
-template <typename Header>
-void rudp::Socket<Header>::handle_keep_alive() {
-	//BOOST_LOG_TRIVIAL(trace) << "keep alive";
+template <typename Header, typename Metrics>
+bool rudp::Socket<Header, Metrics>::admit_peer(const rudp::PacketView<Header>& packet,
+                                               const boost::asio::ip::udp::endpoint& endpoint) {
+	const rudp::ByteSpan message = packet.get_message();
+	const lib_message_type type = (packet.get_flags() & rudp::wire::CONTROL_FLAG) && message.size() >= sizeof(lib_message_type)
+	                              ? rudp::wire::read_le<lib_message_type>(message.data()) : 0;
 
-	// check for timeouts
-	std::chrono::seconds now =
-		std::chrono::duration_cast<std::chrono::seconds>(std::chrono::system_clock::now().time_since_epoch());
-	m_peers.erase(std::remove_if(m_peers.begin(), m_peers.end(), [this, &now](const auto& peer) -> bool {
-		if (peer.last_packet_timestamp + std::chrono::seconds(m_connection_timeout) < now) {
-			if (m_disconnection_timeout_handler) {
-				m_disconnection_timeout_handler(peer);
+	auto pending = std::find_if(m_pending_connects.begin(), m_pending_connects.end(), [&endpoint](const auto& connect) {
+		return connect.first == endpoint;
+	});
+	if (pending != m_pending_connects.end()) { // we asked this endpoint first
+		if (type == CHALLENGE_MESSAGE) {
+			if (message.size() >= sizeof(lib_message_type) + rudp::HandshakeCookie::SIZE) {
+				send_handshake(CONNECTION_MESSAGE, endpoint,
+				               rudp::HandshakeCookie::read(message.data() + sizeof(lib_message_type)));
 			}
-			return true;
+			return false;
 		}
+		m_pending_connects.erase(pending);
+		return true;
+	}
+
+	const size_t cookie_offset = sizeof(lib_message_type) + sizeof(rudp::connection_id_type);
+	if (type != CONNECTION_MESSAGE || message.size() < cookie_offset + rudp::HandshakeCookie::SIZE) {
 		return false;
-	}), m_peers.end());
+	}
+	const boost::uuids::uuid& uuid = packet.get_header().uuid;
+	if (m_cookies.check(rudp::HandshakeCookie::read(message.data() + cookie_offset), endpoint, uuid, m_now)) {
+		return true;
+	}
+	if (m_challenge_limiter.try_consume(m_now)) {
+		send_handshake(CHALLENGE_MESSAGE, endpoint, m_cookies.make(endpoint, uuid, m_now));
+	}
+	return false;
+}
 
-	if (m_listening) {
-		// Keep alive.
-		LibMessage<Header> lib_message = build_lib_message<Header>(m_self.uuid, KEEP_ALIVE_MESSAGE);
-		async_send_to_all(reinterpret_cast<void*>(&lib_message), sizeof(lib_message));
+template <typename Header, typename Metrics>
+void rudp::Socket<Header, Metrics>::reply_bad_protocol(const uint8_t* data, size_t size,
+                                                       const boost::asio::ip::udp::endpoint& endpoint) {
+	// Never in reply to a reply: two sockets would keep bouncing them.
+	if (size == sizeof(BAD_PROTOCOL_REPLY) && std::memcmp(data, BAD_PROTOCOL_REPLY, size) == 0) {
+		return;
+	}
+	if (m_bad_protocol_limiter.try_consume(m_now)) {
+		send_datagram(m_buffer_pool.acquire(BAD_PROTOCOL_REPLY, sizeof(BAD_PROTOCOL_REPLY)), endpoint);
+	}
+}
+
+template <typename T, typename Metrics>
+void rudp::Socket<T, Metrics>::start_receive() {
+	const uint32_t generation = m_receive_generation;
+	m_transport->async_receive([this, generation](const boost::system::error_code& ec, const rudp::Datagram* datagrams,
+	                                              size_t count) {
+		this->handle_receive(ec, datagrams, count, generation);
+	});
+}
+
+template <typename T, typename Metrics>
+void rudp::Socket<T, Metrics>::start_keep_alive() {
+	schedule_timer(m_now + std::chrono::seconds(DEFAULT_KEEP_ALIVE_WAIT), TimerEvent::KEEP_ALIVE, rudp::PeerHandle());
+}
+
+template <typename T, typename Metrics>
+void rudp::Socket<T, Metrics>::start_flush_timer() {
+	if (m_flush_timer_armed) {
+		return;
+	}
+
+	m_flush_timer_armed = true;
+	m_flush_timer.expires_from_now(boost::posix_time::microseconds(m_flush_delay.count()));
+	m_flush_timer.async_wait([this](auto ec) {
+		if (!ec) {
+			m_flush_timer_armed = false;
+			this->flush();
+		}
+	});
+}
+
+template <typename T, typename Metrics>
+rudp::TimerHandle rudp::Socket<T, Metrics>::schedule_timer(clock_type::time_point deadline, typename TimerEvent::Type type,
+                                                           rudp::PeerHandle peer) {
+	TimerEvent event;
+	event.type = type;
+	event.peer = peer;
+	const rudp::TimerHandle handle = m_timers.schedule(deadline, event);
+	start_timers(std::max(deadline, m_now));
+	return handle;
+}
+
+template <typename T, typename Metrics>
+void rudp::Socket<T, Metrics>::schedule_protocol_tick(const rudp::Peer& peer) {
+	if (!rudp::ProtocolState<T>::TICKED) {
+		return;
+	}
 
-		start_keep_alive();
+	PeerState& state = m_peer_states[peer.handle.index];
+	const clock_type::time_point deadline = state.protocol.next_tick();
+	if (deadline == clock_type::time_point::max()) {
+		return; // a pending timer finds nothing to do and is not rescheduled
 	}
+	if (m_timers.is_pending(state.protocol_timer)) {
+		if (state.protocol_deadline <= deadline) {
+			return;
+		}
+		m_timers.cancel(state.protocol_timer);
+	}
+	state.protocol_timer = schedule_timer(deadline, TimerEvent::PROTOCOL_TICK, peer.handle);
+	state.protocol_deadline = deadline;
 }
 
-template <typename T>
-void rudp::Socket<T>::start_receive() {
-	m_socket.async_receive_from(
-		boost::asio::buffer(m_recv_buf),
-		m_remote_endpoint,
-		[this](auto ec, auto bytes_transfered) {
-			this->handle_async_receive_from(ec, bytes_transfered);
+template <typename T, typename Metrics>
+void rudp::Socket<T, Metrics>::schedule_reassembly_timeout(const rudp::Peer& peer) {
+	PeerState& state = m_peer_states[peer.handle.index];
+	const clock_type::time_point deadline = state.reassembler.next_expiry();
+	if (deadline != clock_type::time_point::max() && !m_timers.is_pending(state.reassembly_timer)) {
+		state.reassembly_timer = schedule_timer(deadline, TimerEvent::REASSEMBLY_TIMEOUT, peer.handle);
+	}
+}
+
+template <typename T, typename Metrics>
+void rudp::Socket<T, Metrics>::start_timers(clock_type::time_point wakeup) {
+	if (!m_listening || wakeup >= m_timers_wakeup) {
+		return;
+	}
+
+	// Replaces the pending wait, if any: its handler is called with operation_aborted.
+	m_timers_wakeup = wakeup;
+	m_timers_timer.expires_at(wakeup);
+	m_timers_timer.async_wait([this](auto ec) {
+		if (!ec) {
+			this->handle_timers();
 		}
-	);
+	});
 }
 
-template <typename T>
-void rudp::Socket<T>::start_keep_alive() {
-	m_timer.expires_from_now(boost::posix_time::seconds(DEFAULT_KEEP_ALIVE_WAIT));
-	m_timer.async_wait([this](auto ec) {
-		this->handle_keep_alive();
+template <typename T, typename Metrics>
+void rudp::Socket<T, Metrics>::handle_timers() {
+	m_timers_wakeup = clock_type::time_point::max();
+	m_now = clock_type::now();
+	m_timers.advance(m_now, [this](rudp::TimerHandle, const TimerEvent& event) {
+		this->handle_timer(event);
 	});
+
+	if (!m_timers.empty()) {
+		start_timers(m_timers.next_wakeup());
+	}
+}
+
+template <typename T, typename Metrics>
+void rudp::Socket<T, Metrics>::handle_timer(const TimerEvent& event) {
+	if (event.type == TimerEvent::KEEP_ALIVE) {
+		if (m_listening) {
+			send_lib_message_to_all(KEEP_ALIVE_MESSAGE);
+			erase_if(m_pending_connects, [this](const auto& connect) {
+				return m_now - connect.second >= std::chrono::seconds(m_connection_timeout);
+			});
+			for (const auto& connect : m_pending_connects) {
+				send_handshake(CONNECTION_MESSAGE, connect.first, rudp::HandshakeCookie());
+			}
+			start_keep_alive();
+		}
+		return;
+	}
+
+	rudp::Peer* peer = m_peers.get(event.peer);
+	if (!peer) {
+		return;
+	}
+	PeerState& state = m_peer_states[peer->handle.index];
+
+	switch (event.type) {
+	case TimerEvent::PEER_TIMEOUT:
+		handle_peer_timeout(*peer);
+		break;
+	case TimerEvent::PROTOCOL_TICK: {
+		std::vector<rudp::SendBuffer> datagrams; // retransmissions, paced packets...
+		const bool ack_due = state.protocol.tick(m_now, m_buffer_pool, [&datagrams](rudp::SendBuffer datagram) {
+			datagrams.push_back(std::move(datagram));
+		});
+		send_datagrams(std::move(datagrams), peer->endpoint);
+		if (ack_due) { // nothing carried the acknowledgement since it became due
+			send_lib_message(ACK_MESSAGE, *peer);
+		}
+		schedule_protocol_tick(*peer);
+		break;
+	}
+	case TimerEvent::REASSEMBLY_TIMEOUT:
+		state.reassembler.expire(m_now, m_reassembly_budget);
+		schedule_reassembly_timeout(*peer);
+		break;
+	default:
+		break;
+	}
+}
+
+template <typename T, typename Metrics>
+void rudp::Socket<T, Metrics>::handle_peer_timeout(rudp::Peer& peer) {
+	// The timer is not moved on every packet: once it expires, it is rescheduled from the last packet
+	// if the peer has been heard from since, so that each peer costs at most one expiry per timeout.
+	const clock_type::time_point deadline = peer.last_packet_timestamp + std::chrono::seconds(m_connection_timeout);
+	if (m_now < deadline) {
+		m_peer_states[peer.handle.index].timeout_timer = schedule_timer(deadline, TimerEvent::PEER_TIMEOUT, peer.handle);
+		return;
+	}
+
+	m_metrics.on_timeout();
+	if (m_disconnection_timeout_handler) {
+		m_disconnection_timeout_handler(peer);
+	}
+	reset_peer_state(peer);
+	m_peers.erase(peer.handle);
 }
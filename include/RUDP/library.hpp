@@ -12,12 +12,18 @@
 #ifndef RELIABLEUDP_LIBRARY_HPP
 #define RELIABLEUDP_LIBRARY_HPP
 
+#include "Fec.hpp"
+#include "ImpairedTransport.hpp"
+#include "IoUringTransport.hpp"
+#include "Metrics.hpp"
 #include "Packet.hpp"
 #include "Peer.hpp"
+#include "ShardedSocket.hpp"
+#include "Snapshots.hpp"
 #include "Socket.hpp"
+#include "Transport.hpp"
 #include "protocols.hpp"
 #include "utility.hpp"
-
-// FIXME: beware endianness!
+#include "WireFormat.hpp"
 
 #endif //RELIABLEUDP_LIBRARY_HPP
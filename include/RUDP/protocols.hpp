@@ -13,6 +13,8 @@
 #define RELIABLEUDP_PROTOCOLS_HPP
 
 #include <cstdint> // uint8_t, uint16_t, uint32_t
+#include <limits> // std::numeric_limits
+#include <tuple>
 
 #include <boost/uuid/uuid.hpp>
 
@@ -20,6 +22,17 @@ namespace rudp {
 
 using protocol_type = uint32_t;
 
+// Identifies a connection in place of the sender's UUID once the handshake is done, see rudp::WireFormat.
+using connection_id_type = uint32_t;
+
+const connection_id_type NO_CONNECTION_ID = 0;
+
+// Lists, in wire order, the fields a Header carries besides `protocol` and `uuid`:
+// `static constexpr auto fields()` returns a tuple of pointers to unsigned integer members.
+// Every Header used with rudp::Socket shall specialize it.
+template <typename Header>
+struct HeaderFields;
+
 struct BasicHeader {
 	static protocol_type constexpr PROTOCOL_ID = 57986;
 
@@ -33,13 +46,21 @@ struct BasicHeader {
 	boost::uuids::uuid uuid;
 };
 
+template <>
+struct HeaderFields<BasicHeader> {
+	static constexpr auto fields() noexcept { return std::make_tuple(); }
+};
+
 struct TimeCriticalHeader {
 	static protocol_type constexpr PROTOCOL_ID = 57987;
 
-	TimeCriticalHeader() : protocol(PROTOCOL_ID) {}
+	TimeCriticalHeader() : TimeCriticalHeader(boost::uuids::uuid()) {}
 
+	// Acknowledges "the sequence before 0": nothing has been received yet.
 	TimeCriticalHeader(boost::uuids::uuid uuid)
 		: protocol(PROTOCOL_ID)
+		, sequence(0)
+		, ack(std::numeric_limits<uint16_t>::max())
 		, uuid(uuid) {}
 
 	protocol_type protocol;
@@ -48,13 +69,24 @@ struct TimeCriticalHeader {
 	boost::uuids::uuid uuid;
 };
 
+template <>
+struct HeaderFields<TimeCriticalHeader> {
+	static constexpr auto fields() noexcept {
+		return std::make_tuple(&TimeCriticalHeader::sequence, &TimeCriticalHeader::ack);
+	}
+};
+
 struct ReliableOrderHeader {
 	static protocol_type constexpr PROTOCOL_ID = 57988;
 
-	ReliableOrderHeader() : protocol(PROTOCOL_ID) {}
+	ReliableOrderHeader() : ReliableOrderHeader(boost::uuids::uuid()) {}
 
+	// Acknowledges "the sequence before 0": nothing has been received yet.
 	ReliableOrderHeader(boost::uuids::uuid uuid)
 		: protocol(PROTOCOL_ID)
+		, sequence(0)
+		, ack(std::numeric_limits<uint16_t>::max())
+		, ack_bits(0)
 		, uuid(uuid) {}
 
 	protocol_type protocol;
@@ -64,6 +96,55 @@ struct ReliableOrderHeader {
 	boost::uuids::uuid uuid;
 };
 
+template <>
+struct HeaderFields<ReliableOrderHeader> {
+	static constexpr auto fields() noexcept {
+		return std::make_tuple(&ReliableOrderHeader::sequence, &ReliableOrderHeader::ack, &ReliableOrderHeader::ack_bits);
+	}
+};
+
+// How the packets of a rudp::ChannelHeader channel are delivered.
+enum class DeliveryMode : uint8_t {
+	UNRELIABLE, // as received: possibly lost, duplicated or out of order
+	SEQUENCED, // newest wins, as with rudp::TimeCriticalHeader
+	RELIABLE // reliable and in order, as with rudp::ReliableOrderHeader
+};
+
+// Several independent streams per peer: `channel` picks the stream, `delivery` (a rudp::DeliveryMode) its
+// delivery mode, and `sequence`, `ack` and `ack_bits` belong to that channel only.
+// A channel keeps the delivery mode of its first packet.
+struct ChannelHeader {
+	static protocol_type constexpr PROTOCOL_ID = 57989;
+
+	ChannelHeader() : ChannelHeader(boost::uuids::uuid()) {}
+
+	// Acknowledges "the sequence before 0": nothing has been received yet.
+	ChannelHeader(boost::uuids::uuid uuid, uint8_t channel = 0, DeliveryMode delivery = DeliveryMode::RELIABLE)
+		: protocol(PROTOCOL_ID)
+		, channel(channel)
+		, delivery(static_cast<uint8_t>(delivery))
+		, sequence(0)
+		, ack(std::numeric_limits<uint16_t>::max())
+		, ack_bits(0)
+		, uuid(uuid) {}
+
+	protocol_type protocol;
+	uint8_t channel;
+	uint8_t delivery;
+	uint16_t sequence;
+	uint16_t ack;
+	uint32_t ack_bits;
+	boost::uuids::uuid uuid;
+};
+
+template <>
+struct HeaderFields<ChannelHeader> {
+	static constexpr auto fields() noexcept {
+		return std::make_tuple(&ChannelHeader::channel, &ChannelHeader::delivery, &ChannelHeader::sequence,
+		                       &ChannelHeader::ack, &ChannelHeader::ack_bits);
+	}
+};
+
 }
 
 #endif //RELIABLEUDP_PROTOCOLS_HPP
@@ -13,21 +13,46 @@
 #define RELIABLEUDP_UTILITY_HPP
 
 #include <string>
-#include <cstdint> // uint8_t, uint16_t, uint32_t
+#include <chrono>
+#include <cstddef> // size_t
+#include <cstdint> // uint8_t, uint16_t, uint32_t, uint64_t
+#include <cstring> // std::memcpy
 #include <limits> // std::numeric_limits
 
+#include "WireFormat.hpp"
+
 namespace rudp {
 
+// Monotonic clock used for every protocol timing (timeouts, round trip times...).
+using clock_type = std::chrono::steady_clock;
+
 template <typename T>
 bool sequence_more_recent(T s1, T s2) {
 	return (s1 > s2) && (s1 - s2 <= std::numeric_limits<T>::max() / 2)
 	       || (s2 > s1) && (s2 - s1 > std::numeric_limits<T>::max() / 2);
 }
 
+// out[i] = a[i] ^ b[i], 64 bits at a time, which compilers further vectorize. out may be a.
+inline void xor_bytes(uint8_t* out, const uint8_t* a, const uint8_t* b, size_t size) noexcept {
+	size_t i = 0;
+	for (; i + sizeof(uint64_t) <= size; i += sizeof(uint64_t)) {
+		uint64_t x;
+		uint64_t y;
+		std::memcpy(&x, a + i, sizeof(x));
+		std::memcpy(&y, b + i, sizeof(y));
+		x ^= y;
+		std::memcpy(out + i, &x, sizeof(x));
+	}
+	for (; i < size; ++i) {
+		out[i] = a[i] ^ b[i];
+	}
+}
+
+// The buffer shall hold rudp::header_size<Header>() + message.size() bytes.
 template <typename Header>
 void build_buffer(uint8_t* buffer, Header header, std::string message) {
-	std::copy((uint8_t *) &header, (uint8_t *) &header + sizeof(header), buffer);
-	std::copy(message.data(), message.data() + message.size(), buffer + sizeof(header));
+	const size_t header_size = WireFormat<Header>::write(buffer, header);
+	std::copy(message.data(), message.data() + message.size(), buffer + header_size);
 }
 
 }